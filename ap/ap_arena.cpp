@@ -0,0 +1,168 @@
+#include "ap_arena.h"
+#include "debug.h"
+
+#include <algorithm>
+
+/* Each allocation is preceded by a word that holds it's size, such that realloc knows how much to
+copy. The allocations start at 16 bytes alignment, so the size word lives in the padding at the
+end of the previous allocation. */
+
+#define SZ_WORD     sizeof(ap_sz_t)
+
+static ap_arena_block_t *get_block(ap_arena_t *arena, ap_off_t off) {
+    return (ap_arena_block_t *)ap_malloc_ptr(arena->parent, off);
+}
+
+static ap_sz_t &sz_word(ap_arena_t *arena, ap_off_t ptr) {
+    return *(ap_sz_t *)((uint8_t *)ap_malloc_ptr(arena->parent, ptr) - SZ_WORD);
+}
+
+static void use_block(ap_arena_t *arena, ap_off_t block) {
+    arena->block = block;
+    arena->cur = block ? block + sizeof(ap_arena_block_t) : 0;
+    arena->end = block ? block + get_block(arena, block)->sz : 0;
+    arena->last = 0;
+}
+
+static ap_off_t place(ap_arena_t *arena, ap_sz_t sz, ap_sz_t align) {
+    /* returns the position of a sz bytes object in the current block or 0 if it doesn't fit */
+    if (!arena->block)
+        return 0;
+    /* the address is aligned, not the offset, the region may be aligned to less than align */
+    uintptr_t base = (uintptr_t)arena->parent->region;
+    uintptr_t addr = (base + arena->cur + SZ_WORD + align - 1) & ~uintptr_t(align - 1);
+    ap_off_t ptr = addr - base;
+    if (ptr + sz > arena->end)
+        return 0;
+    return ptr;
+}
+
+static int next_block(ap_arena_t *arena, ap_sz_t sz, ap_sz_t align) {
+    /* the blocks after the current one are left from a release, they are reused if they are large
+    enaugh, else a new block is added after the current one */
+    ap_sz_t need = sizeof(ap_arena_block_t) + SZ_WORD + align + sz;
+    ap_off_t next = arena->block ? get_block(arena, arena->block)->next : arena->first;
+    if (next && get_block(arena, next)->sz >= need) {
+        use_block(arena, next);
+        return 0;
+    }
+
+    ap_sz_t block_sz = std::max(arena->block_sz, need);
+    ap_off_t block = ap_malloc_alloc(arena->parent, block_sz);
+    if (!block) {
+        DBG("Failed to allocate a block of %ld bytes for the arena", block_sz);
+        return -1;
+    }
+    /* the parent's region may have moved while it grew, the arena's ctx is resolved through the
+    parent anyway (see ap_malloc_ptr), this keeps the field itself current */
+    arena->ctx.region = arena->parent->region;
+
+    get_block(arena, block)->sz = block_sz;
+    get_block(arena, block)->next = next;
+    if (arena->block)
+        get_block(arena, arena->block)->next = block;
+    else
+        arena->first = block;
+    use_block(arena, block);
+    return 0;
+}
+
+int ap_arena_init(ap_arena_t *arena, ap_ctx_t *parent, ap_sz_t block_sz) {
+    *arena = ap_arena_t{};
+    arena->ctx.region = parent->region;
+    arena->ctx.add_mem_fn = NULL;
+    arena->ctx.arena = arena;
+    arena->parent = parent;
+    arena->block_sz = block_sz;
+    ASSERT_FN(ap_malloc_register_ctx(&arena->ctx));
+    return 0;
+}
+
+void ap_arena_uninit(ap_arena_t *arena) {
+    ap_off_t block = arena->first;
+    while (block) {
+        ap_off_t next = get_block(arena, block)->next;
+        ap_malloc_free(arena->parent, block);
+        block = next;
+    }
+    ap_malloc_unregister_ctx(&arena->ctx);
+    arena->first = 0;
+    use_block(arena, 0);
+}
+
+ap_off_t ap_arena_alloc(ap_arena_t *arena, ap_sz_t sz, ap_sz_t align) {
+    if (align & (align - 1)) {
+        DBG("Alignment must be a power of 2: %ld", align);
+        return 0;
+    }
+    align = std::max(align, ap_sz_t(16));
+    sz = std::max(sz, ap_sz_t(1));
+    ap_off_t ptr = place(arena, sz, align);
+    if (!ptr) {
+        if (next_block(arena, sz, align) < 0)
+            return 0;
+        ptr = place(arena, sz, align);
+    }
+    sz_word(arena, ptr) = sz;
+    arena->cur = ptr + sz;
+    arena->last = ptr;
+    return ptr;
+}
+
+void ap_arena_free(ap_arena_t *arena, ap_off_t ptr) {
+    if (!ptr || ptr != arena->last)
+        return ;
+    arena->cur = ptr - SZ_WORD;
+    arena->last = 0;
+}
+
+ap_sz_t ap_arena_usable_sz(ap_arena_t *arena, ap_off_t ptr) {
+    return sz_word(arena, ptr);
+}
+
+int ap_arena_realloc_inplace(ap_arena_t *arena, ap_off_t ptr, ap_sz_t sz) {
+    if (!ptr || !sz)
+        return -1;
+    if (ptr == arena->last && ptr + sz <= arena->end) {
+        sz_word(arena, ptr) = sz;
+        arena->cur = ptr + sz;
+        return 0;
+    }
+    return sz <= sz_word(arena, ptr) ? 0 : -1;
+}
+
+ap_off_t ap_arena_realloc(ap_arena_t *arena, ap_off_t ptr, ap_sz_t sz) {
+    if (!ptr)
+        return ap_arena_alloc(arena, sz);
+    if (!sz) {
+        ap_arena_free(arena, ptr);
+        return 0;
+    }
+    if (ap_arena_realloc_inplace(arena, ptr, sz) == 0)
+        return ptr;
+
+    ap_sz_t old_sz = sz_word(arena, ptr);
+    ap_off_t ret = ap_arena_alloc(arena, sz);
+    if (!ret)
+        return 0;
+    memcpy(ap_malloc_ptr(arena->parent, ret), ap_malloc_ptr(arena->parent, ptr),
+            std::min(old_sz, sz));
+    return ret;
+}
+
+ap_arena_mark_t ap_arena_mark(ap_arena_t *arena) {
+    return ap_arena_mark_t{ .block = arena->block, .cur = arena->cur };
+}
+
+void ap_arena_release(ap_arena_t *arena, ap_arena_mark_t mark) {
+    if (!mark.block) {
+        ap_arena_reset(arena);
+        return ;
+    }
+    use_block(arena, mark.block);
+    arena->cur = mark.cur;
+}
+
+void ap_arena_reset(ap_arena_t *arena) {
+    use_block(arena, arena->first);
+}
@@ -0,0 +1,89 @@
+#ifndef AP_ARENA_H
+#define AP_ARENA_H
+
+#include "ap_malloc.h"
+
+/* Bump allocator on top of an ap_ctx_t, for data that is built in one go and dropped together.
+The arena takes large blocks from the parent ctx and hands out pieces of them by moving a pointer,
+a free does nothing and the whole arena is released at once, by rewinding it to a mark or to it's
+start. The blocks are kept for reuse until ap_arena_uninit gives them back to the parent.
+
+The arena has it's own ap_ctx_t that shares the region of the parent, the containers can be
+initialized against &arena->ctx and then all their allocations are served by the arena (the
+ap_malloc_* functions forward to it). Offsets from the arena are offsets in the parent's region,
+ap_malloc_ptr and ap_malloc_off take the region from the parent, so it may move as it grows.
+The ctx id of the arena is registered only for this process, so data that lives in an arena is
+scratch data, it can't be found again after the region is reopened.
+
+An arena is not thread safe and the parent must not be compacted while the arena is in use, as
+the arena holds the offsets of it's blocks. */
+
+#define AP_ARENA_BLOCK_SZ   (256 * 1024)
+
+/* each block starts with this header, the blocks are linked in the order they where added */
+struct ap_arena_block_t {
+    ap_off_t next;
+    ap_sz_t sz;
+};
+
+struct ap_arena_t {
+    ap_ctx_t ctx;
+    ap_ctx_t *parent;
+    ap_sz_t block_sz;
+
+    ap_off_t first;         /* first block */
+    ap_off_t block;         /* the block that is currently used */
+    ap_off_t cur;           /* next free byte in block */
+    ap_off_t end;           /* end of block */
+    ap_off_t last;          /* last allocation, only this one can grow in place */
+};
+
+/* a position in the arena, everything allocated after it can be released with ap_arena_release */
+struct ap_arena_mark_t {
+    ap_off_t block;
+    ap_off_t cur;
+};
+
+int ap_arena_init(ap_arena_t *arena, ap_ctx_t *parent, ap_sz_t block_sz = AP_ARENA_BLOCK_SZ);
+
+/* gives all the blocks back to the parent and unregisters the arena's ctx */
+void ap_arena_uninit(ap_arena_t *arena);
+
+/* align must be a power of 2, the allocations are at least 16 bytes aligned */
+ap_off_t ap_arena_alloc(ap_arena_t *arena, ap_sz_t sz, ap_sz_t align = 16);
+
+/* only the last allocation is given back, for the others this does nothing */
+void ap_arena_free(ap_arena_t *arena, ap_off_t ptr);
+
+/* grows the last allocation in place or moves the object to a new allocation, the old one is not
+given back. Returns 0 on failure, as ap_malloc_realloc. */
+ap_off_t ap_arena_realloc(ap_arena_t *arena, ap_off_t ptr, ap_sz_t sz);
+
+/* returns 0 if ptr now holds sz bytes, -1 otherwise */
+int ap_arena_realloc_inplace(ap_arena_t *arena, ap_off_t ptr, ap_sz_t sz);
+
+/* the size that was requested for ptr, or the size it was grown to */
+ap_sz_t ap_arena_usable_sz(ap_arena_t *arena, ap_off_t ptr);
+
+ap_arena_mark_t ap_arena_mark(ap_arena_t *arena);
+
+/* drops everything allocated after mark, in O(1), the blocks stay with the arena. Objects that
+own memory outside the arena must be uninitialized before. */
+void ap_arena_release(ap_arena_t *arena, ap_arena_mark_t mark);
+
+/* drops all the allocations, in O(1) */
+void ap_arena_reset(ap_arena_t *arena);
+
+/* the allocations done while the scope is alive are released when it ends, scopes can be nested */
+struct ap_arena_scope_t {
+    ap_arena_t *arena;
+    ap_arena_mark_t mark;
+
+    ap_arena_scope_t(ap_arena_t *arena) : arena(arena), mark(ap_arena_mark(arena)) {}
+    ~ap_arena_scope_t() { ap_arena_release(arena, mark); }
+
+    ap_arena_scope_t(const ap_arena_scope_t&) = delete;
+    ap_arena_scope_t &operator = (const ap_arena_scope_t&) = delete;
+};
+
+#endif
@@ -110,6 +110,11 @@ struct ap_hashmap_t {
     struct bucket_t {
         ap::hmap_list_t nodes;
         uint32_t cnt = 0;
+
+        void reloc(const ap_malloc_reloc_table_t *table) {
+            nodes.o.set_first(ap_malloc_reloc_off(table, nodes.o.get_first()));
+            nodes.o.set_last(ap_malloc_reloc_off(table, nodes.o.get_last()));
+        }
     };
 
     /* TODO: alloc and free nodes with ap_malloc */
@@ -140,8 +145,10 @@ private:
 #endif
     int init(ap_ctx_t *ctx) {
         ASSERT_FN(buckets.init(ctx));
-        resize(INITIAL_BUCKET_CNT); /* hardcoded initial */
+        /* the list must be empty before resize walks it */
+        elems = ap::hmap_glist_t{};
         elems.o.ctx_id = buckets.ctx_id;
+        resize(INITIAL_BUCKET_CNT); /* hardcoded initial */
         /* buckets.ctx_id - must be given to each list */
         return 0;
     }
@@ -160,44 +167,31 @@ public:
 
 /* TODO: all the members bellow should be internals */
     void resize(uint32_t newsz) {
-        ap_ctx_t *ctx = ap_malloc_get_ctx(buckets.ctx_id);
-        if (!ctx)
-            return ;
-
-        ap_vector_t<bucket_t> old_buckets = buckets;
-        ap_vector_t<bucket_t> new_buckets;
-        new_buckets.init(ctx);
-        new_buckets.resize(newsz);
-        buckets = new_buckets;
-
-        for (auto &buck : new_buckets) {
+        /* all the nodes are in elems, so the buckets are made again empty and filled from it */
+        buckets.clear();
+        buckets.resize(newsz);
+        for (auto &buck : buckets)
             buck.nodes.o.ctx_id = buckets.ctx_id;
-        }
 
-        for (auto &buck : old_buckets) {
-            auto curr = buck.nodes.front();
-            while (curr) {
-                auto next = buck.nodes.next(curr);
-                buck.nodes.pop_front();
-                insert(curr);
-                curr = next;
-            }
+        auto curr = elems.front();
+        while (curr) {
+            bucket_add(curr);
+            curr = elems.next(curr);
         }
+    }
 
-        old_buckets.uninit();
+    bucket_t &bucket_add(ap_off_t hn) {
+        auto &buck = buckets[ap::ap_hash(deref_hnode(hn)->key) % buckets.size()];
+        buck.nodes.push_front(hn);
+        buck.cnt++;
+        return buck;
     }
 
     void insert(ap_off_t hn) {
-        ap_ctx_t *ctx = ap_malloc_get_ctx(buckets.ctx_id);
-        if (!ctx)
+        if (!ap_malloc_get_ctx(buckets.ctx_id))
             return ;
-        hmap_node_t *node = (hmap_node_t *)ap_malloc_ptr(ctx, hn);
-        uint32_t slot = (ap::ap_hash(node->key)) % buckets.size();
-        auto &buck = buckets[slot];
-        buck.nodes.push_front(hn);
-        buck.cnt++;
         elems.push_front(hn);
-        if (buck.cnt > MAX_BUCKET_CNT)
+        if (bucket_add(hn).cnt > MAX_BUCKET_CNT)
             resize(buckets.size() * 2);
     }
 
@@ -223,6 +217,7 @@ public:
             return 0;
         elems.remove(node);
         buckets[slot].nodes.remove(node);
+        buckets[slot].cnt--;
         return node;
     }
 
@@ -247,6 +242,27 @@ public:
         return (hmap_node_t *)ap_malloc_ptr(ctx, off);
     }
 
+    /* after ap_malloc_compact, replaces the offsets of the buckets, of the nodes and the ones owned
+    by the keys and values. Each node is reached through the list of all the nodes. */
+    void reloc(const ap_malloc_reloc_table_t *table) {
+        buckets.reloc(table);
+        elems.o.set_first(ap_malloc_reloc_off(table, elems.o.get_first()));
+        elems.o.set_last(ap_malloc_reloc_off(table, elems.o.get_last()));
+        auto curr = elems.o.get_first();
+        while (curr) {
+            hmap_node_t *node = deref_hnode(curr);
+            node->next = ap_malloc_reloc_off(table, node->next);
+            node->prev = ap_malloc_reloc_off(table, node->prev);
+            node->gnext = ap_malloc_reloc_off(table, node->gnext);
+            node->gprev = ap_malloc_reloc_off(table, node->gprev);
+            if constexpr (requires (Key &key) { key.reloc(table); })
+                node->key.reloc(table);
+            if constexpr (requires (Val &val) { val.reloc(table); })
+                node->val.reloc(table);
+            curr = node->gnext;
+        }
+    }
+
     void iter(void *uctx, iter_fn_t iter_fn) {
         ap_ctx_t *ctx = ap_malloc_get_ctx(buckets.ctx_id);
         if (!ctx)
@@ -1,12 +1,23 @@
 #include "ap_malloc.h"
+#include "ap_arena.h"
 #include "debug.h"
 #include "misc_utils.h"
 #include "bit_utils.h"
 #include "time_utils.h"
+#include "gavl.h"
 
 #include <unordered_map>
-
-#define AP_MALLOC_MAGIC     0xd0caffe
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* the low half of the magic marks an ap_malloc region, the high half is the version of it's layout
+(mem_hdr_t, the borders, INIT_OFF), it changes with it. A region of another version is not read */
+#define AP_MALLOC_MAGIC_ID  0xd0caffeULL
+#define AP_MALLOC_VERSION   2
+#define AP_MALLOC_MAGIC     (AP_MALLOC_MAGIC_ID | (uint64_t(AP_MALLOC_VERSION) << 32))
 #define ALIGNMENT           16
 #define PAGE_SZ             4096
 #define SZ_DIV_ASK          (16 * PAGE_SZ)
@@ -16,19 +27,43 @@
 #define INIT_OFF            (((sizeof(mem_hdr_t) + BOREDR_SZ) / 16 + 1) * 16 - BOREDR_SZ)
 #define CB_ALIGN_OFF        (BOREDR_SZ % 16 ? (16 - BOREDR_SZ % 16) : 0)
 
+#define SBIN_CNT            16
+#define SBIN_CHUNK_SZ       4096
+#define SBIN_BMAP_WORDS     4
+
+/* the most borders a single operation on a shared region can change: growing the region (the old
+and the new last border and the free tail), fitting a chunk in a free one (the free chunk, the
+split rest, the chunk after it and the free chunk the rest merges with) and aligning it (the
+aligned chunk, the free chunk before it and the second split rest). A free touches the chunk and
+the ones around it, at most JRNL_FREE_BORDERS, and a realloc frees, fits or grows in place less
+than an aligned alloc that grows the region. Compaction and trim are not done on shared regions */
+#define JRNL_GROW_BORDERS   3
+#define JRNL_FIT_BORDERS    4
+#define JRNL_ALIGN_BORDERS  3
+#define JRNL_FREE_BORDERS   4
+#define JRNL_MAX_BORDERS    (JRNL_GROW_BORDERS + JRNL_FIT_BORDERS + JRNL_ALIGN_BORDERS)
+#define JRNL_CNT            32
+
+#define TCACHE_CTX_CNT      4
+#define TCACHE_MAX          64
+#define TCACHE_BATCH        32
+
+#define FREE_LIST_CNT       64
+#define TREE_MIN_SZ         (FREE_LIST_CNT * 16)
+
 #define PACKED_STRUCT       __attribute__((packed))
 
 /* TODO: replace /16 %16 with >>4 &0xf */
 
 struct PACKED_STRUCT border_sz_t {
     ap_sz_t is_free : 1;
-    ap_sz_t is_node : 1; // this is for nodes in the avl tree(not implemented)
-    ap_sz_t is_sbin : 1; // this bit is allways 0 except for small bins(not implemented)
-    ap_sz_t reserve : 5;
+    ap_sz_t is_node : 1; // this is set for free chunks that are nodes in the free avl tree
+    ap_sz_t is_sbin : 1; // this bit is allways 0 except for small bins
+    ap_sz_t is_rel  : 1; // set for free chunks whose inner pages were given back by a trim
+    ap_sz_t algn    : 4; // for aligned chunks, see chunk_align
     ap_sz_t sz      : ((sizeof(ap_sz_t) - 1) * 8);
 };
 
-/* TODO: create chunk borders that are nodes in an avl */
 struct PACKED_STRUCT chunk_border_t {
     ap_sz_t     prev_sz;
     border_sz_t sz;
@@ -36,6 +71,23 @@ struct PACKED_STRUCT chunk_border_t {
     ap_off_t    next_free;
 };
 
+/* Free chunks of at least TREE_MIN_SZ are kept in an avl tree sorted by (size, offset) instead of
+a list, the node fields overlap the user space of the chunk, the same as prev_free/next_free do */
+struct PACKED_STRUCT chunk_node_t {
+    ap_sz_t     prev_sz;
+    border_sz_t sz;
+    ap_off_t    left;
+    ap_off_t    right;
+    int64_t     height;
+};
+
+/* the state of a chunk border before the current operation changed it */
+struct jrnl_entry_t {
+    ap_off_t    off;
+    ap_sz_t     prev_sz;
+    border_sz_t sz;
+};
+
 struct mem_hdr_t {
     uint64_t null;         // nothing can point here
     uint64_t magic;
@@ -45,21 +97,116 @@ struct mem_hdr_t {
 
     ap_off_t usr_slot;
 
-    /* TODO: solution - implement an avl */
-    /* TODO: find a way to fix this, it can work really badly, meaning a lot of subsized free
-    pieces can stand inside the list apriori of the searched node */
+    /* free chunks smaller than TREE_MIN_SZ are held in exact size lists, free_lists[sz / 16],
+    and free_bmap marks the non-empty lists, the rest of the free chunks are in the free tree */
     uint64_t free_bmap;
-    ap_off_t free_lists[64];
+    ap_off_t free_lists[FREE_LIST_CNT];
+    ap_off_t free_root;
+
+    /* lists of small bins that still have free slots, one list for each slot size */
+    ap_off_t sbin_lists[SBIN_CNT];
+
+    /* used with AP_MALLOC_FLAG_THREAD_SAFE or AP_MALLOC_FLAG_SHARED, it is reinitialized on each
+    init, except for shared regions, where it is a robust process shared lock */
+    pthread_mutex_t lock;
+
+    /* undo journal of the current operation, used only for shared regions */
+    uint32_t jrnl_on;
+    uint32_t jrnl_cnt;
+    ap_sz_t jrnl_sz;
+    uint32_t jrnl_lost;    // a border was changed without being saved, the region can't be undone
+    uint32_t jrnl_pad;
+    jrnl_entry_t jrnl[JRNL_CNT];
+
+    /* counters for ap_malloc_stats, the ones about the free chunks and the chunk counts can be
+    found again by walking the region */
+    ap_sz_t free_bytes;
+    ap_sz_t free_bytes_l2[64];
+    uint64_t chunk_cnt;
+    uint64_t free_chunk_cnt;
+    uint64_t sbin_cnt;
+    uint64_t sbin_used_slots;
+    uint64_t alloc_cnt;
+    uint64_t free_cnt;
+    uint64_t search_cnt;
+    uint64_t search_steps;
+    ap_sz_t released_bytes;
+    ap_sz_t trimmed_bytes;
+    ap_sz_t refault_bytes;
+};
+
+/* A small bin is a normal chunk (that has is_sbin set in it's border) that is split into equal
+slots. Each slot is prefixed by a border_sz_t tag that has is_sbin set and sz holding the distance
+from the slot to the start of the small bin, so a free can find the bin in O(1). Slots have a
+stride of 16 * (cls + 1) bytes and hold at most stride - sizeof(border_sz_t) bytes. The header is
+8 bytes off the 16 alignment such that after the tag the user data is 16 bytes aligned. */
+struct sbin_hdr_t {
+    ap_off_t next;
+    ap_off_t prev;
+    uint32_t cls;
+    uint32_t free_cnt;
+    uint32_t slot_cnt;
+    uint32_t reserved;
+    uint64_t free_slots[SBIN_BMAP_WORDS];   /* a set bit is a free slot */
+    uint64_t pad;
 };
 
 static_assert(sizeof(mem_hdr_t) < INIT_OFF);
 static_assert(sizeof(chunk_border_t) % 16 == 0);
+static_assert(sizeof(chunk_node_t) - BOREDR_SZ <= TREE_MIN_SZ);
+static_assert(sizeof(sbin_hdr_t) % 16 == sizeof(border_sz_t));
+static_assert(SBIN_CNT * 16 - sizeof(border_sz_t) == AP_MALLOC_SBIN_MAX_SZ);
+static_assert((SBIN_CHUNK_SZ - sizeof(sbin_hdr_t)) / 16 <= SBIN_BMAP_WORDS * 64);
+static_assert(JRNL_MAX_BORDERS <= JRNL_CNT);
 
 static std::unordered_map<ap_ctx_id_t, ap_ctx_t *> id_ctx_map;
+ap_ctx_slot_t ap_ctx_slots[AP_CTX_SLOT_CNT];
+
+/* Per thread cache of small bin slots, for AP_MALLOC_FLAG_THREAD_SAFE. A thread can cache slots
+for at most TCACHE_CTX_CNT regions at a time, the rest of the regions are used directly. */
+struct tcache_bin_t {
+    uint32_t cnt;
+    ap_off_t offs[TCACHE_MAX];
+};
+
+struct tcache_t {
+    ap_ctx_t *ctx;
+    ap_ctx_id_t ctx_id;
+    tcache_bin_t bins[SBIN_CNT];
+};
+
+struct tcache_list_t {
+    tcache_t caches[TCACHE_CTX_CNT];
+
+    ~tcache_list_t();
+};
+
+static thread_local tcache_list_t tcaches;
+
+/* takes the region's lock if the ctx needs one, err is set if the lock could not be taken */
+struct ctx_lock_t {
+    ap_ctx_t *ctx = NULL;
+    int err = 0;
+
+    ctx_lock_t(ap_ctx_t *ctx);
+    ~ctx_lock_t();
+};
 
 static ap_ctx_id_t generate_ctx_id() {
     ap_ctx_id_t ret = (1ULL << (sizeof(ap_ctx_id_t) * 8 - 1));
-    return ret + get_time_us();
+    ret += get_time_us();
+
+    /* the low bits are replaced with the index of a free slot, if there is one */
+    for (ap_ctx_id_t i = 0; i < AP_CTX_SLOT_CNT; i++) {
+        ap_ctx_id_t idx = (ret + i) & (AP_CTX_SLOT_CNT - 1);
+        if (!ap_ctx_slots[idx].id) {
+            ret = (ret & ~ap_ctx_id_t(AP_CTX_SLOT_CNT - 1)) | idx;
+            break;
+        }
+    }
+    while (HAS(id_ctx_map, ret))
+        ret += AP_CTX_SLOT_CNT;
+    return ret;
 }
 
 static chunk_border_t *get_first_border(ap_ctx_t *ctx) {
@@ -96,14 +243,131 @@ static void *get_ptr(ap_ctx_t *ctx, ap_off_t off) {
     return (uint8_t *)ctx->region + off;
 }
 
-static void remove_from_free_list(ap_ctx_t *ctx, chunk_border_t *cb) {
-    uint32_t l2 = log2_64(cb->sz.sz);
+static void jrnl_border(ap_ctx_t *ctx, chunk_border_t *cb) {
+    /* saves the border before it is changed for the first time in the current operation, the
+    fences make sure that the compiler doesn't move the change before the entry is counted */
     auto hdr = (mem_hdr_t *)ctx->region;
-    auto &first_free = hdr->free_lists[l2];
+    if (!(ctx->flags & AP_MALLOC_FLAG_SHARED) || !hdr->jrnl_on)
+        return ;
+    ap_off_t off = get_offset(ctx, cb);
+    for (uint32_t i = 0; i < hdr->jrnl_cnt; i++)
+        if (hdr->jrnl[i].off == off)
+            return ;
+    if (hdr->jrnl_cnt == JRNL_CNT) {
+        /* can't happen while JRNL_MAX_BORDERS holds, if it does anyway the region is lost if the
+        owner dies before the operation ends */
+        DBG("The border journal is full, the region can't be recovered until the operation ends");
+        hdr->jrnl_lost = true;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        return ;
+    }
+    hdr->jrnl[hdr->jrnl_cnt] = jrnl_entry_t{ .off = off, .prev_sz = cb->prev_sz, .sz = cb->sz };
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    hdr->jrnl_cnt++;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+namespace ap
+{
+    /* the nodes of the free tree are the offsets of the chunk borders */
+    struct free_avl_ctx_t {
+        using ptr_t = ap_off_t;
+
+        ap_ctx_t *ctx = NULL;
+
+        ptr_t       get_root_fn   () const                      { return hdr()->free_root; }
+        void        set_root_fn   (ptr_t r)                     { hdr()->free_root = r; }
+        ptr_t       get_left_fn   (ptr_t node) const            { return get_node(node)->left; }
+        void        set_left_fn   (ptr_t node, ptr_t newn)      { get_node(node)->left = newn; }
+        ptr_t       get_right_fn  (ptr_t node) const            { return get_node(node)->right; }
+        void        set_right_fn  (ptr_t node, ptr_t newn)      { get_node(node)->right = newn; }
+        int         get_height_fn (ptr_t node) const            { return get_node(node)->height; }
+        void        set_height_fn (ptr_t node, int height)      { get_node(node)->height = height; }
+
+        /* cmp is as strcmp, the offset makes all keys unique */
+        int cmp_fn(ptr_t a, ptr_t b) {
+            ap_sz_t sza = get_node(a)->sz.sz;
+            ap_sz_t szb = get_node(b)->sz.sz;
+            if (sza != szb)
+                return sza < szb ? -1 : 1;
+            return a < b ? -1 : (a > b ? 1 : 0);
+        }
+
+        void same_key_cbk(ptr_t, ptr_t) {
+            DBG("Chunk is already in the free tree");
+        }
+
+        mem_hdr_t *hdr() const {
+            return (mem_hdr_t *)ctx->region;
+        }
+
+        chunk_node_t *get_node(ptr_t n) const {
+            return (chunk_node_t *)((uint8_t *)ctx->region + n);
+        }
+    };
+}
+
+using free_avl_t = generic_avl_t<ap::free_avl_ctx_t>;
+
+static free_avl_t get_free_avl(ap_ctx_t *ctx) {
+    free_avl_t avl;
+    avl.o.ctx = ctx;
+    return avl;
+}
+
+static ap_sz_t region_page_sz(ap_ctx_t *ctx) {
+    /* the unit in which the memory is given to and taken back from the region */
+    return (ctx->flags & AP_MALLOC_FLAG_HUGE_PAGES) ? AP_MALLOC_HUGE_PAGE_SZ : AP_MALLOC_PAGE_SZ;
+}
+
+static ap_sz_t released_range(ap_ctx_t *ctx, chunk_border_t *cb, uintptr_t *start) {
+    /* the pages of a free chunk that can be given back, the ones that hold it's header and the next
+    border are kept */
+    ap_sz_t page_sz = region_page_sz(ctx);
+    *start = ((uintptr_t)cb + sizeof(chunk_node_t) + page_sz - 1) & ~uintptr_t(page_sz - 1);
+    uintptr_t end = (uintptr_t)next_border(cb) & ~uintptr_t(page_sz - 1);
+    return end > *start ? end - *start : 0;
+}
+
+static ap_sz_t released_sz(ap_ctx_t *ctx, chunk_border_t *cb) {
+    uintptr_t start;
+    return released_range(ctx, cb, &start);
+}
+
+static int sz_log2(ap_sz_t sz) {
+    return sz ? 63 - __builtin_clzll(sz) : 0;
+}
+
+static void count_free(mem_hdr_t *hdr, ap_sz_t sz, int64_t dir) {
+    hdr->free_bytes += dir * sz;
+    hdr->free_bytes_l2[sz_log2(sz)] += dir * sz;
+    hdr->free_chunk_cnt += dir;
+}
 
-    // DBG("Remove %lx from %d", get_offset(ctx, cb), l2);
+static void remove_from_free_list(ap_ctx_t *ctx, chunk_border_t *cb) {
+    auto hdr = (mem_hdr_t *)ctx->region;
 
+    jrnl_border(ctx, cb);
+    count_free(hdr, cb->sz.sz, -1);
+    if (cb->sz.is_rel) {
+        hdr->released_bytes -= released_sz(ctx, cb);
+        cb->sz.is_rel = false;
+    }
     cb->sz.is_free = false;
+    if (cb->sz.is_node) {
+        ap_off_t removed = 0;
+        get_free_avl(ctx).remove(get_offset(ctx, cb), &removed);
+        if (removed != get_offset(ctx, cb))
+            DBG("Chunk %lx was not in the free tree", get_offset(ctx, cb));
+        cb->sz.is_node = false;
+        return ;
+    }
+
+    uint32_t idx = cb->sz.sz / 16;
+    auto &first_free = hdr->free_lists[idx];
+
+    // DBG("Remove %lx from %d", get_offset(ctx, cb), idx);
+
     if (cb->prev_free)
         ((chunk_border_t *)get_ptr(ctx, cb->prev_free))->next_free = cb->next_free;
     if (cb->next_free)
@@ -111,27 +375,68 @@ static void remove_from_free_list(ap_ctx_t *ctx, chunk_border_t *cb) {
     if (get_offset(ctx, cb) == first_free) {
         first_free = cb->next_free;
         if (!first_free)
-            hdr->free_bmap &= ~(1 << l2);
+            hdr->free_bmap &= ~(1ULL << idx);
     }
 }
 
 static void add_to_free_list(ap_ctx_t *ctx, chunk_border_t *cb) {
-    uint32_t l2 = log2_64(cb->sz.sz);
     auto hdr = (mem_hdr_t *)ctx->region;
-    auto &first_free = hdr->free_lists[l2];
-    hdr->free_bmap |= (1 << l2);
 
-    // DBG("Insert %lx to %d", get_offset(ctx, cb), l2);
+    jrnl_border(ctx, cb);
+    count_free(hdr, cb->sz.sz, 1);
+    cb->sz.is_free = true;
+    cb->sz.is_rel = false;
+    cb->sz.algn = 0;
+    if (cb->sz.sz >= TREE_MIN_SZ) {
+        /* the tree doesn't initialize a node that becomes the root */
+        auto node = (chunk_node_t *)cb;
+        node->left = 0;
+        node->right = 0;
+        node->height = 1;
+        cb->sz.is_node = true;
+        get_free_avl(ctx).insert(get_offset(ctx, cb));
+        return ;
+    }
+
+    uint32_t idx = cb->sz.sz / 16;
+    auto &first_free = hdr->free_lists[idx];
+    hdr->free_bmap |= (1ULL << idx);
+
+    // DBG("Insert %lx to %d", get_offset(ctx, cb), idx);
 
     if (first_free)
         ((chunk_border_t *)get_ptr(ctx, first_free))->prev_free = get_offset(ctx, cb);
     cb->next_free = first_free;
     cb->prev_free = 0;
     first_free = get_offset(ctx, cb);
-    cb->sz.is_free = true;
 }
 
-static chunk_border_t *split_chunk(chunk_border_t *cb, ap_sz_t split_loc) {
+static chunk_border_t *find_best_fit(ap_ctx_t *ctx, ap_sz_t sz) {
+    /* the smallest free chunk that can hold sz, if there is an exact size list with a fitting
+    chunk it is used, else the successor of (sz, 0) in the free tree */
+    auto hdr = (mem_hdr_t *)ctx->region;
+
+    hdr->search_cnt++;
+    hdr->search_steps++;
+    if (sz < TREE_MIN_SZ) {
+        uint64_t bmap = hdr->free_bmap >> (sz / 16);
+        if (bmap)
+            return (chunk_border_t *)get_ptr(ctx,
+                    hdr->free_lists[sz / 16 + __builtin_ctzll(bmap)]);
+    }
+
+    /* (sz, 0) is smaller than any node of size sz, so it's successor is the best fit, each visited
+    node is a step of the search */
+    struct key_t { ap_ctx_t *ctx; ap_sz_t sz; };
+    auto avl = get_free_avl(ctx);
+    ap_off_t best = avl.get_succ([](const key_t &key, ap_off_t node) {
+        ((mem_hdr_t *)key.ctx->region)->search_steps++;
+        return ((chunk_node_t *)get_ptr(key.ctx, node))->sz.sz < key.sz ? 1 : -1;
+    }, key_t{ctx, sz});
+    return best ? (chunk_border_t *)get_ptr(ctx, best) : NULL;
+}
+
+static chunk_border_t *split_chunk(ap_ctx_t *ctx, chunk_border_t *cb, ap_sz_t split_loc) {
     /* splits the current chunk into two chunks, the first one will remain the current chunk and
     the second one will be returned, split_loc must reside in the usr space of the old chunk and
     it will be the usr space of the new chunk */
@@ -142,10 +447,17 @@ static chunk_border_t *split_chunk(chunk_border_t *cb, ap_sz_t split_loc) {
     if (split_loc < BOREDR_SZ)
         DBG("OOOPS");
 
+    jrnl_border(ctx, cb);
+    jrnl_border(ctx, new_cb);
+    jrnl_border(ctx, next_cb);
+    ((mem_hdr_t *)ctx->region)->chunk_cnt++;
+
     ap_sz_t old_sz1 = cb->sz.sz;
     ap_sz_t new_sz1 = split_loc - BOREDR_SZ;
     ap_sz_t new_sz2 = old_sz1 - split_loc;
 
+    /* the new border is placed over old user data, so all it's bits must be cleared */
+    new_cb->sz = border_sz_t{};
     new_cb->sz.sz = new_sz2;
     next_cb->prev_sz = new_sz2;
 
@@ -155,120 +467,617 @@ static chunk_border_t *split_chunk(chunk_border_t *cb, ap_sz_t split_loc) {
     return new_cb;
 }
 
-/* we assume a, b are free, b is not the last chunk border */
+/* we assume b is free and is not the last chunk border, a is free or is being grown */
 static chunk_border_t *merge_chunks(ap_ctx_t *ctx, chunk_border_t *a, chunk_border_t *b) {
     auto next_cb = next_border(b);
+    jrnl_border(ctx, a);
+    jrnl_border(ctx, b);
+    jrnl_border(ctx, next_cb);
+    ((mem_hdr_t *)ctx->region)->chunk_cnt--;
     next_cb->prev_sz = a->sz.sz + BOREDR_SZ + b->sz.sz;
     a->sz.sz = next_cb->prev_sz;
     return a;
 }
 
-static ap_off_t try_alloc_in_free(ap_ctx_t *ctx, size_t sz) {
-    auto hdr = (mem_hdr_t *)ctx->region;
-
-    if (sz % 16 != 0)
-        sz = (sz / 16 + 1) * 16;
-
-    /* first we will try to look in the list of similar sizes  */
-    uint32_t l2 = log2_64(sz);
-    ap_off_t curr_free = hdr->free_lists[l2];
-    bool found = false;
-
-    while (curr_free) {
-        auto cb = (chunk_border_t *)get_ptr(ctx, curr_free);
-        if (cb->sz.sz >= sz)
-            break;
-        curr_free = cb->next_free;
+static void shrink_chunk(ap_ctx_t *ctx, chunk_border_t *cb, ap_sz_t sz) {
+    /* sz is aligned to 16, if what remains after sz is large enaugh to be a chunk, the current
+    chunk is split in two and the second one is added to the free list */
+    if (cb->sz.sz < sz + CB_ALIGN_OFF + sizeof(chunk_border_t))
+        return ;
+    ap_sz_t split_loc = sz + BOREDR_SZ + CB_ALIGN_OFF;
+    auto new_cb = split_chunk(ctx, cb, split_loc);
+    if (next_border(new_cb) != get_last_border(ctx) && next_border(new_cb)->sz.is_free) {
+        remove_from_free_list(ctx, next_border(new_cb));
+        merge_chunks(ctx, new_cb, next_border(new_cb));
     }
+    add_to_free_list(ctx, new_cb);
+}
 
-    /* if in this list we didn't find anything we must look in larger chunks */
-    if (!curr_free) {
-        l2 = log2_64(next_pow2(sz));
-        uint64_t bmap = hdr->free_bmap >> l2;
-        while (bmap) {
-            if (bmap & 1)
-                break;
-            bmap >>= 1;
-            l2++;
+static void count_refault(ap_ctx_t *ctx, chunk_border_t *cb, ap_sz_t rel_sz) {
+    /* cb was taken from a free chunk that had rel_sz bytes released, if a free chunk remains after
+    it, that one ends where the released chunk ended, so it's pages are still released. The other
+    pages will be loaded again when they are used. */
+    if (!rel_sz)
+        return ;
+    auto hdr = (mem_hdr_t *)ctx->region;
+    auto rem = next_border(cb);
+    if (rem != get_last_border(ctx) && rem->sz.is_free) {
+        if (ap_sz_t rem_sz = released_sz(ctx, rem)) {
+            jrnl_border(ctx, rem);
+            rem->sz.is_rel = true;
+            hdr->released_bytes += rem_sz;
+            rel_sz -= rem_sz;
         }
-        if (bmap)
-            curr_free = hdr->free_lists[l2];
     }
+    hdr->refault_bytes += rel_sz;
+}
 
-    /* if we had no luck then we have failed to find enaugh space */
-    if (!curr_free)
+static ap_off_t try_alloc_in_free(ap_ctx_t *ctx, size_t sz) {
+    if (sz % 16 != 0)
+        sz = (sz / 16 + 1) * 16;
+
+    /* if there is no fit then we have failed to find enaugh space */
+    auto cb = find_best_fit(ctx, sz);
+    if (!cb)
         return 0;
 
     /* else we can allocate */
-    auto cb = (chunk_border_t *)get_ptr(ctx, curr_free);
-    if (cb->sz.sz >= sz + CB_ALIGN_OFF + sizeof(chunk_border_t)) {
-        /* In this case we must split the current border in two and apend one to the free
-        list */
-        ap_sz_t split_loc = sz + BOREDR_SZ + CB_ALIGN_OFF;
-        remove_from_free_list(ctx, cb);
-        auto new_cb = split_chunk(cb, split_loc);
-        if (next_border(new_cb) != get_last_border(ctx) && next_border(new_cb)->sz.is_free) {
-            remove_from_free_list(ctx, next_border(new_cb));
-            merge_chunks(ctx, new_cb, next_border(new_cb));
-        }
-        add_to_free_list(ctx, new_cb);
-        return get_offset(ctx, cb2usr(cb));
-    }
-    else {
-        remove_from_free_list(ctx, cb);
-        return get_offset(ctx, cb2usr(cb));
-    }
-    return 0;
+    ap_sz_t rel_sz = cb->sz.is_rel ? released_sz(ctx, cb) : 0;
+    remove_from_free_list(ctx, cb);
+    shrink_chunk(ctx, cb, sz);
+    count_refault(ctx, cb, rel_sz);
+    return get_offset(ctx, cb2usr(cb));
 }
 
-static ap_off_t alloc_increasing_space(ap_ctx_t *ctx, size_t sz) {
+static void advise_huge_pages(ap_ctx_t *ctx, void *start, ap_sz_t sz) {
+    /* only a hint, hugetlb mappings refuse it and without transparent huge pages it does nothing */
+    if (!(ctx->flags & AP_MALLOC_FLAG_HUGE_PAGES))
+        return ;
+    uintptr_t aligned = (uintptr_t)start & ~uintptr_t(AP_MALLOC_PAGE_SZ - 1);
+    madvise((void *)aligned, sz + ((uintptr_t)start - aligned), MADV_HUGEPAGE);
+}
+
+static int grow_region(ap_ctx_t *ctx, size_t sz) {
     /* This means we have no more space in our current region so we must increase the space by at
-    least sz. We will increase it by more than sz, more exactly by multiples of SZ_DIV_ASK */
-    ap_sz_t ask_sz = sz + sizeof(chunk_border_t);
-    if (ask_sz % SZ_DIV_ASK != 0)
-        ask_sz = (ask_sz / SZ_DIV_ASK + 1) * SZ_DIV_ASK;
+    least sz. We will increase it by more than sz, more exactly by multiples of SZ_DIV_ASK (or of
+    the huge page size). If the last chunk is free it will be merged with the new space, so we ask
+    only for what is missing. The new space ends up as a free chunk at the end of the region. */
+    if (sz % 16 != 0)
+        sz = (sz / 16 + 1) * 16;
+    auto tail_cb = prev_border(get_last_border(ctx));
+    ap_sz_t tail_free = tail_cb->sz.is_free ? tail_cb->sz.sz + BOREDR_SZ : 0;
+    ap_off_t tail_off = get_offset(ctx, tail_cb);
+    ap_sz_t div_ask = std::max(ap_sz_t(SZ_DIV_ASK), region_page_sz(ctx));
+    ap_sz_t ask_sz = sz + sizeof(chunk_border_t) > tail_free ?
+            sz + sizeof(chunk_border_t) - tail_free : div_ask;
+    if (ask_sz % div_ask != 0)
+        ask_sz = (ask_sz / div_ask + 1) * div_ask;
 
     /* we will ask for more space */
     if (ctx->add_mem_fn) {
         int ret = 0;
-        if ((ret = ctx->add_mem_fn(ask_sz)) < 0) {
+        if ((ret = ctx->add_mem_fn(ctx, ask_sz)) < 0) {
             DBG("Failed to add more memory!");
-            return 0;
+            return -1;
         }
     }
     else {
         DBG("Asking for memory is disabled!");
-        return 0;
+        return -1;
     }
 
     auto last_border = get_last_border(ctx);
     auto hdr = (mem_hdr_t *)ctx->region;
+    advise_huge_pages(ctx, (uint8_t *)ctx->region + hdr->sz, ask_sz);
+    jrnl_border(ctx, last_border);
     hdr->sz += ask_sz;
+    hdr->chunk_cnt++;
 
     last_border->sz.sz = ask_sz - BOREDR_SZ;
     auto new_last_border = get_last_border(ctx);
+    jrnl_border(ctx, new_last_border);
+    new_last_border->sz = border_sz_t{};
     new_last_border->prev_sz = last_border->sz.sz;
 
     new_last_border->sz.is_free = false;
 
+    if (tail_free) {
+        tail_cb = (chunk_border_t *)get_ptr(ctx, tail_off);
+        remove_from_free_list(ctx, tail_cb);
+        last_border = merge_chunks(ctx, tail_cb, last_border);
+    }
     add_to_free_list(ctx, last_border);
+    return 0;
+}
+
+static ap_off_t alloc_increasing_space(ap_ctx_t *ctx, size_t sz) {
+    if (grow_region(ctx, sz) < 0)
+        return 0;
 
     /* now this should work */
     return try_alloc_in_free(ctx, sz);
 }
 
+static int realloc_chunk_inplace(ap_ctx_t *ctx, chunk_border_t *cb, ap_sz_t sz) {
+    /* shrinking gives back the tail, growing absorbs the next chunk if it is free and, if the
+    chunk is at the end of the region, the region is grown as needed */
+    if (sz % 16 != 0)
+        sz = (sz / 16 + 1) * 16;
+    if (sz <= cb->sz.sz) {
+        shrink_chunk(ctx, cb, sz);
+        return 0;
+    }
+
+    auto last_border = get_last_border(ctx);
+    auto next_cb = next_border(cb);
+    bool next_free = next_cb != last_border && next_cb->sz.is_free;
+    ap_sz_t avail = cb->sz.sz + (next_free ? BOREDR_SZ + next_cb->sz.sz : 0);
+    if (avail < sz && (next_cb == last_border || (next_free && next_border(next_cb) == last_border))) {
+        if (grow_region(ctx, sz - cb->sz.sz) < 0)
+            return -1;
+        next_cb = next_border(cb);
+        next_free = true;
+        avail = cb->sz.sz + BOREDR_SZ + next_cb->sz.sz;
+    }
+    if (avail < sz)
+        return -1;
+
+    ap_sz_t rel_sz = next_cb->sz.is_rel ? released_sz(ctx, next_cb) : 0;
+    remove_from_free_list(ctx, next_cb);
+    merge_chunks(ctx, cb, next_cb);
+    shrink_chunk(ctx, cb, sz);
+    count_refault(ctx, cb, rel_sz);
+    return 0;
+}
+
+static ap_off_t alloc_chunk(ap_ctx_t *ctx, size_t sz) {
+    ap_off_t ret = 0;
+    if ((ret = try_alloc_in_free(ctx, sz)))
+        return ret;
+    return alloc_increasing_space(ctx, sz);
+}
+
+static ap_sz_t page_isolate_sz(ap_ctx_t *ctx, ap_sz_t sz) {
+    /* returns the rounded size if the object must be on it's own pages, else 0 */
+    if (!(ctx->flags & AP_MALLOC_FLAG_PAGE_ISOLATE) || sz < AP_MALLOC_PAGE_MIN_SZ)
+        return 0;
+    return (sz + AP_MALLOC_PAGE_SZ - 1) / AP_MALLOC_PAGE_SZ * AP_MALLOC_PAGE_SZ;
+}
+
+static void free_chunk(ap_ctx_t *ctx, chunk_border_t *cb) {
+    /* a user gives us a pointer and we must free it, in case the boundry that gets freed
+    is adjiacent to another free boundry, we can merge it to reduce fragmentation */
+    if (cb->sz.is_free) {
+        DBG("Double free");
+        return ;
+    }
+    if (cb != get_last_border(ctx) && next_border(cb)->sz.is_free) {
+        remove_from_free_list(ctx, next_border(cb));
+        merge_chunks(ctx, cb, next_border(cb));
+    }
+    if (cb != get_first_border(ctx) && prev_border(cb)->sz.is_free) {
+        remove_from_free_list(ctx, prev_border(cb));
+        cb = merge_chunks(ctx, prev_border(cb), cb);
+    }
+    add_to_free_list(ctx, cb);
+}
+
+/* The alignment of an aligned chunk is kept in it's border, such that a compaction can move it to
+an address with the same alignment: algn is log2(align) - 4, 0 for the chunks that have only the
+default alignment. The alignments that don't fit are ALGN_FIXED, those chunks are not moved. */
+#define ALGN_FIXED          15
+
+static void set_chunk_align(ap_ctx_t *ctx, chunk_border_t *cb, ap_sz_t align) {
+    jrnl_border(ctx, cb);
+    cb->sz.algn = std::min<ap_sz_t>(sz_log2(align) - 4, ALGN_FIXED);
+}
+
+static ap_sz_t chunk_align(chunk_border_t *cb) {
+    return cb->sz.algn ? ap_sz_t(16) << cb->sz.algn : 0;
+}
+
+static ap_off_t align_in_chunk(ap_ctx_t *ctx, ap_off_t off, size_t sz, ap_sz_t align) {
+    /* off is a used chunk with room for sz after the first address aligned to align that leaves
+    space for a chunk in front of it, that padding is freed and the space after the object is given
+    back as usual. The address is aligned, not the offset, the region may be aligned to less than
+    align */
+    uintptr_t usr = (uintptr_t)get_ptr(ctx, off);
+    uintptr_t aligned_usr = (usr + align - 1) & ~uintptr_t(align - 1);
+    if (aligned_usr != usr && aligned_usr - usr < sizeof(chunk_border_t))
+        aligned_usr += align;
+    ap_off_t aligned_off = off + (aligned_usr - usr);
+
+    auto cb = usr2cb(get_ptr(ctx, off));
+    if (aligned_off != off) {
+        auto aligned_cb = split_chunk(ctx, cb, aligned_off - off);
+        free_chunk(ctx, cb);
+        cb = aligned_cb;
+    }
+    shrink_chunk(ctx, cb, sz);
+    set_chunk_align(ctx, cb, align);
+    return aligned_off;
+}
+
+static ap_off_t alloc_chunk_aligned(ap_ctx_t *ctx, size_t sz, ap_sz_t align) {
+    /* we allocate enaugh space such that the padding in front of the aligned address can be a chunk
+    of it's own */
+    if (sz % 16 != 0)
+        sz = (sz / 16 + 1) * 16;
+    ap_off_t off = alloc_chunk(ctx, sz + align + sizeof(chunk_border_t));
+    if (!off)
+        return 0;
+    return align_in_chunk(ctx, off, sz, align);
+}
+
+static uint32_t sbin_cls(ap_sz_t sz) {
+    return (sz + sizeof(border_sz_t) + 15) / 16 - 1;
+}
+
+static ap_sz_t sbin_stride(uint32_t cls) {
+    return (cls + 1) * 16;
+}
+
+static void sbin_list_remove(ap_ctx_t *ctx, sbin_hdr_t *sb) {
+    auto hdr = (mem_hdr_t *)ctx->region;
+    if (sb->prev)
+        ((sbin_hdr_t *)get_ptr(ctx, sb->prev))->next = sb->next;
+    else
+        hdr->sbin_lists[sb->cls] = sb->next;
+    if (sb->next)
+        ((sbin_hdr_t *)get_ptr(ctx, sb->next))->prev = sb->prev;
+    sb->next = 0;
+    sb->prev = 0;
+}
+
+static void sbin_list_add(ap_ctx_t *ctx, sbin_hdr_t *sb) {
+    auto hdr = (mem_hdr_t *)ctx->region;
+    auto &first = hdr->sbin_lists[sb->cls];
+    if (first)
+        ((sbin_hdr_t *)get_ptr(ctx, first))->prev = get_offset(ctx, sb);
+    sb->next = first;
+    sb->prev = 0;
+    first = get_offset(ctx, sb);
+}
+
+static sbin_hdr_t *sbin_create(ap_ctx_t *ctx, uint32_t cls) {
+    ap_off_t off = alloc_chunk(ctx, SBIN_CHUNK_SZ);
+    if (!off)
+        return NULL;
+    jrnl_border(ctx, usr2cb(get_ptr(ctx, off)));
+    usr2cb(get_ptr(ctx, off))->sz.is_sbin = true;
+
+    auto sb = (sbin_hdr_t *)get_ptr(ctx, off);
+    memset(sb, 0, sizeof(*sb));
+    sb->cls = cls;
+    sb->slot_cnt = (SBIN_CHUNK_SZ - sizeof(sbin_hdr_t)) / sbin_stride(cls);
+    sb->free_cnt = sb->slot_cnt;
+    for (uint32_t i = 0; i < sb->slot_cnt; i++)
+        sb->free_slots[i / 64] |= 1ULL << (i % 64);
+    sbin_list_add(ctx, sb);
+    ((mem_hdr_t *)ctx->region)->sbin_cnt++;
+    return sb;
+}
+
+static ap_off_t sbin_alloc(ap_ctx_t *ctx, ap_sz_t sz) {
+    auto hdr = (mem_hdr_t *)ctx->region;
+    uint32_t cls = sbin_cls(sz);
+
+    sbin_hdr_t *sb = NULL;
+    if (hdr->sbin_lists[cls])
+        sb = (sbin_hdr_t *)get_ptr(ctx, hdr->sbin_lists[cls]);
+    else if (!(sb = sbin_create(ctx, cls)))
+        return 0;
+
+    uint32_t w = 0;
+    while (!sb->free_slots[w])
+        w++;
+    uint32_t slot = w * 64 + __builtin_ctzll(sb->free_slots[w]);
+    sb->free_slots[w] &= ~(1ULL << (slot % 64));
+    sb->free_cnt--;
+    if (!sb->free_cnt)
+        sbin_list_remove(ctx, sb);
+    hdr->sbin_used_slots++;
+    hdr->alloc_cnt++;
+
+    auto tag = (border_sz_t *)((uint8_t *)(sb + 1) + slot * sbin_stride(cls));
+    auto usr = (uint8_t *)(tag + 1);
+    *tag = border_sz_t{};
+    tag->is_sbin = true;
+    tag->sz = usr - (uint8_t *)sb;
+    return get_offset(ctx, usr);
+}
+
+static void sbin_free(ap_ctx_t *ctx, ap_off_t ptroff) {
+    auto usr = (uint8_t *)get_ptr(ctx, ptroff);
+    auto tag = (border_sz_t *)(usr - sizeof(border_sz_t));
+    auto sb = (sbin_hdr_t *)(usr - tag->sz);
+    uint32_t slot = ((uint8_t *)tag - (uint8_t *)(sb + 1)) / sbin_stride(sb->cls);
+
+    if (sb->free_slots[slot / 64] & (1ULL << (slot % 64))) {
+        DBG("Double free");
+        return ;
+    }
+    sb->free_slots[slot / 64] |= 1ULL << (slot % 64);
+    sb->free_cnt++;
+    if (sb->free_cnt == 1)
+        sbin_list_add(ctx, sb);
+    auto hdr = (mem_hdr_t *)ctx->region;
+    hdr->sbin_used_slots--;
+    hdr->free_cnt++;
+
+    /* an empty bin is given back only if it is not the last one with free slots, to avoid
+    creating and destroying a bin on each alloc/free pair */
+    if (sb->free_cnt == sb->slot_cnt && (sb->next || hdr->sbin_lists[sb->cls] != get_offset(ctx, sb))) {
+        sbin_list_remove(ctx, sb);
+        auto cb = usr2cb(sb);
+        jrnl_border(ctx, cb);
+        cb->sz.is_sbin = false;
+        hdr->sbin_cnt--;
+        free_chunk(ctx, cb);
+    }
+}
+
+static void rebuild_free_index(ap_ctx_t *ctx) {
+    /* everything besides the chunk borders and the small bin bitmaps can be found again by
+    walking the region */
+    auto hdr = (mem_hdr_t *)ctx->region;
+    hdr->free_bmap = 0;
+    hdr->free_root = 0;
+    memset(hdr->free_lists, 0, sizeof(hdr->free_lists));
+    memset(hdr->sbin_lists, 0, sizeof(hdr->sbin_lists));
+    hdr->free_bytes = 0;
+    memset(hdr->free_bytes_l2, 0, sizeof(hdr->free_bytes_l2));
+    hdr->chunk_cnt = 0;
+    hdr->free_chunk_cnt = 0;
+    hdr->sbin_cnt = 0;
+    hdr->sbin_used_slots = 0;
+    hdr->released_bytes = 0;
+
+    auto cb = get_first_border(ctx);
+    auto last_border = get_last_border(ctx);
+    while (cb != last_border) {
+        hdr->chunk_cnt++;
+        if (cb->sz.is_free) {
+            cb->sz.is_node = false;
+            add_to_free_list(ctx, cb);
+        }
+        else if (cb->sz.is_sbin) {
+            auto sb = (sbin_hdr_t *)cb2usr(cb);
+            sb->free_cnt = 0;
+            for (auto word : sb->free_slots)
+                sb->free_cnt += __builtin_popcountll(word);
+            if (sb->free_cnt)
+                sbin_list_add(ctx, sb);
+            hdr->sbin_cnt++;
+            hdr->sbin_used_slots += sb->slot_cnt - sb->free_cnt;
+        }
+        cb = next_border(cb);
+    }
+}
+
+static int recover_region(ap_ctx_t *ctx) {
+    /* the last owner of the lock died, the borders it changed are restored in reverse order, so
+    the oldest saved state wins */
+    auto hdr = (mem_hdr_t *)ctx->region;
+    DBG("The owner of the lock died, recovering the region, journal: %d entries", hdr->jrnl_cnt);
+    if (hdr->jrnl_on && hdr->jrnl_lost) {
+        DBG("The journal of the dead owner is incomplete, the region can't be recovered");
+        return -1;
+    }
+    hdr->jrnl_on = false;
+    if (hdr->jrnl_cnt) {
+        for (int i = hdr->jrnl_cnt - 1; i >= 0; i--) {
+            auto cb = (chunk_border_t *)get_ptr(ctx, hdr->jrnl[i].off);
+            cb->prev_sz = hdr->jrnl[i].prev_sz;
+            cb->sz = hdr->jrnl[i].sz;
+        }
+        hdr->sz = hdr->jrnl_sz;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        hdr->jrnl_cnt = 0;
+    }
+    rebuild_free_index(ctx);
+    return 0;
+}
+
+ctx_lock_t::ctx_lock_t(ap_ctx_t *ctx) {
+    if (!(ctx->flags & (AP_MALLOC_FLAG_THREAD_SAFE | AP_MALLOC_FLAG_SHARED)))
+        return ;
+    auto hdr = (mem_hdr_t *)ctx->region;
+    int ret = pthread_mutex_lock(&hdr->lock);
+    if (ret == EOWNERDEAD) {
+        if (recover_region(ctx) < 0) {
+            /* unlocked without being made consistent, every other lock fails with
+            ENOTRECOVERABLE from now on */
+            pthread_mutex_unlock(&hdr->lock);
+            err = -1;
+            return ;
+        }
+        pthread_mutex_consistent(&hdr->lock);
+    }
+    else if (ret) {
+        DBG("Failed to lock the region: %s", strerror(ret));
+        err = -1;
+        return ;
+    }
+    this->ctx = ctx;
+    if (ctx->flags & AP_MALLOC_FLAG_SHARED) {
+        hdr->jrnl_cnt = 0;
+        hdr->jrnl_lost = false;
+        hdr->jrnl_sz = hdr->sz;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        hdr->jrnl_on = true;
+    }
+}
+
+ctx_lock_t::~ctx_lock_t() {
+    if (!ctx)
+        return ;
+    auto hdr = (mem_hdr_t *)ctx->region;
+    if (ctx->flags & AP_MALLOC_FLAG_SHARED) {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        hdr->jrnl_on = false;
+        hdr->jrnl_cnt = 0;
+        hdr->jrnl_lost = false;
+    }
+    pthread_mutex_unlock(&hdr->lock);
+}
+
+static tcache_t *get_tcache(ap_ctx_t *ctx) {
+    tcache_t *empty = NULL;
+    for (auto &tc : tcaches.caches) {
+        if (tc.ctx == ctx && tc.ctx_id == ctx->ctx_id)
+            return &tc;
+        if (tc.ctx == ctx) {
+            /* the ctx was reused for another region, the old one is gone with it's slots */
+            memset(&tc, 0, sizeof(tc));
+        }
+        if (!tc.ctx && !empty)
+            empty = &tc;
+    }
+    if (empty) {
+        empty->ctx = ctx;
+        empty->ctx_id = ctx->ctx_id;
+    }
+    return empty;
+}
+
+static void tcache_flush(tcache_t *tc, uint32_t cls, uint32_t cnt) {
+    /* the oldest cnt slots are given back to the region */
+    auto &bin = tc->bins[cls];
+    {
+        ctx_lock_t guard(tc->ctx);
+        for (uint32_t i = 0; i < cnt; i++)
+            sbin_free(tc->ctx, bin.offs[i]);
+    }
+    bin.cnt -= cnt;
+    memmove(bin.offs, bin.offs + cnt, bin.cnt * sizeof(bin.offs[0]));
+}
+
+static ap_off_t tcache_alloc(ap_ctx_t *ctx, ap_sz_t sz) {
+    auto tc = get_tcache(ctx);
+    if (!tc) {
+        ctx_lock_t guard(ctx);
+        return sbin_alloc(ctx, sz);
+    }
+    auto &bin = tc->bins[sbin_cls(sz)];
+    if (!bin.cnt) {
+        ctx_lock_t guard(ctx);
+        while (bin.cnt < TCACHE_BATCH) {
+            ap_off_t off = sbin_alloc(ctx, sz);
+            if (!off)
+                break;
+            bin.offs[bin.cnt++] = off;
+        }
+    }
+    if (!bin.cnt)
+        return 0;
+    return bin.offs[--bin.cnt];
+}
+
+static void tcache_free(ap_ctx_t *ctx, ap_off_t ptroff) {
+    auto tc = get_tcache(ctx);
+    if (!tc) {
+        ctx_lock_t guard(ctx);
+        sbin_free(ctx, ptroff);
+        return ;
+    }
+    /* the slot is owned by the caller so the bin can't go away while we look at it */
+    auto usr = (uint8_t *)get_ptr(ctx, ptroff);
+    auto tag = (border_sz_t *)(usr - sizeof(border_sz_t));
+    uint32_t cls = ((sbin_hdr_t *)(usr - tag->sz))->cls;
+    auto &bin = tc->bins[cls];
+    if (bin.cnt == TCACHE_MAX)
+        tcache_flush(tc, cls, TCACHE_BATCH);
+    bin.offs[bin.cnt++] = ptroff;
+}
+
+static void tcache_flush_all(tcache_t *tc) {
+    for (uint32_t cls = 0; cls < SBIN_CNT; cls++)
+        if (tc->bins[cls].cnt)
+            tcache_flush(tc, cls, tc->bins[cls].cnt);
+    tc->ctx = NULL;
+    tc->ctx_id = 0;
+}
+
+tcache_list_t::~tcache_list_t() {
+    /* only regions that are still registered can get their slots back */
+    for (auto &tc : caches)
+        if (tc.ctx && HAS(id_ctx_map, tc.ctx_id) && id_ctx_map[tc.ctx_id] == tc.ctx)
+            tcache_flush_all(&tc);
+}
+
+static int init_lock(ap_ctx_t *ctx) {
+    auto hdr = (mem_hdr_t *)ctx->region;
+    hdr->jrnl_on = false;
+    hdr->jrnl_cnt = 0;
+    hdr->jrnl_lost = false;
+    if (!(ctx->flags & AP_MALLOC_FLAG_SHARED)) {
+        pthread_mutex_init(&hdr->lock, NULL);
+        return 0;
+    }
+
+    pthread_mutexattr_t attr;
+    ASSERT_FN(pthread_mutexattr_init(&attr) ? -1 : 0);
+    FnScope attr_scope([&attr]{ pthread_mutexattr_destroy(&attr); });
+    ASSERT_FN(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ? -1 : 0);
+    ASSERT_FN(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) ? -1 : 0);
+    ASSERT_FN(pthread_mutex_init(&hdr->lock, &attr) ? -1 : 0);
+    return 0;
+}
+
+static void unregister_ctx_id(ap_ctx_id_t ctx_id) {
+    auto &slot = ap_ctx_slots[ctx_id & (AP_CTX_SLOT_CNT - 1)];
+    if (slot.id == ctx_id)
+        slot = ap_ctx_slot_t{};
+    id_ctx_map.erase(ctx_id);
+}
+
 static int register_ctx_id(ap_ctx_t *ctx, ap_ctx_id_t ctx_id) {
+    /* a ctx has a single id, if it was used for another region before that one is forgotten */
+    if (ctx->ctx_id && ctx->ctx_id != ctx_id && HAS(id_ctx_map, ctx->ctx_id) &&
+            id_ctx_map[ctx->ctx_id] == ctx)
+    {
+        unregister_ctx_id(ctx->ctx_id);
+    }
+
     id_ctx_map[ctx_id] = ctx;
     ctx->ctx_id = ctx_id;
+
+    auto &slot = ap_ctx_slots[ctx_id & (AP_CTX_SLOT_CNT - 1)];
+    if (!slot.id || slot.id == ctx_id)
+        slot = ap_ctx_slot_t{ .id = ctx_id, .ctx = ctx };
     return 0;
 }
 
 int ap_malloc_init(ap_ctx_t *ctx, ap_sz_t sz) {
     auto hdr = (mem_hdr_t *)ctx->region;
 
+    /* the first regions had no version in their magic, they are version 0 */
+    if ((hdr->magic & 0xffffffff) == AP_MALLOC_MAGIC_ID && hdr->magic != AP_MALLOC_MAGIC) {
+        DBG("The region has the layout version %ld, this ap_malloc can only use version %d",
+                hdr->magic >> 32, AP_MALLOC_VERSION);
+        return -1;
+    }
+    if (ctx->flags & AP_MALLOC_FLAG_READ_ONLY) {
+        if (hdr->magic != AP_MALLOC_MAGIC) {
+            DBG("A read only region must be initialized");
+            return -1;
+        }
+        if (HAS(id_ctx_map, hdr->ctx_id) && id_ctx_map[hdr->ctx_id] != ctx) {
+            DBG("The region %ld is already attached in this process", hdr->ctx_id);
+            return -1;
+        }
+        ASSERT_FN(register_ctx_id(ctx, hdr->ctx_id));
+        advise_huge_pages(ctx, ctx->region, hdr->sz);
+        return 0;
+    }
     if (hdr->magic == AP_MALLOC_MAGIC) { /* It means that this region is already initialized */
         DBG("using existing malloc: ctx_id: %ld", hdr->ctx_id);
         ASSERT_FN(register_ctx_id(ctx, hdr->ctx_id));
+        advise_huge_pages(ctx, ctx->region, hdr->sz);
+        /* whoever held the lock before is gone, except for shared regions */
+        if (!(ctx->flags & AP_MALLOC_FLAG_SHARED))
+            pthread_mutex_init(&hdr->lock, NULL);
         return 0;
     }
 
@@ -277,7 +1086,7 @@ int ap_malloc_init(ap_ctx_t *ctx, ap_sz_t sz) {
         desired_ctx_id = ctx->ctx_id;
     DBG("Registering ctx: %p as %ld", ctx, desired_ctx_id);
     ASSERT_FN(register_ctx_id(ctx, desired_ctx_id));
-    FnScope err_scope([desired_ctx_id]{ id_ctx_map.erase(desired_ctx_id); });
+    FnScope err_scope([desired_ctx_id]{ unregister_ctx_id(desired_ctx_id); });
 
     sz = (sz / 16) * 16;
     if (sz < INIT_OFF + 2 * sizeof(chunk_border_t)) {
@@ -290,13 +1099,30 @@ int ap_malloc_init(ap_ctx_t *ctx, ap_sz_t sz) {
     }
 
     // 4r453 - not sure what it means, but my cat wrote that
+    advise_huge_pages(ctx, ctx->region, sz);
 
     hdr->magic = AP_MALLOC_MAGIC;
     hdr->ctx_id = ctx->ctx_id;
 
     hdr->sz = sz;
     hdr->free_bmap = 0;
+    hdr->free_root = 0;
     memset(hdr->free_lists, 0, sizeof(hdr->free_lists));
+    memset(hdr->sbin_lists, 0, sizeof(hdr->sbin_lists));
+    hdr->free_bytes = 0;
+    memset(hdr->free_bytes_l2, 0, sizeof(hdr->free_bytes_l2));
+    hdr->chunk_cnt = 1;
+    hdr->free_chunk_cnt = 0;
+    hdr->sbin_cnt = 0;
+    hdr->sbin_used_slots = 0;
+    hdr->alloc_cnt = 0;
+    hdr->free_cnt = 0;
+    hdr->search_cnt = 0;
+    hdr->search_steps = 0;
+    hdr->released_bytes = 0;
+    hdr->trimmed_bytes = 0;
+    hdr->refault_bytes = 0;
+    ASSERT_FN(init_lock(ctx));
 
     auto border0 = get_first_border(ctx);
     auto usr0 = (uint8_t *)cb2usr(border0);
@@ -317,7 +1143,7 @@ int ap_malloc_init(ap_ctx_t *ctx, ap_sz_t sz) {
     return 0;
 }
 
-ap_ctx_t *ap_malloc_get_ctx(ap_ctx_id_t ctx_id) {
+ap_ctx_t *ap_malloc_get_ctx_slow(ap_ctx_id_t ctx_id) {
     if (!HAS(id_ctx_map, ctx_id)) {
         DBG("This context was not registered: %ld", ctx_id);
         return NULL;
@@ -325,55 +1151,580 @@ ap_ctx_t *ap_malloc_get_ctx(ap_ctx_id_t ctx_id) {
     return id_ctx_map[ctx_id];
 }
 
+int ap_malloc_register_ctx(ap_ctx_t *ctx) {
+    return register_ctx_id(ctx, generate_ctx_id());
+}
+
+void ap_malloc_unregister_ctx(ap_ctx_t *ctx) {
+    if (HAS(id_ctx_map, ctx->ctx_id) && id_ctx_map[ctx->ctx_id] == ctx)
+        unregister_ctx_id(ctx->ctx_id);
+    ctx->ctx_id = 0;
+}
+
+static void *usr_region(ap_ctx_t *ctx) {
+    /* an arena's ctx shares the region of it's parent, which may have moved since the arena
+    last looked at it */
+    while (ctx->arena) [[unlikely]]
+        ctx = ctx->arena->parent;
+    return ctx->region;
+}
+
 void ap_malloc_set_usr(ap_ctx_t *ctx, ap_off_t val) {
-    auto hdr = (mem_hdr_t *)ctx->region;
+    auto hdr = (mem_hdr_t *)usr_region(ctx);
     hdr->usr_slot = val;
 }
 
 ap_off_t ap_malloc_get_usr(ap_ctx_t *ctx) {
-    auto hdr = (mem_hdr_t *)ctx->region;
+    auto hdr = (mem_hdr_t *)usr_region(ctx);
     return hdr->usr_slot;
 }
 
 void *ap_malloc_ptr(ap_ctx_t *ctx, ap_off_t off) {
     if (off == 0)
         return NULL;
-    return (uint8_t *)ctx->region + off;
+    return (uint8_t *)usr_region(ctx) + off;
 }
 
 ap_off_t ap_malloc_off(ap_ctx_t *ctx, void *ptr) {
     if (!ptr)
         return 0;
-    return ap_off_t((uint8_t *)ptr - (uint8_t *)ctx->region);
+    return ap_off_t((uint8_t *)ptr - (uint8_t *)usr_region(ctx));
 }
 
 ap_off_t ap_malloc_alloc(ap_ctx_t *ctx, size_t sz) {
     if (!sz)
         return 0;
-    ap_off_t ret = 0;
-    if ((ret = try_alloc_in_free(ctx, sz)))
-        return ret;
-    return alloc_increasing_space(ctx, sz);
+    if (ctx->arena) [[unlikely]]
+        return ap_arena_alloc(ctx->arena, sz);
+    bool use_tcache = (ctx->flags & AP_MALLOC_FLAG_THREAD_SAFE) &&
+            !(ctx->flags & AP_MALLOC_FLAG_SHARED);
+    if (sz <= AP_MALLOC_SBIN_MAX_SZ && !(ctx->flags & AP_MALLOC_FLAG_NO_SBIN) && use_tcache)
+        return tcache_alloc(ctx, sz);
+
+    ctx_lock_t guard(ctx);
+    if (guard.err)
+        return 0;
+    if (sz <= AP_MALLOC_SBIN_MAX_SZ && !(ctx->flags & AP_MALLOC_FLAG_NO_SBIN))
+        return sbin_alloc(ctx, sz);
+    ap_off_t ret;
+    if (ap_sz_t page_sz = page_isolate_sz(ctx, sz))
+        ret = alloc_chunk_aligned(ctx, page_sz, AP_MALLOC_PAGE_SZ);
+    else
+        ret = alloc_chunk(ctx, sz);
+    if (ret)
+        ((mem_hdr_t *)ctx->region)->alloc_cnt++;
+    return ret;
+}
+
+ap_off_t ap_malloc_alloc_aligned(ap_ctx_t *ctx, ap_sz_t sz, ap_sz_t align) {
+    if (align & (align - 1)) {
+        DBG("Alignment must be a power of 2: %ld", align);
+        return 0;
+    }
+    if (align <= ALIGNMENT)
+        return ap_malloc_alloc(ctx, sz);
+    if (!sz)
+        return 0;
+    if (ctx->arena) [[unlikely]]
+        return ap_arena_alloc(ctx->arena, sz, align);
+
+    ctx_lock_t guard(ctx);
+    if (guard.err)
+        return 0;
+    ap_off_t ret;
+    if (ap_sz_t page_sz = page_isolate_sz(ctx, sz))
+        ret = alloc_chunk_aligned(ctx, page_sz, std::max(align, ap_sz_t(AP_MALLOC_PAGE_SZ)));
+    else
+        ret = alloc_chunk_aligned(ctx, sz, align);
+    if (ret)
+        ((mem_hdr_t *)ctx->region)->alloc_cnt++;
+    return ret;
 }
 
 void ap_malloc_free(ap_ctx_t *ctx, ap_off_t ptroff) {
-    /* a user gives us a pointer and we must free it, in case the boundry that gets freed
-    is adjiacent to another free boundry, we can merge it to reduce fragmentation */
-    auto hdr = (mem_hdr_t *)ctx->region;
+    if (!ptroff)
+        return ;
+    if (ctx->arena) [[unlikely]] {
+        ap_arena_free(ctx->arena, ptroff);
+        return ;
+    }
     auto cb = usr2cb(ap_malloc_ptr(ctx, ptroff));
-    if (cb->sz.is_free) {
-        DBG("Double free");
+    bool use_tcache = (ctx->flags & AP_MALLOC_FLAG_THREAD_SAFE) &&
+            !(ctx->flags & AP_MALLOC_FLAG_SHARED);
+    if (cb->sz.is_sbin && use_tcache) {
+        tcache_free(ctx, ptroff);
         return ;
     }
-    if (cb != get_last_border(ctx) && next_border(cb)->sz.is_free) {
-        remove_from_free_list(ctx, next_border(cb));
-        merge_chunks(ctx, cb, next_border(cb));
+
+    ctx_lock_t guard(ctx);
+    if (guard.err)
+        return ;
+    if (cb->sz.is_sbin)
+        sbin_free(ctx, ptroff);
+    else {
+        ((mem_hdr_t *)ctx->region)->free_cnt++;
+        free_chunk(ctx, cb);
     }
-    if (cb != get_first_border(ctx) && prev_border(cb)->sz.is_free) {
-        remove_from_free_list(ctx, prev_border(cb));
-        cb = merge_chunks(ctx, prev_border(cb), cb);
+}
+
+static ap_sz_t usable_sz(ap_ctx_t *ctx, ap_off_t ptroff) {
+    /* for small bin slots the border is the slot's tag, that points to the small bin */
+    auto cb = usr2cb(ap_malloc_ptr(ctx, ptroff));
+    if (!cb->sz.is_sbin)
+        return cb->sz.sz;
+    auto sb = (sbin_hdr_t *)((uint8_t *)ap_malloc_ptr(ctx, ptroff) - cb->sz.sz);
+    return sbin_stride(sb->cls) - sizeof(border_sz_t);
+}
+
+int ap_malloc_realloc_inplace(ap_ctx_t *ctx, ap_off_t ptroff, ap_sz_t sz) {
+    if (!ptroff || !sz)
+        return -1;
+    if (ctx->arena) [[unlikely]]
+        return ap_arena_realloc_inplace(ctx->arena, ptroff, sz);
+    auto cb = usr2cb(ap_malloc_ptr(ctx, ptroff));
+    if (cb->sz.is_sbin) {
+        /* the slot can't change, but it may already be large enaugh */
+        return sz <= usable_sz(ctx, ptroff) ? 0 : -1;
     }
-    add_to_free_list(ctx, cb);
+
+    /* page isolated objects that change size must still end on a page border */
+    if (ap_sz_t page_sz = page_isolate_sz(ctx, sz); page_sz &&
+            (uintptr_t)ap_malloc_ptr(ctx, ptroff) % AP_MALLOC_PAGE_SZ == 0)
+        sz = page_sz;
+
+    ctx_lock_t guard(ctx);
+    if (guard.err)
+        return -1;
+    return realloc_chunk_inplace(ctx, cb, sz);
+}
+
+ap_off_t ap_malloc_realloc(ap_ctx_t *ctx, ap_off_t ptroff, ap_sz_t sz) {
+    if (ctx->arena) [[unlikely]]
+        return ap_arena_realloc(ctx->arena, ptroff, sz);
+    if (!ptroff)
+        return ap_malloc_alloc(ctx, sz);
+    if (!sz) {
+        ap_malloc_free(ctx, ptroff);
+        return 0;
+    }
+    if (ap_malloc_realloc_inplace(ctx, ptroff, sz) == 0)
+        return ptroff;
+
+    /* the old object is not touched by the failed attempt, so it's size can be read now */
+    ap_sz_t old_sz = usable_sz(ctx, ptroff);
+    ap_off_t ret = ap_malloc_alloc(ctx, sz);
+    if (!ret)
+        return 0;
+    memcpy(ap_malloc_ptr(ctx, ret), ap_malloc_ptr(ctx, ptroff), std::min(old_sz, sz));
+    ap_malloc_free(ctx, ptroff);
+    return ret;
+}
+
+void ap_malloc_flush_tcache(ap_ctx_t *ctx) {
+    for (auto &tc : tcaches.caches)
+        if (tc.ctx == ctx && tc.ctx_id == ctx->ctx_id)
+            tcache_flush_all(&tc);
+}
+
+static chunk_border_t *move_chunk(ap_ctx_t *ctx, chunk_border_t *cb) {
+    /* the chunk is moved only if the best fit for it is bellow it, the old chunk is freed. An
+    aligned chunk needs room for it's alignment, as when it was allocated */
+    ap_sz_t sz = cb->sz.sz;
+    ap_sz_t align = chunk_align(cb);
+    auto dst = find_best_fit(ctx, align ? sz + align + sizeof(chunk_border_t) : sz);
+    if (!dst || dst > cb)
+        return NULL;
+    ap_sz_t rel_sz = dst->sz.is_rel ? released_sz(ctx, dst) : 0;
+    remove_from_free_list(ctx, dst);
+    if (align)
+        dst = usr2cb(get_ptr(ctx, align_in_chunk(ctx, get_offset(ctx, cb2usr(dst)), sz, align)));
+    else
+        shrink_chunk(ctx, dst, sz);
+    count_refault(ctx, dst, rel_sz);
+
+    /* the slot tags of a small bin are relative to the bin, only it's list links change */
+    auto sb = (sbin_hdr_t *)cb2usr(cb);
+    bool is_sbin = cb->sz.is_sbin;
+    if (is_sbin && sb->free_cnt)
+        sbin_list_remove(ctx, sb);
+    memcpy(cb2usr(dst), cb2usr(cb), sz);
+    if (is_sbin) {
+        dst->sz.is_sbin = true;
+        cb->sz.is_sbin = false;
+        auto new_sb = (sbin_hdr_t *)cb2usr(dst);
+        if (new_sb->free_cnt)
+            sbin_list_add(ctx, new_sb);
+    }
+    free_chunk(ctx, cb);
+    return dst;
+}
+
+static int trim_tail(ap_ctx_t *ctx) {
+    /* the free chunk at the end is shrunk by whole pages, but it is kept, such that the region
+    still ends in a free chunk */
+    auto hdr = (mem_hdr_t *)ctx->region;
+    auto tail_cb = prev_border(get_last_border(ctx));
+    ap_sz_t page_sz = region_page_sz(ctx);
+    if (!tail_cb->sz.is_free || tail_cb->sz.sz < page_sz + ALIGNMENT)
+        return 0;
+    ap_sz_t rm_sz = (tail_cb->sz.sz - ALIGNMENT) / page_sz * page_sz;
+
+    remove_from_free_list(ctx, tail_cb);
+    tail_cb->sz.sz -= rm_sz;
+    hdr->sz -= rm_sz;
+    auto last_border = get_last_border(ctx);
+    *last_border = chunk_border_t{};
+    last_border->prev_sz = tail_cb->sz.sz;
+    add_to_free_list(ctx, tail_cb);
+
+    if (ctx->rm_mem_fn(ctx, rm_sz) < 0) {
+        /* the memory is still there, so it is taken back */
+        DBG("Failed to remove memory");
+        remove_from_free_list(ctx, tail_cb);
+        tail_cb->sz.sz += rm_sz;
+        hdr->sz += rm_sz;
+        last_border = get_last_border(ctx);
+        *last_border = chunk_border_t{};
+        last_border->prev_sz = tail_cb->sz.sz;
+        add_to_free_list(ctx, tail_cb);
+        return -1;
+    }
+    hdr->trimmed_bytes += rm_sz;
+    return 0;
+}
+
+static int release_chunk(ap_ctx_t *ctx, chunk_border_t *cb) {
+    auto hdr = (mem_hdr_t *)ctx->region;
+    uintptr_t start;
+    ap_sz_t sz = released_range(ctx, cb, &start);
+    if (cb->sz.is_rel || !sz)
+        return 0;
+    ap_off_t off = get_offset(ctx, (void *)start);
+    int ret = ctx->release_mem_fn ? ctx->release_mem_fn(ctx, off, sz) :
+            madvise((void *)start, sz, MADV_DONTNEED);
+    if (ret < 0) {
+        DBG("Failed to release %ld bytes at %lx", sz, off);
+        return -1;
+    }
+    jrnl_border(ctx, cb);
+    cb->sz.is_rel = true;
+    hdr->released_bytes += sz;
+    hdr->trimmed_bytes += sz;
+    return 0;
+}
+
+static int release_tree(ap_ctx_t *ctx, ap_off_t node, ap_sz_t min_sz) {
+    /* the nodes on the left are smaller, so they are visited only if this one is large enaugh */
+    if (!node)
+        return 0;
+    auto cb = (chunk_border_t *)get_ptr(ctx, node);
+    auto n = (chunk_node_t *)cb;
+    int ret = 0;
+    if (cb->sz.sz >= min_sz) {
+        ret |= release_tree(ctx, n->left, min_sz);
+        ret |= release_chunk(ctx, cb);
+    }
+    ret |= release_tree(ctx, n->right, min_sz);
+    return ret;
+}
+
+int ap_malloc_trim(ap_ctx_t *ctx, ap_sz_t min_sz) {
+    if (ctx->flags & AP_MALLOC_FLAG_SHARED) {
+        DBG("Trimming is not supported for shared regions");
+        return -1;
+    }
+    ctx_lock_t guard(ctx);
+    ASSERT_FN(guard.err);
+    if (ctx->rm_mem_fn)
+        ASSERT_FN(trim_tail(ctx));
+    auto hdr = (mem_hdr_t *)ctx->region;
+    return release_tree(ctx, hdr->free_root, std::max(min_sz, ap_sz_t(AP_MALLOC_TRIM_MIN_SZ)));
+}
+
+int ap_malloc_compact(ap_ctx_t *ctx, ap_malloc_reloc_fn_t fn, void *usr, uint64_t budget_us) {
+    if (ctx->flags & AP_MALLOC_FLAG_SHARED) {
+        DBG("Compaction is not supported for shared regions");
+        return -1;
+    }
+    bool move_sbins = !(ctx->flags & AP_MALLOC_FLAG_THREAD_SAFE);
+    if (!move_sbins)
+        ap_malloc_flush_tcache(ctx);
+
+    ctx_lock_t guard(ctx);
+    ASSERT_FN(guard.err);
+    auto hdr = (mem_hdr_t *)ctx->region;
+
+    /* the chunks are visited from the end of the region, each one goes in the best fit bellow it.
+    A chunk can be visited again after it was moved, in that case it's move is updated, so each
+    object has a single entry */
+    std::vector<ap_malloc_reloc_t> relocs;
+    std::unordered_map<ap_off_t, uint64_t> moved;
+    uint64_t start = get_time_us();
+    bool done = true;
+    auto first_border = get_first_border(ctx);
+    auto cb = prev_border(get_last_border(ctx));
+    for (uint64_t i = 0; cb != first_border; i++) {
+        if (budget_us && i % 64 == 0 && get_time_us() - start >= budget_us) {
+            done = false;
+            break;
+        }
+        auto prev_cb = prev_border(cb);
+        if (cb->sz.is_free || (cb->sz.is_sbin && !move_sbins) || cb->sz.algn == ALGN_FIXED) {
+            cb = prev_cb;
+            continue;
+        }
+        ap_off_t old_off = get_offset(ctx, cb2usr(cb));
+        ap_sz_t sz = cb->sz.sz;
+        if (auto dst = move_chunk(ctx, cb)) {
+            ap_off_t new_off = get_offset(ctx, cb2usr(dst));
+            if (HAS(moved, old_off)) {
+                uint64_t idx = moved[old_off];
+                moved.erase(old_off);
+                relocs[idx].new_off = new_off;
+                moved[new_off] = idx;
+            }
+            else {
+                moved[new_off] = relocs.size();
+                relocs.push_back(ap_malloc_reloc_t{ .old_off = old_off, .new_off = new_off, .sz = sz });
+            }
+        }
+        cb = prev_cb;
+    }
+
+    /* the chunks were visited in reverse order */
+    std::reverse(relocs.begin(), relocs.end());
+    ap_malloc_reloc_table_t table = { .relocs = relocs.data(), .cnt = relocs.size() };
+    if (relocs.size()) {
+        hdr->usr_slot = ap_malloc_reloc_off(&table, hdr->usr_slot);
+        fn(ctx, &table, usr);
+    }
+    if (!done)
+        return 0;
+    if (ctx->rm_mem_fn)
+        ASSERT_FN(trim_tail(ctx));
+    return 1;
+}
+
+ap_malloc_stats_t ap_malloc_stats(ap_ctx_t *ctx) {
+    ap_malloc_stats_t st{};
+    ctx_lock_t guard(ctx);
+    if (guard.err)
+        return st;
+
+    auto hdr = (mem_hdr_t *)ctx->region;
+    st.region_sz = hdr->sz;
+    st.free_bytes = hdr->free_bytes;
+    st.used_bytes = hdr->sz - INIT_OFF - sizeof(chunk_border_t) - hdr->chunk_cnt * BOREDR_SZ -
+            hdr->free_bytes;
+    memcpy(st.free_bytes_l2, hdr->free_bytes_l2, sizeof(st.free_bytes_l2));
+
+    /* all the chunks in the tree are larger than the ones in the lists */
+    if (ap_off_t max_node = get_free_avl(ctx).get_max())
+        st.largest_free = ((chunk_border_t *)get_ptr(ctx, max_node))->sz.sz;
+    else if (hdr->free_bmap)
+        st.largest_free = (63 - __builtin_clzll(hdr->free_bmap)) * 16;
+
+    st.chunk_cnt = hdr->chunk_cnt;
+    st.free_chunk_cnt = hdr->free_chunk_cnt;
+    st.sbin_cnt = hdr->sbin_cnt;
+    st.sbin_used_slots = hdr->sbin_used_slots;
+    st.alloc_cnt = hdr->alloc_cnt;
+    st.free_cnt = hdr->free_cnt;
+    st.frag_ratio = hdr->free_bytes ? 1 - st.largest_free / (double)hdr->free_bytes : 0;
+    st.avg_search_len = hdr->search_cnt ? hdr->search_steps / (double)hdr->search_cnt : 0;
+    st.released_bytes = hdr->released_bytes;
+    st.trimmed_bytes = hdr->trimmed_bytes;
+    st.refault_bytes = hdr->refault_bytes;
+    return st;
+}
+
+int ap_malloc_walk(ap_ctx_t *ctx, ap_malloc_walk_fn_t fn, void *usr) {
+    ctx_lock_t guard(ctx);
+    ASSERT_FN(guard.err);
+
+    auto cb = get_first_border(ctx);
+    auto last_border = get_last_border(ctx);
+    while (cb != last_border) {
+        ap_malloc_chunk_info_t info = {
+            .off = get_offset(ctx, cb2usr(cb)),
+            .sz = cb->sz.sz,
+            .is_free = bool(cb->sz.is_free),
+            .is_sbin = bool(cb->sz.is_sbin),
+        };
+        if (fn(&info, usr) < 0)
+            return 0;
+        cb = next_border(cb);
+    }
+    return 0;
+}
+
+/* checks the tree order and heights, returns the height of the subtree or -1 */
+static int validate_tree(ap_ctx_t *ctx, ap_off_t node, uint64_t *cnt) {
+    if (!node)
+        return 0;
+    auto avl = get_free_avl(ctx);
+    auto n = (chunk_node_t *)get_ptr(ctx, node);
+    if (!n->sz.is_free || !n->sz.is_node || n->sz.sz < TREE_MIN_SZ) {
+        DBG("Tree node %lx is not a free chunk large enaugh for the tree", node);
+        return -1;
+    }
+    if ((n->left && avl.o.cmp_fn(n->left, node) >= 0) ||
+            (n->right && avl.o.cmp_fn(n->right, node) <= 0))
+    {
+        DBG("Tree node %lx is out of order", node);
+        return -1;
+    }
+    (*cnt)++;
+    int lh = validate_tree(ctx, n->left, cnt);
+    int rh = validate_tree(ctx, n->right, cnt);
+    if (lh < 0 || rh < 0)
+        return -1;
+    if (n->height != std::max(lh, rh) + 1 || std::abs(lh - rh) > 1) {
+        DBG("Tree node %lx has a wrong height: %ld, left: %d, right: %d", node, n->height, lh, rh);
+        return -1;
+    }
+    return n->height;
+}
+
+int ap_malloc_validate(ap_ctx_t *ctx) {
+    ctx_lock_t guard(ctx);
+    ASSERT_FN(guard.err);
+    auto hdr = (mem_hdr_t *)ctx->region;
+
+    /* first the walk over all the chunks, the counters are computed again along the way */
+    ap_sz_t free_bytes = 0, released_bytes = 0;
+    ap_sz_t free_bytes_l2[64] = {};
+    uint64_t chunk_cnt = 0, list_chunk_cnt = 0, node_cnt = 0;
+    uint64_t sbin_cnt = 0, sbin_free_cnt = 0, sbin_used_slots = 0;
+    auto cb = get_first_border(ctx);
+    auto last_border = get_last_border(ctx);
+    ap_sz_t prev_sz = 0;
+    bool prev_free = false;
+    while (cb < last_border) {
+        ap_off_t off = get_offset(ctx, cb);
+        if (cb->prev_sz != prev_sz) {
+            DBG("Chunk %lx has prev_sz: %ld, but the previous chunk has: %ld", off, cb->prev_sz,
+                    prev_sz);
+            return -1;
+        }
+        if (cb->sz.sz % 16 != 0 || off + BOREDR_SZ + cb->sz.sz > hdr->sz - sizeof(chunk_border_t)) {
+            DBG("Chunk %lx has an invalid size: %ld", off, cb->sz.sz);
+            return -1;
+        }
+        if (cb->sz.is_free && prev_free) {
+            DBG("Chunk %lx is free and so is the one before it", off);
+            return -1;
+        }
+        if (cb->sz.is_node != (cb->sz.is_free && cb->sz.sz >= TREE_MIN_SZ)) {
+            DBG("Chunk %lx has is_node: %d, but is_free: %d, sz: %ld", off, cb->sz.is_node,
+                    cb->sz.is_free, cb->sz.sz);
+            return -1;
+        }
+        if ((cb->sz.is_free && (cb->sz.is_sbin || cb->sz.algn)) ||
+                (cb->sz.is_rel && !cb->sz.is_free) || (cb->sz.is_sbin && cb->sz.algn))
+        {
+            DBG("Chunk %lx has invalid flags: is_free: %d is_sbin: %d is_rel: %d algn: %d", off,
+                    cb->sz.is_free, cb->sz.is_sbin, cb->sz.is_rel, cb->sz.algn);
+            return -1;
+        }
+        if (cb->sz.is_rel)
+            released_bytes += released_sz(ctx, cb);
+        if (cb->sz.is_free) {
+            free_bytes += cb->sz.sz;
+            free_bytes_l2[sz_log2(cb->sz.sz)] += cb->sz.sz;
+            if (cb->sz.is_node)
+                node_cnt++;
+            else
+                list_chunk_cnt++;
+        }
+        if (cb->sz.is_sbin) {
+            auto sb = (sbin_hdr_t *)cb2usr(cb);
+            uint32_t free_cnt = 0;
+            for (auto word : sb->free_slots)
+                free_cnt += __builtin_popcountll(word);
+            if (sb->cls >= SBIN_CNT || free_cnt != sb->free_cnt || sb->free_cnt > sb->slot_cnt ||
+                    sb->slot_cnt != (SBIN_CHUNK_SZ - sizeof(sbin_hdr_t)) / sbin_stride(sb->cls))
+            {
+                DBG("Small bin %lx is inconsistent: cls: %d slots: %d free: %d bitmap free: %d",
+                        off, sb->cls, sb->slot_cnt, sb->free_cnt, free_cnt);
+                return -1;
+            }
+            sbin_cnt++;
+            sbin_free_cnt += sb->free_cnt > 0;
+            sbin_used_slots += sb->slot_cnt - sb->free_cnt;
+        }
+        chunk_cnt++;
+        prev_sz = cb->sz.sz;
+        prev_free = cb->sz.is_free;
+        cb = next_border(cb);
+    }
+    if (cb != last_border || last_border->prev_sz != prev_sz || last_border->sz.sz != 0) {
+        DBG("The chunks don't end at the last border");
+        return -1;
+    }
+
+    /* each free chunk must be in the index exactly once */
+    uint64_t list_cnt = 0;
+    for (uint32_t i = 0; i < FREE_LIST_CNT; i++) {
+        if (bool(hdr->free_lists[i]) != bool(hdr->free_bmap & (1ULL << i))) {
+            DBG("The bitmap doesn't match the free list %d", i);
+            return -1;
+        }
+        ap_off_t prev = 0;
+        for (ap_off_t it = hdr->free_lists[i]; it; it = ((chunk_border_t *)get_ptr(ctx, it))->next_free) {
+            auto fcb = (chunk_border_t *)get_ptr(ctx, it);
+            if (!fcb->sz.is_free || fcb->sz.is_node || fcb->sz.sz / 16 != i || fcb->prev_free != prev) {
+                DBG("Chunk %lx is misplaced in the free list %d", it, i);
+                return -1;
+            }
+            if (++list_cnt > list_chunk_cnt) {
+                DBG("The free lists have more chunks than the region");
+                return -1;
+            }
+            prev = it;
+        }
+    }
+    uint64_t tree_cnt = 0;
+    if (validate_tree(ctx, hdr->free_root, &tree_cnt) < 0)
+        return -1;
+    if (list_cnt != list_chunk_cnt || tree_cnt != node_cnt) {
+        DBG("The free index has %ld list chunks and %ld tree nodes, the region has %ld and %ld",
+                list_cnt, tree_cnt, list_chunk_cnt, node_cnt);
+        return -1;
+    }
+
+    uint64_t sbin_list_cnt = 0;
+    for (uint32_t i = 0; i < SBIN_CNT; i++)
+        for (ap_off_t it = hdr->sbin_lists[i]; it; it = ((sbin_hdr_t *)get_ptr(ctx, it))->next) {
+            auto sb = (sbin_hdr_t *)get_ptr(ctx, it);
+            if (!usr2cb(sb)->sz.is_sbin || sb->cls != i || !sb->free_cnt) {
+                DBG("Small bin %lx is misplaced in the list %d", it, i);
+                return -1;
+            }
+            if (++sbin_list_cnt > sbin_free_cnt) {
+                DBG("The small bin lists have more bins than the region");
+                return -1;
+            }
+        }
+    if (sbin_list_cnt != sbin_free_cnt) {
+        DBG("The small bin lists have %ld bins, the region has %ld bins with free slots",
+                sbin_list_cnt, sbin_free_cnt);
+        return -1;
+    }
+
+    if (free_bytes != hdr->free_bytes || chunk_cnt != hdr->chunk_cnt ||
+            list_cnt + tree_cnt != hdr->free_chunk_cnt || sbin_cnt != hdr->sbin_cnt ||
+            sbin_used_slots != hdr->sbin_used_slots || released_bytes != hdr->released_bytes ||
+            memcmp(free_bytes_l2, hdr->free_bytes_l2, sizeof(free_bytes_l2)) != 0)
+    {
+        DBG("The counters don't match the region: free_bytes: %ld/%ld chunks: %ld/%ld "
+                "free chunks: %ld/%ld sbins: %ld/%ld sbin slots: %ld/%ld released: %ld/%ld",
+                hdr->free_bytes, free_bytes, hdr->chunk_cnt, chunk_cnt, hdr->free_chunk_cnt,
+                list_cnt + tree_cnt, hdr->sbin_cnt, sbin_cnt, hdr->sbin_used_slots,
+                sbin_used_slots, hdr->released_bytes, released_bytes);
+        return -1;
+    }
+    return 0;
 }
 
 void ap_malloc_dbg_print(ap_ctx_t *ctx) {
@@ -390,14 +1741,20 @@ void ap_malloc_dbg_print(ap_ctx_t *ctx) {
     DBG("\tsz:         %ld", (int64_t)hdr->sz);
     DBG("\tadd_mem():  %p" , ctx->add_mem_fn);
     DBG("\tfree_bmap:  %lx", (uint64_t)hdr->free_bmap);
+    DBG("\tfree_root:  %lx", (uint64_t)hdr->free_root);
+    for (int i = 0; i < SBIN_CNT; i++)
+        if (hdr->sbin_lists[i])
+            DBG("\tsbin[%3ld]: %lx", sbin_stride(i) - sizeof(border_sz_t), hdr->sbin_lists[i]);
     // DBG("\tfree_str:   %s" , free_list_str.c_str());
 
     auto cb = get_first_border(ctx);
     auto last_border = get_last_border(ctx);
     while (cb != last_border) {
         std::string offsets = sformat("%lx/%lx", get_offset(ctx, cb), get_offset(ctx, cb2usr(cb)));
-        DBG("[CB] off/usr: %16s sz: %8ld prev_sz: %8ld is_free: %1d prev_free: %16lx next_free: %16lx",
-                offsets.c_str(), cb->sz.sz, cb->prev_sz, cb->sz.is_free, cb->prev_free, cb->next_free);
+        DBG("[CB] off/usr: %16s sz: %8ld prev_sz: %8ld is_free: %1d is_node: %1d is_sbin: %1d "
+                "prev_free/left: %16lx next_free/right: %16lx", offsets.c_str(), cb->sz.sz,
+                cb->prev_sz, cb->sz.is_free, cb->sz.is_node, cb->sz.is_sbin, cb->prev_free,
+                cb->next_free);
         cb = next_border(cb);
     }
     DBG("\\AP_MALLOC");
@@ -20,9 +20,72 @@ using ap_off_t      = uint64_t;
 using ap_sz_t       = uint64_t;
 using ap_ctx_id_t   = uint64_t;
 
+struct ap_ctx_t;
+
+/* The functions bellow get the ctx of the region that they serve, such that one function can serve
+more regions. */
+
 /* This function will get the new requested size as a parameter and will return the real allocated
 size. It must alocate at least sz or return negative on error. */
-using ap_add_mem_fn_t = int (*)(ap_sz_t sz);
+using ap_add_mem_fn_t = int (*)(ap_ctx_t *ctx, ap_sz_t sz);
+
+/* This function will get the size by which the region shrinks at it's end, the memory after the new
+end is not used anymore. On error it must return negative and the region keeps it's size. */
+using ap_rm_mem_fn_t = int (*)(ap_ctx_t *ctx, ap_sz_t sz);
+
+/* This function will get a page aligned range of the region that is not used anymore, it's memory
+may be given back (the range must read as zero or as the old content after this). It must return
+negative on error. */
+using ap_release_mem_fn_t = int (*)(ap_ctx_t *ctx, ap_off_t off, ap_sz_t sz);
+
+enum {
+    /* Disables the small bins, all the allocations will be done as normal chunks. Freeing small bin
+    objects that where allocated before setting this flag still works. */
+    AP_MALLOC_FLAG_NO_SBIN = 1,
+
+    /* Makes the alloc/free functions safe to be called from multiple threads on the same region.
+    Each thread keeps a cache of small bin slots for each size class and it refills or flushes it
+    in batches, so the region's lock is taken only once per batch. Slots that are inside a
+    thread's cache are seen as allocated by the region until they are flushed, use
+    ap_malloc_flush_tcache for that (this is also done on thread exit). All the users of a region
+    must set this flag. */
+    AP_MALLOC_FLAG_THREAD_SAFE = 2,
+
+    /* For regions that are mapped by more processes at once, like a memfd or a shm. The region is
+    guarded by a process shared robust lock that lives inside the region and each change of the
+    chunk borders is journaled, such that if a process dies while holding the lock, the next one
+    that takes it will undo the unfinished operation and rebuild the free lists. The thread caches
+    are not used, as their slots would be lost with the process. The region must be initialized by
+    one process before the others attach to it and all of them must set this flag. add_mem_fn is
+    called with the lock held, the new space must become visible for all the processes. */
+    AP_MALLOC_FLAG_SHARED = 4,
+
+    /* Allocations of at least AP_MALLOC_PAGE_MIN_SZ bytes are placed on their own pages: they are
+    aligned to AP_MALLOC_PAGE_SZ and their size is rounded up to it. This way a write to such an
+    object will not dirty the pages of another object (see ap_storage) */
+    AP_MALLOC_FLAG_PAGE_ISOLATE = 8,
+
+    /* For regions that are backed by huge pages, either by a MAP_HUGETLB mapping (anonymous or a
+    hugetlb memfd) or by transparent huge pages. The region grows in multiples of
+    AP_MALLOC_HUGE_PAGE_SZ, so add_mem_fn is allways asked for whole huge pages, and the new space
+    is advised with MADV_HUGEPAGE (for hugetlb mappings this fails and is ignored, they don't need
+    it). ap_malloc_trim gives back only whole huge pages. The region's address and initial size
+    should be aligned to AP_MALLOC_HUGE_PAGE_SZ and all the users of a region must set this flag. */
+    AP_MALLOC_FLAG_HUGE_PAGES = 16,
+
+    /* For regions that are mapped read only, like the snapshots of ap_storage. ap_malloc_init only
+    attaches to an initialized region and doesn't write to it, after that only the functions that
+    don't change the region may be used: ap_malloc_ptr, ap_malloc_get_usr and the lookups of the
+    containers. The region's ctx_id can't be attached twice in the same process, so a region can't
+    be read this way by the process that writes it. */
+    AP_MALLOC_FLAG_READ_ONLY = 32,
+};
+
+#define AP_MALLOC_PAGE_SZ       4096
+#define AP_MALLOC_PAGE_MIN_SZ   4096
+#define AP_MALLOC_HUGE_PAGE_SZ  (2 * 1024 * 1024)
+
+struct ap_arena_t;
 
 struct ap_ctx_t {
     // The base of the region needs to be provided by the user. This is the memory that is used
@@ -37,26 +100,89 @@ struct ap_ctx_t {
     // malloc region.
     ap_add_mem_fn_t add_mem_fn;
 
+    // optional, used by ap_malloc_trim to give back the free space at the end of the region
+    ap_rm_mem_fn_t rm_mem_fn = nullptr;
+
+    // optional, used by ap_malloc_trim to give back the pages inside large free chunks. If it is
+    // not set madvise(MADV_DONTNEED) is used, that is enaugh for private mappings, for file
+    // backed regions this should punch a hole in the file.
+    ap_release_mem_fn_t release_mem_fn = nullptr;
+
     // This is a number that you can assign to a malloc instance. If a region was not initialized,
     // it will set this number into the malloc header for that region. If the region was initialized,
     // this number will be overrided into this structure. Specialized data structures will use this number
     // to get the ap_ctx and as such vectors can rezide inside malloc-ed regions. If an id is not
     // provided on first init the time in microseconds will be used as an id (0 is not valid).
     ap_ctx_id_t ctx_id = 0;
+
+    // AP_MALLOC_FLAG_* flags, those are not saved inside the region, they only affect the current
+    // user of the ap_ctx_t
+    uint32_t flags = 0;
+
+    // set only for the ctx of an arena (see ap_arena.h), the allocations on this ctx are forwarded
+    // to the arena
+    ap_arena_t *arena = nullptr;
 };
 
 /* The alocator will use a minimum requested size and will require the user to provide a function
 for allocations. The memory inside region MUST be zero if the alocator was not initialized
-before. sz must be aligned to 16 bytes */
+before. sz must be aligned to 16 bytes. A region that was made by a version of the allocator with
+another layout of the region is not used, -1 is returned and the region is left as it is */
 int ap_malloc_init(ap_ctx_t *ctx, ap_sz_t sz);
 
+/* Registered contexts are also held in a direct mapped table indexed by the low bits of their
+id, generated ids are chosen such that they land in a free slot. ap_malloc_get_ctx is called by
+the containers on each operation, so the table is checked inline and only if the id is not there
+the lookup falls back to ap_malloc_get_ctx_slow */
+#define AP_CTX_SLOT_CNT 64
+
+struct ap_ctx_slot_t {
+    ap_ctx_id_t id;
+    ap_ctx_t *ctx;
+};
+
+extern ap_ctx_slot_t ap_ctx_slots[AP_CTX_SLOT_CNT];
+
+ap_ctx_t *ap_malloc_get_ctx_slow(ap_ctx_id_t ctx_id);
+
+/* registers ctx under a new id without touching it's region, for contexts that share the region of
+an initialized one, like the arenas */
+int ap_malloc_register_ctx(ap_ctx_t *ctx);
+void ap_malloc_unregister_ctx(ap_ctx_t *ctx);
+
 /* returns the ap_ctx_t that is reflected by ctx_id */
-ap_ctx_t *ap_malloc_get_ctx(ap_ctx_id_t ctx_id);
+inline ap_ctx_t *ap_malloc_get_ctx(ap_ctx_id_t ctx_id) {
+    auto &slot = ap_ctx_slots[ctx_id & (AP_CTX_SLOT_CNT - 1)];
+    if (slot.id == ctx_id && ctx_id) [[likely]]
+        return slot.ctx;
+    return ap_malloc_get_ctx_slow(ctx_id);
+}
 
-/* self evident */
+/* self evident. Allocations of at most AP_MALLOC_SBIN_MAX_SZ bytes are served from small bins:
+chunks that are split in equal slots, each slot having only 8 bytes of overhead */
+#define AP_MALLOC_SBIN_MAX_SZ   248
 ap_off_t ap_malloc_alloc(ap_ctx_t *ctx, ap_sz_t sz);
 void ap_malloc_free(ap_ctx_t *ctx, ap_off_t ptr);
 
+/* align must be a power of 2, the padding in front of the object is given back as a free chunk.
+The result is freed with ap_malloc_free, but note that if ap_malloc_realloc needs to move the
+object the alignment is not kept */
+ap_off_t ap_malloc_alloc_aligned(ap_ctx_t *ctx, ap_sz_t sz, ap_sz_t align);
+
+/* Changes the size of an allocation. It is first resized in place: shrinking gives back the end of
+the chunk and growing absorbs the next chunk if it is free (growing the region if the chunk is the
+last one). Only if that fails the data is copied to a new allocation. As for realloc, a 0 ptr
+means alloc and a 0 sz means free, on failure 0 is returned and ptr stays valid */
+ap_off_t ap_malloc_realloc(ap_ctx_t *ctx, ap_off_t ptr, ap_sz_t sz);
+
+/* only the in place part of ap_malloc_realloc, returns 0 if the allocation now holds sz bytes or
+-1 if it was left untouched, usefull for objects that can't be copied byte by byte */
+int ap_malloc_realloc_inplace(ap_ctx_t *ctx, ap_off_t ptr, ap_sz_t sz);
+
+/* gives back to the region all the slots that are cached by the calling thread for this ctx, only
+usefull with AP_MALLOC_FLAG_THREAD_SAFE */
+void ap_malloc_flush_tcache(ap_ctx_t *ctx);
+
 /* A special slot is held inside the malloc header. This slot is meant to be populated by an
 aplication and it will hold a user provided number. For example it can hold the starting point of
 the data, in this way if an application allocated some data, another application using this same
@@ -68,6 +194,105 @@ ap_off_t ap_malloc_get_usr(ap_ctx_t *ctx);
 void *ap_malloc_ptr(ap_ctx_t *ctx, ap_off_t off);
 ap_off_t ap_malloc_off(ap_ctx_t *ctx, void *ptr);
 
+/* Compaction: the live chunks from the end of the region are moved in free chunks closer to it's
+start, such that the free space gathers at the end, from where it can be given back. Because the
+references to the objects are offsets that live in the region, the user must replace them after
+the objects are moved: fn is called with the table of the moves and it must change each stored
+offset to ap_malloc_reloc_off(table, off). Offsets that point inside a moved object move with it.
+The containers have a reloc(table) method that does this for the offsets they own (and for their
+elements, if those have one), so fn usually needs to call it only for the top level objects. The
+user slot is relocated by ap_malloc_compact.
+
+Only the moves that fit in budget_us microseconds are done by a call (0 means no limit), so it can
+be called repeatedly in between other work. It returns 1 when a pass over the whole region was done
+and then it also trims the end of the region if rm_mem_fn is set, 0 if there is more work to do, or negative on error.
+
+The region is locked while fn runs, fn must not allocate or free from it. No pointers to the
+objects may be held during the call. Aligned and page isolated objects are moved only to addresses
+with the same alignment, the ones aligned to more than 256KB are not moved. Not
+supported for AP_MALLOC_FLAG_SHARED, with AP_MALLOC_FLAG_THREAD_SAFE the small bins are not moved,
+as other threads may cache their slots. */
+struct ap_malloc_reloc_t {
+    ap_off_t old_off;
+    ap_off_t new_off;
+    ap_sz_t sz;
+};
+
+/* sorted by old_off */
+struct ap_malloc_reloc_table_t {
+    const ap_malloc_reloc_t *relocs;
+    uint64_t cnt;
+};
+
+inline ap_off_t ap_malloc_reloc_off(const ap_malloc_reloc_table_t *table, ap_off_t off) {
+    uint64_t l = 0, r = table->cnt;
+    while (l < r) {
+        uint64_t m = (l + r) / 2;
+        if (table->relocs[m].old_off <= off)
+            l = m + 1;
+        else
+            r = m;
+    }
+    if (!off || !l)
+        return off;
+    auto &rel = table->relocs[l - 1];
+    return off < rel.old_off + rel.sz ? rel.new_off + (off - rel.old_off) : off;
+}
+
+using ap_malloc_reloc_fn_t = void (*)(ap_ctx_t *ctx, const ap_malloc_reloc_table_t *table,
+        void *usr);
+int ap_malloc_compact(ap_ctx_t *ctx, ap_malloc_reloc_fn_t fn, void *usr, uint64_t budget_us);
+
+/* gives back the free space at the end of the region with rm_mem_fn (if set), in multiples of
+AP_MALLOC_PAGE_SZ, and then the pages inside the free chunks of at least min_sz bytes with
+release_mem_fn. The pages that hold the chunk headers are kept, so a released chunk costs nothing
+until it is allocated again, then it's pages are faulted back in (see refault_bytes). min_sz is
+at least AP_MALLOC_TRIM_MIN_SZ. Not supported for AP_MALLOC_FLAG_SHARED. */
+#define AP_MALLOC_TRIM_MIN_SZ   (64 * 1024)
+int ap_malloc_trim(ap_ctx_t *ctx, ap_sz_t min_sz = 0);
+
+/* Statistics about the region, the counters are kept in the malloc header, so this is cheap. The
+slots cached by threads (AP_MALLOC_FLAG_THREAD_SAFE) are seen as allocated. */
+struct ap_malloc_stats_t {
+    ap_sz_t region_sz;
+    ap_sz_t used_bytes;             /* allocated chunks, the small bins are counted whole */
+    ap_sz_t free_bytes;
+    ap_sz_t free_bytes_l2[64];      /* free bytes in chunks of size [2^i, 2^(i+1)) */
+    ap_sz_t largest_free;
+    uint64_t chunk_cnt;
+    uint64_t free_chunk_cnt;
+    uint64_t sbin_cnt;
+    uint64_t sbin_used_slots;
+    uint64_t alloc_cnt;             /* since the region was created, including other users */
+    uint64_t free_cnt;
+    double frag_ratio;              /* 1 - largest_free / free_bytes, 0 means no fragmentation */
+    double avg_search_len;          /* free lists or tree nodes checked per best fit search */
+    ap_sz_t released_bytes;         /* inside free chunks, given back by ap_malloc_trim */
+    ap_sz_t trimmed_bytes;          /* total given back by ap_malloc_trim, including the tail */
+    ap_sz_t refault_bytes;          /* released bytes that were allocated again */
+};
+
+ap_malloc_stats_t ap_malloc_stats(ap_ctx_t *ctx);
+
+/* info about a chunk of the region, off is the offset of the user memory of the chunk, for small
+bins that is the bin itself */
+struct ap_malloc_chunk_info_t {
+    ap_off_t off;
+    ap_sz_t sz;
+    bool is_free;
+    bool is_sbin;
+};
+
+/* fn is called for each chunk in address order, the walk stops if fn returns negative. The region
+is locked for the whole walk, so fn must not call other ap_malloc functions on it. */
+using ap_malloc_walk_fn_t = int (*)(const ap_malloc_chunk_info_t *info, void *usr);
+int ap_malloc_walk(ap_ctx_t *ctx, ap_malloc_walk_fn_t fn, void *usr);
+
+/* walks the whole region and checks the chunk borders, the free lists and tree, the small bins and
+the counters from ap_malloc_stats. Returns 0 if everything is consistent, on the first problem it
+prints it and returns -1. It is slow, use it for debugging. */
+int ap_malloc_validate(ap_ctx_t *ctx);
+
 void ap_malloc_dbg_print(ap_ctx_t *ctx);
 
 #endif
@@ -312,7 +312,28 @@ public:
         return *it;
     }
 
+    /* after ap_malloc_compact, replaces the offsets of the nodes and the ones owned by the keys and
+    values */
+    void reloc(const ap_malloc_reloc_table_t *table) {
+        avl.o.root = ap_malloc_reloc_off(table, avl.o.root);
+        reloc_node(table, avl.o.root);
+    }
+
 private:
+    void reloc_node(const ap_malloc_reloc_table_t *table, ap_off_t n) {
+        if (!n)
+            return ;
+        auto node = get_node(n);
+        node->left = ap_malloc_reloc_off(table, node->left);
+        node->right = ap_malloc_reloc_off(table, node->right);
+        if constexpr (requires (Key &key) { key.reloc(table); })
+            node->elem.first.reloc(table);
+        if constexpr (requires (Val &val) { val.reloc(table); })
+            node->elem.second.reloc(table);
+        reloc_node(table, node->left);
+        reloc_node(table, node->right);
+    }
+
     static int key_cmp_fn(const search_ctx_t& key_ctx, ap_off_t n) {
         auto node = key_ctx.parr->get_node(n);
         return *key_ctx.key < node->key() ? -1 : (node->key() < *key_ctx.key ? 1 : 0);
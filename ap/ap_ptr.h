@@ -38,6 +38,13 @@ struct ap_ptr_internal_t {
         ap_storage_destruct<T>(ptr.off);
         ptr.off = 0;
     }
+
+    void reloc(const ap_malloc_reloc_table_t *table) {
+        off = ap_malloc_reloc_off(table, off);
+        if constexpr (requires (T &obj) { obj.reloc(table); })
+            if (off)
+                (**this).reloc(table);
+    }
 };
 
 template <typename T>
@@ -45,6 +52,10 @@ struct ap_ptr_t {
     struct smptr_storage_t {
         ap_ptr_internal_t<T> ptr;
         uint64_t ref = 0;
+
+        void reloc(const ap_malloc_reloc_table_t *table) {
+            ptr.reloc(table);
+        }
     };
     ap_ptr_internal_t<smptr_storage_t> base;
 
@@ -120,6 +131,11 @@ struct ap_ptr_t {
         }
     }
 
+    /* the object may be shared by more ap_ptr_t, relocating it more than once does nothing */
+    void reloc(const ap_malloc_reloc_table_t *table) {
+        base.reloc(table);
+    }
+
     template <typename ...Args>
     static ap_ptr_t<T> mkptr(Args&& ...args) {
         ap_ptr_t<T> ret;
@@ -7,9 +7,66 @@
 #include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#include <linux/fs.h>
+#include <sys/uio.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <filesystem>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <array>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/* the async write protection and the pagemap scan are from linux 6.7, older headers don't have
+them, but the kernel we run on may */
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY         1
+#endif
+#ifndef UFFD_FEATURE_WP_HUGETLBFS_SHMEM
+#define UFFD_FEATURE_WP_HUGETLBFS_SHMEM (1 << 12)
+#endif
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC       (1 << 15)
+#endif
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_WRITTEN             (1 << 1)
+#define PM_SCAN_CHECK_WPASYNC       (1 << 1)
+#define PAGEMAP_SCAN                _IOWR('f', 16, struct pm_scan_arg)
+struct page_region {
+    __u64 start;
+    __u64 end;
+    __u64 categories;
+};
+struct pm_scan_arg {
+    __u64 size;
+    __u64 flags;
+    __u64 start;
+    __u64 end;
+    __u64 walk_end;
+    __u64 vec;
+    __u64 vec_len;
+    __u64 max_pages;
+    __u64 category_inverted;
+    __u64 category_mask;
+    __u64 category_anyof_mask;
+    __u64 return_mask;
+};
+#endif
 
 #define CTRL_SZ             4096
 #define STORAGE_MIN_SZ      4096
@@ -18,12 +75,30 @@
 
 #define STORAGE_MAGIC 0xa1ceface
 
+#define PAGEMAP_SOFT_DIRTY  (1ULL << 55)
+#define PAGEMAP_PRESENT     (1ULL << 63)
+
+#define LAZY_SEG_SZ         (64 * 1024 * 1024)
+#define HOT_MERGE_PAGES     16
+#define HOT_MAX_RANGES      4096
+
+#define CRC_CHUNK_PAGES     256
+
+#define WAL_MAGIC           0x3a1f0a11
+#define WAL_CKPT_SZ         (64 * 1024 * 1024)
+
 struct storage_ctrl_t {
     uint32_t magic = STORAGE_MAGIC; /* shows that this ctrl is initialized */
     uint32_t flag_in_use;           /* if this is 1 at load, then data_used points to a corrupted
                                     data backup. While syncing the data_used will change and the
                                     other backup will be used. */
     uint32_t data_used;             /* 1 or 0 */
+    uint32_t wal;                   /* the storage was created with AP_STORAGE_FLAG_WAL, it has one
+                                    data file and two logs */
+    uint64_t generation;            /* number of commits, the readers use it to see that the
+                                    snapshot they pinned is old */
+    uint32_t checksums;             /* the .crc files hold the checksums of the data files, it is
+                                    cleared by an open without AP_STORAGE_FLAG_CHECKSUMS */
 };
 
 ap_ctx_t *ap_static_ctx = NULL;
@@ -32,88 +107,1671 @@ static_assert(sizeof(storage_ctrl_t) < CTRL_SZ);
 
 /* TODO: check all the cases, really not sure if everything is ok(in this entire implementation) */
 
-static uint64_t bmap_get_word(uint64_t i);
-static void     bmap_set_word(uint64_t i, uint64_t w);
-static uint64_t bmap_get_size();
+/* The dirty map of a storage, a bit for each page. The words are mapped for the whole reservation
+and the kernel gives memory only to the ones that are written, a summary bit for each group of
+MOD_GROUP_WORDS words tells which groups may have bits set. So the map costs nothing for the pages
+that are not written and the searches and the clear skip the empty groups, the size of the storage
+doesn't matter. The words are set from the fault handler, so nothing there allocates. The sizes
+are in pages, like the vector that was used before. */
+#define MOD_GROUP_WORDS     64
+
+struct mod_bmap_data_t {
+    uint64_t *words = NULL;
+    uint64_t words_sz = 0;
+    std::vector<uint64_t> summary;
+    uint64_t word_cnt = 0;
+
+    ~mod_bmap_data_t() {
+        if (words)
+            munmap(words, words_sz);
+    }
+
+    int init(uint64_t max_pages) {
+        words_sz = DIV_UP(DIV_UP(max_pages, 64), MOD_GROUP_WORDS) * MOD_GROUP_WORDS * 8;
+        words = (uint64_t *)mmap(NULL, words_sz, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (words == MAP_FAILED) {
+            words = NULL;
+            DBGE("Failed to map the dirty map");
+            return -1;
+        }
+        return 0;
+    }
+
+    void set_word(uint64_t i, uint64_t w) {
+        words[i] = w;
+        uint64_t group = i / MOD_GROUP_WORDS;
+        if (w)
+            summary[group / 64] |= 1ULL << (group % 64);
+    }
+
+    uint64_t next_word(uint64_t i) const {
+        /* the first word from i on that is in a group with bits, or word_cnt */
+        uint64_t group = i / MOD_GROUP_WORDS;
+        while (group * MOD_GROUP_WORDS < word_cnt) {
+            uint64_t sw = summary[group / 64] >> (group % 64);
+            if (sw) {
+                group += __builtin_ctzll(sw);
+                return std::min(std::max(i, group * MOD_GROUP_WORDS), word_cnt);
+            }
+            group = (group / 64 + 1) * 64;
+        }
+        return word_cnt;
+    }
+
+    uint64_t size() const {
+        return word_cnt * 64;
+    }
+
+    void clear() {
+        for (uint64_t s = 0; s < summary.size(); s++) {
+            for (uint64_t sw = summary[s]; sw; sw &= sw - 1) {
+                uint64_t group = s * 64 + __builtin_ctzll(sw);
+                memset(words + group * MOD_GROUP_WORDS, 0, MOD_GROUP_WORDS * sizeof(uint64_t));
+            }
+            summary[s] = 0;
+        }
+        word_cnt = 0;
+    }
+
+    void resize(uint64_t pages) {
+        /* the words after the new end must be zero if the map grows back */
+        uint64_t cnt = DIV_UP(pages, 64);
+        for (uint64_t i = next_word(cnt); i < word_cnt; i = next_word(i + 1))
+            words[i] = 0;
+        word_cnt = cnt;
+        summary.resize(DIV_UP(cnt, (MOD_GROUP_WORDS * 64)));
+    }
+};
 
 struct mod_bmap_ctx_t {
     using W = uint64_t;
     using I = size_t;
     using SZ = size_t;
 
-    W    get_word_fn(I i) const { return bmap_get_word(i); }
-    void set_word_fn(I i, W w)  { bmap_set_word(i, w); }
-    SZ   get_sz_fn()      const { return bmap_get_size(); }
+    mod_bmap_data_t *data = nullptr;
+
+    W    get_word_fn(I i) const { return data->words[i]; }
+    void set_word_fn(I i, W w)  { data->set_word(i, w); }
+    SZ   get_sz_fn()      const { return data->word_cnt; }
     void resize_fn(SZ sz)       { ; }
+    I    next_word_fn(I i) const { return data->next_word(i); }
 };
 
 using mod_bmap_t = generic_bitmap_t<mod_bmap_ctx_t>;
 
+/* how the modified pages are found, see AP_STORAGE_FLAG_TRACK_* */
+enum {
+    TRACK_MPROTECT,
+    TRACK_SOFT_DIRTY,
+    TRACK_UFFD,
+};
+
+/* In WAL mode the data file is mapped private, so it holds only committed data. A commit appends
+one record with the dirty pages to the active log and the background thread copies the records of
+the other log in the data file (a checkpoint), after that the other log is emptied. When the
+active log is large enaugh the two logs switch places. */
+struct wal_rec_hdr_t {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t seq;           /* number of the commit, the records of both logs are replayed in order */
+    uint64_t storage_sz;    /* size of the storage at this commit */
+    uint64_t page_cnt;
+    uint64_t checksum;      /* of the page list and of the pages */
+};
+
+/* a record is the header and the list of pages, padded to a page, followed by the pages */
+struct wal_rec_t {
+    int log;
+    uint64_t off;
+    wal_rec_hdr_t hdr;
+    std::vector<uint64_t> pages;
+};
+
+/* where the last committed copy of a page is, while it is not yet in the data file */
+struct wal_loc_t {
+    int log;
+    uint64_t off;
+};
+
+/* A commit that is written in background (ap_storage_commit_async). The dirty set is frozen at the
+start, then the application keeps writing. A frozen page that is written again before the flush
+thread got to it is copied first by the write fault, so the log gets the page as it was at the
+freeze. The state of each frozen page decides who reads it: */
+enum {
+    FROZEN_PENDING,         /* not yet written, the page in the region is still the frozen one */
+    FROZEN_FLUSHING,        /* the flush thread is writing it from the region */
+    FROZEN_FLUSHED,         /* in the log, the region can change */
+    FROZEN_COPIED,          /* the frozen content is in copies, the region can change */
+};
+
+#define ASYNC_BATCH         256
+
+struct frozen_commit_t {
+    uint64_t seq;
+    uint64_t storage_sz;
+    uint64_t last_storage_sz;                           /* of the commit before this one */
+    bool sz_changed;
+    std::vector<uint64_t> pages;                        /* sorted */
+    std::unique_ptr<std::atomic<uint8_t>[]> state;      /* FROZEN_* for each page */
+    uint8_t *copies;                                    /* a page for each frozen page */
+
+    ap_storage_commit_cbk_t cbk;
+    void *ctx;
+    int result;
+};
+
+/* The savepoints of the transaction (ap_storage_savepoint). A page that is written for the first
+time after the last savepoint is copied in the log by the write fault before it changes, so a
+rollback copies back only the pages that changed after the savepoint. The arrays start with room
+for the pages that the storage has and double with mremap when they are full, so the fault handler
+appends to them without using the heap. The kernel gives memory only to what is used. */
+#define SP_MIN_CNT          1024
+#define SP_MAP_PAGES        (MAX_STORAGE_SPACE / PAGE_SZ)
+
+template <typename T>
+struct sp_array_t {
+    T *items = NULL;
+    uint64_t cap = 0;
+    uint64_t cnt = 0;
+
+    ~sp_array_t() {
+        if (items)
+            munmap(items, cap * sizeof(T));
+    }
+
+    int init(uint64_t init_cnt) {
+        if (items)
+            return 0;
+        init_cnt = std::max<uint64_t>(init_cnt, SP_MIN_CNT);
+        items = (T *)mmap(NULL, init_cnt * sizeof(T), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (items == MAP_FAILED) {
+            items = NULL;
+            DBGE("Failed to map the savepoint log");
+            return -1;
+        }
+        cap = init_cnt;
+        return 0;
+    }
+
+    T *push() {
+        if (cnt == cap) {
+            /* the items may move, they are only used by their index */
+            void *p = mremap(items, cap * sizeof(T), cap * 2 * sizeof(T), MREMAP_MAYMOVE);
+            if (p == MAP_FAILED)
+                return NULL;
+            items = (T *)p;
+            cap *= 2;
+        }
+        return &items[cnt++];
+    }
+
+    void truncate(uint64_t new_cnt) {
+        /* the memory of the dropped items is given back */
+        uint64_t from = UP_ALIGN(new_cnt * sizeof(T), PAGE_SZ);
+        uint64_t to = UP_ALIGN(cnt * sizeof(T), PAGE_SZ);
+        if (items && from < to)
+            madvise((uint8_t *)items + from, to - from, MADV_DONTNEED);
+        cnt = std::min(cnt, new_cnt);
+    }
+};
+
+struct sp_page_t {
+    uint8_t data[PAGE_SZ];
+};
+
+struct savepoint_t {
+    uint64_t log_cnt;       /* the log entries before the savepoint */
+    uint64_t storage_sz;
+};
+
+/* The replication stream (ap_storage_replicate). Each commit is a record: a repl_hdr_t, the pages
+that changed, each after a repl_page_hdr_t, and a page header with the index REPL_END, written
+after the commit is durable. A commit that fails after it started it's record ends it with
+REPL_ABORT. A page is sent whole, as zero, or as the runs of 8 byte words that differ from it's last
+commit, each run a repl_delta_t followed by the new words. The record is written as it is made, in
+pieces of REPL_FLUSH_SZ. */
+#define REPL_MAGIC          0x5e9117ca
+#define REPL_END            (~0ULL)
+#define REPL_ABORT          (~0ULL - 1)
+#define REPL_FLUSH_SZ       (1024 * 1024)
+
+enum {
+    REPL_PAGE_RAW,
+    REPL_PAGE_ZERO,
+    REPL_PAGE_DELTA,
+};
+
+struct repl_hdr_t {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t seq;           /* the generation of the commit, or it's sequence in WAL mode */
+    uint64_t storage_sz;
+};
+
+struct repl_page_hdr_t {
+    uint64_t page;
+    uint32_t enc;           /* REPL_PAGE_* */
+    uint32_t sz;            /* of the data that follows */
+};
+
+struct repl_delta_t {
+    uint16_t word;          /* index of the first uint64_t word of the run in the page */
+    uint16_t cnt;           /* of uint64_t words, cnt * 8 bytes follow */
+};
+
+/* All the state of an open storage. Each storage has it's own region inside it's own reservation,
+the fault handler and the ap_malloc callbacks find the storage by address (see find_storage). */
+struct ap_storage_t {
+    storage_ctrl_t *ctrl;
+    int ctrl_fd = -1;
+
+    std::string storage_dir;
+    std::string storage_name;
+    std::string storage_data_path[2];
+
+    int      storage_fd = -1;
+    int      backup_fd = -1;
+    uint64_t storage_sz;
+    ap_ctx_t storage_ctx;
+    uint64_t last_storage_sz;
+    void     *reserved_region;
+    uint64_t reserved_sz;
+
+    mod_bmap_t mod_bmap;
+    mod_bmap_data_t mod_bmap_data;
+
+    /* ranges given back by ap_malloc_trim since the last commit, on commit the holes are also
+    punched in the backup */
+    std::vector<std::pair<uint64_t, uint64_t>> released_ranges;
+
+    /* AP_STORAGE_FLAG_LAZY, the segments that have their tracking set up, the others are mapped
+    without access until they are used. The vector has a byte for each segment of the reservation,
+    so it never moves under the fault handler */
+    bool lazy;
+    std::vector<uint8_t> seg_armed;
+    bool prefetch;
+    std::string hot_path;
+
+    /* AP_STORAGE_FLAG_CHECKSUMS, the checksums of each data file are in the crc file with the same
+    index. crc_mu is held by a commit while it writes the backup and it's checksums, such that
+    ap_storage_verify, that reads them from another thread, sees whole commits */
+    bool checksums;
+    std::string crc_path[2];
+    int crc_fd[2] = {-1, -1};
+    std::mutex crc_mu;
+
+    int track_mode;
+    int uffd = -1;
+    int pagemap_fd = -1;
+    int clear_refs_fd = -1;
+
+    bool wal_mode;
+    std::string wal_path[2];
+    int wal_fd[2] = {-1, -1};
+    uint64_t wal_sz[2];
+    int wal_active;
+    uint64_t wal_seq;
+    uint64_t data_file_sz;
+
+    /* the members bellow are shared with the checkpoint thread */
+    std::mutex wal_mu;
+    std::condition_variable wal_cv;
+    std::thread wal_thread;
+    std::unordered_map<uint64_t, wal_loc_t> wal_index;
+    std::vector<uint64_t> wal_ckpt_pages;   /* pages that the last checkpoints wrote */
+    bool wal_ckpt_pending;
+    int wal_ckpt_log;
+    bool wal_stop;
+
+    /* the savepoints, see savepoint_t. sp_images and sp_pages are the log, sp_captured has the
+    pages copied since the last savepoint and sp_rw the pages that became writable since the last
+    savepoint, the next one protects only them. sp_tracking is false until the first savepoint of
+    the transaction protects all the modified pages (or if sp_rw is full). sp_lost is set if the log
+    is full, the savepoints can't be rolled back anymore */
+    std::vector<savepoint_t> savepoints;
+    sp_array_t<sp_page_t> sp_images;
+    sp_array_t<uint64_t> sp_pages;
+    sp_array_t<uint64_t> sp_rw;
+    mod_bmap_t sp_captured;
+    mod_bmap_data_t sp_captured_data;
+    bool sp_tracking = false;
+    bool sp_lost = false;
+
+    /* the number of active ap_storage_bulk_write_t, while there is one the memory added to the
+    storage is marked as modified and left writable */
+    int bulk_depth = 0;
+
+    /* ap_storage_replicate, repl_buf is the part of the record that was not written yet.
+    repl_full asks for all the pages in the next record */
+    int repl_fd = -1;
+    uint32_t repl_flags;
+    bool repl_full;
+    std::vector<uint8_t> repl_buf;
+
+    /* the async commit in flight, or the last one if it was not waited for. It is freed only by
+    the thread that writes the storage, as the fault handler reads it */
+    frozen_commit_t *async_commit;
+    std::thread async_thread;
+
+    ap_storage_cbk_t user_cbk;
+    void             *user_ctx;
+};
+
+/* The open storages, the fault handler reads this list, so the slots are atomic and a storage is
+taken out of it before it is freed. The handler is installed with the first storage that needs it
+and stays installed. */
+#define MAX_STORAGE_CNT     64
+
+static std::atomic<ap_storage_t *> storages[MAX_STORAGE_CNT];
+static std::mutex storages_mu;
 static struct sigaction old_sa;
-static storage_ctrl_t *ctrl;
-static int ctrl_fd;
+static bool handler_installed;
 
-static std::string storage_dir;
-static std::string storage_name;
-static std::string storage_data_path[2];
+/* the storage of ap_storage_init, used by the functions that don't take a storage */
+static ap_storage_t *default_storage;
 
-static int      storage_fd;
-static int      backup_fd;
-static uint64_t storage_sz;
-static ap_ctx_t storage_ctx;
-static uint64_t last_storage_sz;
+static ap_storage_t *find_storage(void *addr) {
+    for (auto &slot : storages) {
+        ap_storage_t *st = slot.load();
+        if (st && (uint8_t *)addr >= (uint8_t *)st->reserved_region &&
+                (uint8_t *)addr < (uint8_t *)st->reserved_region + st->reserved_sz)
+        {
+            return st;
+        }
+    }
+    return NULL;
+}
 
-static mod_bmap_t mod_bmap;
-static std::vector<uint64_t> mod_bmap_data;
+static std::string base_name(std::string path) {
+    return path.substr(path.find_last_of("/") + 1);
+}
 
-static uint64_t bmap_get_word(uint64_t i)               { return mod_bmap_data[i]; }
-static void     bmap_set_word(uint64_t i, uint64_t w)   { mod_bmap_data[i] = w; }
-static uint64_t bmap_get_size()                         { return mod_bmap_data.size(); }
+static std::string base_dir(std::string path) {
+    return path.substr(0, path.find_last_of("/") + 1);
+}
+
+static int clear_soft_dirty(ap_storage_t *st) {
+    /* this clears the bits of all the pages of the process, not only the storage's */
+    ASSERT_FN(write(st->clear_refs_fd, "4", 1));
+    return 0;
+}
+
+static bool soft_dirty_works(ap_storage_t *st) {
+    /* the kernel may be built without soft dirty bits, in which case the bit is never set */
+    auto page = (volatile uint8_t *)mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+        return false;
+    FnScope scope([page]{ munmap((void *)page, PAGE_SZ); });
+    page[0] = 1;
+    if (clear_soft_dirty(st) < 0)
+        return false;
+    page[0] = 2;
+    uint64_t entry = 0;
+    if (pread(st->pagemap_fd, &entry, sizeof(entry), uintptr_t(page) / PAGE_SZ * sizeof(entry)) !=
+            sizeof(entry))
+    {
+        return false;
+    }
+    return entry & PAGEMAP_SOFT_DIRTY;
+}
+
+static int track_init(ap_storage_t *st, uint32_t flags) {
+    bool soft_dirty = flags & AP_STORAGE_FLAG_TRACK_SOFT_DIRTY;
+    bool userfault = flags & AP_STORAGE_FLAG_TRACK_UFFD;
+    if (soft_dirty && userfault) {
+        DBG("Only one way of tracking the modified pages can be selected");
+        return -1;
+    }
+    st->track_mode = soft_dirty ? TRACK_SOFT_DIRTY : userfault ? TRACK_UFFD : TRACK_MPROTECT;
+    if (st->track_mode == TRACK_MPROTECT)
+        return 0;
+
+    ASSERT_FN(st->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC));
+    if (st->track_mode == TRACK_SOFT_DIRTY) {
+        ASSERT_FN(st->clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC));
+        if (!soft_dirty_works(st)) {
+            DBG("The kernel doesn't keep soft dirty bits");
+            return -1;
+        }
+        return 0;
+    }
+
+    /* in async mode the kernel removes the protection by itself on the first write, so there is
+    no thread to handle the faults, the written pages are found later with PAGEMAP_SCAN */
+    ASSERT_FN(st->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY));
+    uffdio_api api = {
+        .api = UFFD_API,
+        .features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED |
+                UFFD_FEATURE_WP_HUGETLBFS_SHMEM,
+        .ioctls = 0,
+    };
+    if (ioctl(st->uffd, UFFDIO_API, &api) < 0) {
+        DBGE("The kernel doesn't support async write protection");
+        return -1;
+    }
+    return 0;
+}
+
+static void track_uninit(ap_storage_t *st) {
+    for (int *fd : {&st->uffd, &st->pagemap_fd, &st->clear_refs_fd}) {
+        if (*fd >= 0)
+            close(*fd);
+        *fd = -1;
+    }
+}
+
+static int protect_pages(ap_storage_t *st, ap_off_t off, ap_sz_t sz) {
+    /* the next write to those pages will mark them as modified again */
+    void *addr = (uint8_t *)st->storage_ctx.region + off;
+    if (st->track_mode == TRACK_MPROTECT) {
+        ASSERT_FN(mprotect(addr, sz, PROT_READ));
+    }
+    else if (st->track_mode == TRACK_UFFD) {
+        uffdio_writeprotect wp = {
+            .range = { .start = uintptr_t(addr), .len = sz },
+            .mode = UFFDIO_WRITEPROTECT_MODE_WP,
+        };
+        ASSERT_FN(ioctl(st->uffd, UFFDIO_WRITEPROTECT, &wp));
+    }
+    /* the soft dirty bits are cleared all at once, at the end of a commit */
+    return 0;
+}
+
+static int arm_segment(ap_storage_t *st, uint64_t seg) {
+    /* the first access to a segment of a lazy storage, it's pages are protected as they would
+    have been at open */
+    uint64_t off = seg * LAZY_SEG_SZ;
+    uint64_t sz = std::min<uint64_t>(LAZY_SEG_SZ, st->storage_sz - off);
+    ASSERT_FN(protect_pages(st, off, sz));
+    if (st->track_mode != TRACK_MPROTECT)
+        ASSERT_FN(mprotect((uint8_t *)st->storage_ctx.region + off, sz, PROT_READ | PROT_WRITE));
+    st->seg_armed[seg] = true;
+    return 0;
+}
+
+static int arm_range(ap_storage_t *st, uint64_t off, uint64_t sz) {
+    /* for the places that change the protection of the pages by themselves */
+    if (!st->lazy)
+        return 0;
+    for (uint64_t seg = off / LAZY_SEG_SZ; seg < DIV_UP(off + sz, LAZY_SEG_SZ); seg++)
+        if (!st->seg_armed[seg])
+            ASSERT_FN(arm_segment(st, seg));
+    return 0;
+}
+
+static int track_pages(ap_storage_t *st, ap_off_t off, ap_sz_t sz) {
+    /* starts the tracking of newly mapped pages. With soft dirty a new mapping reports all it's
+    pages as modified until the next commit */
+    if (st->track_mode == TRACK_UFFD) {
+        uffdio_register reg = {
+            .range = { .start = uintptr_t(st->storage_ctx.region) + off, .len = sz },
+            .mode = UFFDIO_REGISTER_MODE_WP,
+            .ioctls = 0,
+        };
+        ASSERT_FN(ioctl(st->uffd, UFFDIO_REGISTER, &reg));
+    }
+    if (!st->lazy) {
+        ASSERT_FN(protect_pages(st, off, sz));
+        return 0;
+    }
+    /* in a lazy storage the pages of the segments that are not used yet are closed, the others
+    are protected as usual, each run of segments is done with one call */
+    uint64_t first = off;
+    while (first < off + sz) {
+        bool armed = st->seg_armed[first / LAZY_SEG_SZ];
+        uint64_t last = first;
+        while (last < off + sz && st->seg_armed[last / LAZY_SEG_SZ] == armed)
+            last = std::min<uint64_t>(off + sz, (last / LAZY_SEG_SZ + 1) * LAZY_SEG_SZ);
+        if (armed) {
+            ASSERT_FN(protect_pages(st, first, last - first));
+        }
+        else {
+            ASSERT_FN(mprotect((uint8_t *)st->storage_ctx.region + first, last - first,
+                    PROT_NONE));
+        }
+        first = last;
+    }
+    return 0;
+}
+
+static void hot_ranges_save(ap_storage_t *st) {
+    /* the pages of the used segments that are mapped, close pages are merged in one range. Those
+    are taken from the pagemap, mincore would also count the pages that the kernel read ahead */
+    int pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (pagemap_fd < 0) {
+        DBGE("Failed to open the pagemap");
+        return ;
+    }
+    FnScope scope([pagemap_fd]{ close(pagemap_fd); });
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    std::vector<uint64_t> entries(LAZY_SEG_SZ / PAGE_SZ);
+    for (uint64_t seg = 0; seg < DIV_UP(st->storage_sz, LAZY_SEG_SZ); seg++) {
+        if (!st->seg_armed[seg])
+            continue;
+        uint64_t off = seg * LAZY_SEG_SZ;
+        uint64_t sz = std::min<uint64_t>(LAZY_SEG_SZ, st->storage_sz - off);
+        uint64_t pos = (uintptr_t(st->storage_ctx.region) + off) / PAGE_SZ * sizeof(uint64_t);
+        ssize_t len = sz / PAGE_SZ * sizeof(uint64_t);
+        if (pread(pagemap_fd, entries.data(), len, pos) != len) {
+            DBGE("Failed to read the pagemap");
+            return ;
+        }
+        for (uint64_t i = 0; i < sz / PAGE_SZ; i++) {
+            if (!(entries[i] & PAGEMAP_PRESENT))
+                continue;
+            uint64_t page_off = off + i * PAGE_SZ;
+            if (ranges.size() && ranges.back().first + ranges.back().second +
+                    HOT_MERGE_PAGES * PAGE_SZ >= page_off)
+            {
+                ranges.back().second = page_off + PAGE_SZ - ranges.back().first;
+            }
+            else {
+                ranges.push_back({page_off, PAGE_SZ});
+            }
+        }
+    }
+    if (ranges.size() > HOT_MAX_RANGES) {
+        /* the largest ones are kept */
+        std::nth_element(ranges.begin(), ranges.begin() + HOT_MAX_RANGES, ranges.end(),
+                [](auto &a, auto &b){ return a.second > b.second; });
+        ranges.resize(HOT_MAX_RANGES);
+    }
+    int fd = open(st->hot_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        DBGE("Failed to save the hot ranges");
+        return ;
+    }
+    uint64_t sz = ranges.size() * sizeof(ranges[0]);
+    if (write(fd, ranges.data(), sz) != ssize_t(sz))
+        DBGE("Failed to save the hot ranges");
+    close(fd);
+}
+
+static void hot_ranges_prefetch(ap_storage_t *st) {
+    /* only a hint, the storage works the same without it */
+    int fd = open(st->hot_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return ;
+    std::pair<uint64_t, uint64_t> ranges[256];
+    ssize_t ret;
+    while ((ret = read(fd, ranges, sizeof(ranges))) > 0) {
+        for (ssize_t i = 0; i < ret / ssize_t(sizeof(ranges[0])); i++) {
+            auto [off, sz] = ranges[i];
+            if (off >= st->storage_sz)
+                continue;
+            sz = std::min(sz, st->storage_sz - off);
+            madvise((uint8_t *)st->storage_ctx.region + off, sz, MADV_WILLNEED);
+        }
+    }
+    close(fd);
+}
+
+static int collect_dirty_pages(ap_storage_t *st) {
+    /* with mprotect the pages are marked by mprot_handl as they are written, for the other two the
+    kernel knows them and we copy them in mod_bmap */
+    if (st->track_mode == TRACK_MPROTECT)
+        return 0;
+
+    uint64_t start = uintptr_t(st->storage_ctx.region);
+    uint64_t end = start + st->storage_sz;
+    if (st->track_mode == TRACK_SOFT_DIRTY) {
+        uint64_t entries[512];
+        for (uint64_t addr = start; addr < end; addr += sizeof(entries) / 8 * PAGE_SZ) {
+            uint64_t cnt = std::min<uint64_t>(sizeof(entries) / 8, (end - addr) / PAGE_SZ);
+            if (pread(st->pagemap_fd, entries, cnt * 8, addr / PAGE_SZ * 8) != ssize_t(cnt * 8)) {
+                DBGE("Failed to read the pagemap");
+                return -1;
+            }
+            for (uint64_t i = 0; i < cnt; i++)
+                if (entries[i] & PAGEMAP_SOFT_DIRTY)
+                    st->mod_bmap.set((addr - start) / PAGE_SZ + i, true);
+        }
+        return 0;
+    }
+
+    page_region regions[256];
+    pm_scan_arg arg = {
+        .size = sizeof(arg),
+        .flags = PM_SCAN_CHECK_WPASYNC,
+        .start = start,
+        .end = end,
+        .walk_end = 0,
+        .vec = uintptr_t(regions),
+        .vec_len = sizeof(regions) / sizeof(regions[0]),
+        .max_pages = 0,
+        .category_inverted = 0,
+        .category_mask = PAGE_IS_WRITTEN,
+        .category_anyof_mask = 0,
+        .return_mask = PAGE_IS_WRITTEN,
+    };
+    while (arg.start < arg.end) {
+        int cnt;
+        ASSERT_FN(cnt = ioctl(st->pagemap_fd, PAGEMAP_SCAN, &arg));
+        for (int i = 0; i < cnt; i++)
+            for (uint64_t a = regions[i].start; a < regions[i].end; a += PAGE_SZ)
+                st->mod_bmap.set((a - start) / PAGE_SZ, true);
+        arg.start = arg.walk_end;
+    }
+    return 0;
+}
+
+static int commit_mem_changes(ap_storage_t *st) {
+    /* the modified pages of the mapping are in the page cache of the file, a single fdatasync
+    writes all of them */
+    ASSERT_FN(collect_dirty_pages(st));
+    ASSERT_FN(fdatasync(st->storage_fd));
+    return 0;
+}
+
+static int copy_file_data(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t sz) {
+    /* copy_file_range copies inside the kernel (or shares the blocks, on file systems that can do
+    that), if it can't be used between the two files the data goes through a buffer */
+    static std::atomic<bool> use_copy_range = true;
+    while (sz && use_copy_range) {
+        loff_t in_pos = in_off, out_pos = out_off;
+        ssize_t ret = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, sz, 0);
+        if (ret < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP))
+        {
+            use_copy_range = false;
+            break;
+        }
+        ASSERT_FN(ret);
+        if (ret == 0) {
+            DBG("The file ended before %ld", in_off);
+            return -1;
+        }
+        in_off += ret;
+        out_off += ret;
+        sz -= ret;
+    }
+    std::vector<uint8_t> buff(std::min<uint64_t>(sz, 1024 * 1024));
+    while (sz) {
+        ssize_t ret;
+        ASSERT_FN(ret = pread(in_fd, buff.data(), std::min<uint64_t>(sz, buff.size()), in_off));
+        if (ret == 0) {
+            DBG("The file ended before %ld", in_off);
+            return -1;
+        }
+        for (ssize_t done = 0, wret; done < ret; done += wret)
+            ASSERT_FN(wret = pwrite(out_fd, buff.data() + done, ret - done, out_off + done));
+        in_off += ret;
+        out_off += ret;
+        sz -= ret;
+    }
+    return 0;
+}
+
+static int take_data_file(ap_storage_t *st, int idx, int *fd, int src_fd, uint64_t sz) {
+    /* the data file idx is going to be written, the readers that pinned it hold a shared lock on
+    it (see reader_pin). If there are any, the file is replaced by a copy of src_fd and they keep
+    the old one, so the writer never waits for a reader. The writer holds the exclusive lock for
+    as long as it writes the file. Returns 1 if the file was replaced. */
+    if (flock(*fd, LOCK_EX | LOCK_NB) == 0)
+        return 0;
+    if (errno != EWOULDBLOCK) {
+        DBGE("Failed to lock %s", st->storage_data_path[idx].c_str());
+        return -1;
+    }
+    std::string tmp_path = st->storage_data_path[idx] + ".tmp";
+    int tmp_fd;
+    ASSERT_FN(tmp_fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    FnScope err_scope([tmp_fd, tmp_path]{ close(tmp_fd); unlink(tmp_path.c_str()); });
+    ASSERT_FN(ftruncate(tmp_fd, sz));
+    ASSERT_FN(copy_file_data(src_fd, 0, tmp_fd, 0, sz));
+    ASSERT_FN(fdatasync(tmp_fd));
+    ASSERT_FN(flock(tmp_fd, LOCK_EX));
+    ASSERT_FN(rename(tmp_path.c_str(), st->storage_data_path[idx].c_str()));
+    err_scope.disable();
+    close(*fd);
+    *fd = tmp_fd;
+
+    /* the new name must be on disk before the commit that relies on it ends, else after a crash
+    the path may still lead to the reader's old copy */
+    int dir_fd;
+    ASSERT_FN(dir_fd = open(st->storage_dir.empty() ? "." : st->storage_dir.c_str(),
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    FnScope dir_scope([dir_fd]{ close(dir_fd); });
+    ASSERT_FN(fsync(dir_fd));
+    return 1;
+}
+
+/* CRC32C of whole pages. With SSE4.2 four pages are done at the same time: the crc32 instruction
+has a latency of three cycles, one page alone would wait on it, four independent ones keep it busy
+and the speed is that of the memory. Without it a table is used, a byte at a time. */
+static const auto crc32c_table = []{
+    std::array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        table[i] = crc;
+    }
+    return table;
+}();
+
+static uint32_t crc32c_sw(const uint8_t *data, uint64_t sz) {
+    uint32_t crc = ~0U;
+    for (uint64_t i = 0; i < sz; i++)
+        crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static void crc32c_pages_hw(const uint8_t *data, uint64_t cnt, uint32_t *crcs) {
+    constexpr uint64_t words = PAGE_SZ / sizeof(uint64_t);
+    uint64_t i = 0;
+    for (; i + 4 <= cnt; i += 4) {
+        auto p = (const uint64_t *)(data + i * PAGE_SZ);
+        uint64_t c0 = ~0U, c1 = ~0U, c2 = ~0U, c3 = ~0U;
+        for (uint64_t w = 0; w < words; w++) {
+            c0 = _mm_crc32_u64(c0, p[w]);
+            c1 = _mm_crc32_u64(c1, p[w + words]);
+            c2 = _mm_crc32_u64(c2, p[w + 2 * words]);
+            c3 = _mm_crc32_u64(c3, p[w + 3 * words]);
+        }
+        crcs[i] = ~uint32_t(c0);
+        crcs[i + 1] = ~uint32_t(c1);
+        crcs[i + 2] = ~uint32_t(c2);
+        crcs[i + 3] = ~uint32_t(c3);
+    }
+    for (; i < cnt; i++) {
+        auto p = (const uint64_t *)(data + i * PAGE_SZ);
+        uint64_t c = ~0U;
+        for (uint64_t w = 0; w < words; w++)
+            c = _mm_crc32_u64(c, p[w]);
+        crcs[i] = ~uint32_t(c);
+    }
+}
+#endif
+
+static void crc32c_pages(const uint8_t *data, uint64_t cnt, uint32_t *crcs) {
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if (hw) {
+        crc32c_pages_hw(data, cnt, crcs);
+        return ;
+    }
+#endif
+    for (uint64_t i = 0; i < cnt; i++)
+        crcs[i] = crc32c_sw(data + i * PAGE_SZ, PAGE_SZ);
+}
+
+static uint32_t crc32c_zero_page() {
+    static const uint32_t crc = []{
+        static const uint8_t zero[PAGE_SZ] = {};
+        uint32_t ret;
+        crc32c_pages(zero, 1, &ret);
+        return ret;
+    }();
+    return crc;
+}
+
+/* the checksums that a commit writes, a run for each run of pages */
+struct crc_run_t {
+    uint64_t first;
+    std::vector<uint32_t> crcs;
+};
+
+static void crc_compute(ap_storage_t *st, std::vector<crc_run_t> &runs) {
+    /* the dirty pages are read from the region, the pages that the storage grew by and that where
+    not written are zeros in the file */
+    uint64_t page_cnt = st->storage_sz / PAGE_SZ;
+    uint64_t first = st->mod_bmap.next_one(0);
+    while (first < page_cnt) {
+        uint64_t last = std::min(st->mod_bmap.next_zero(first), page_cnt);
+        runs.push_back({ .first = first, .crcs = std::vector<uint32_t>(last - first) });
+        crc32c_pages((uint8_t *)st->storage_ctx.region + first * PAGE_SZ, last - first,
+                runs.back().crcs.data());
+        first = last < page_cnt ? st->mod_bmap.next_one(last) : page_cnt;
+    }
+    for (uint64_t page = st->last_storage_sz / PAGE_SZ; page < page_cnt; page++) {
+        if (st->mod_bmap.get(page))
+            continue;
+        if (runs.empty() || runs.back().first + runs.back().crcs.size() != page)
+            runs.push_back({ .first = page, .crcs = {} });
+        runs.back().crcs.push_back(crc32c_zero_page());
+    }
+}
+
+static int crc_write(int fd, const std::vector<crc_run_t> &runs, uint64_t page_cnt) {
+    for (auto &run : runs) {
+        ssize_t sz = run.crcs.size() * sizeof(uint32_t);
+        if (pwrite(fd, run.crcs.data(), sz, run.first * sizeof(uint32_t)) != sz) {
+            DBGE("Failed to write the checksums");
+            return -1;
+        }
+    }
+    ASSERT_FN(ftruncate(fd, page_cnt * sizeof(uint32_t)));
+    ASSERT_FN(fdatasync(fd));
+    return 0;
+}
+
+static int read_pages(int fd, uint8_t *buff, uint64_t first, uint64_t cnt) {
+    ssize_t sz = cnt * PAGE_SZ;
+    if (pread(fd, buff, sz, first * PAGE_SZ) != sz) {
+        DBGE("Failed to read the pages [%ld, %ld)", first, first + cnt);
+        return -1;
+    }
+    return 0;
+}
+
+static int read_crcs(int fd, uint32_t *crcs, uint64_t first, uint64_t cnt) {
+    ssize_t sz = cnt * sizeof(uint32_t);
+    if (pread(fd, crcs, sz, first * sizeof(uint32_t)) != sz) {
+        DBGE("Failed to read the checksums of the pages [%ld, %ld)", first, first + cnt);
+        return -1;
+    }
+    return 0;
+}
+
+template <typename Fn>
+static int crc_parallel(uint64_t page_cnt, Fn &&fn) {
+    /* fn(first, cnt, buff) is called for each chunk of pages, from a thread for each core, buff
+    has room for a chunk */
+    uint64_t chunk_cnt = DIV_UP(page_cnt, CRC_CHUNK_PAGES);
+    uint64_t thread_cnt = std::min<uint64_t>(std::max(std::thread::hardware_concurrency(), 1U),
+            chunk_cnt);
+    std::atomic<uint64_t> next_chunk = 0;
+    std::atomic<bool> failed = false;
+    auto worker = [&]{
+        std::vector<uint8_t> buff(CRC_CHUNK_PAGES * PAGE_SZ);
+        for (uint64_t chunk; !failed && (chunk = next_chunk++) < chunk_cnt;) {
+            uint64_t first = chunk * CRC_CHUNK_PAGES;
+            if (fn(first, std::min<uint64_t>(CRC_CHUNK_PAGES, page_cnt - first), buff.data()) < 0)
+                failed = true;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint64_t i = 1; i < thread_cnt; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+    return failed ? -1 : 0;
+}
+
+static int crc_open(ap_storage_t *st, uint64_t page_cnt, bool verify) {
+    /* both data files hold the same commit here. If there are no checksums they are made from the
+    storage file, else the storage file is checked against them if asked */
+    for (int i = 0; i < 2; i++) {
+        ASSERT_FN(st->crc_fd[i] = open(st->crc_path[i].c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                0666));
+    }
+    int idx = st->ctrl->data_used;
+    if (!st->ctrl->checksums) {
+        DBG("Making the checksums of %ld pages", page_cnt);
+        std::vector<crc_run_t> runs = {{ .first = 0, .crcs = std::vector<uint32_t>(page_cnt) }};
+        ASSERT_FN(crc_parallel(page_cnt, [&](uint64_t first, uint64_t cnt, uint8_t *buff) {
+            ASSERT_FN(read_pages(st->storage_fd, buff, first, cnt));
+            crc32c_pages(buff, cnt, runs[0].crcs.data() + first);
+            return 0;
+        }));
+        ASSERT_FN(crc_write(st->crc_fd[0], runs, page_cnt));
+        ASSERT_FN(crc_write(st->crc_fd[1], runs, page_cnt));
+        st->ctrl->checksums = true;
+        ASSERT_FN(msync(st->ctrl, CTRL_SZ, MS_SYNC));
+        return 0;
+    }
+    if (!verify)
+        return 0;
+
+    std::mutex bad_mu;
+    std::vector<uint64_t> bad;
+    ASSERT_FN(crc_parallel(page_cnt, [&](uint64_t first, uint64_t cnt, uint8_t *buff) {
+        uint32_t crcs[CRC_CHUNK_PAGES], expected[CRC_CHUNK_PAGES];
+        ASSERT_FN(read_pages(st->storage_fd, buff, first, cnt));
+        ASSERT_FN(read_crcs(st->crc_fd[idx], expected, first, cnt));
+        crc32c_pages(buff, cnt, crcs);
+        for (uint64_t i = 0; i < cnt; i++) {
+            if (crcs[i] != expected[i]) {
+                std::lock_guard guard(bad_mu);
+                bad.push_back(first + i);
+            }
+        }
+        return 0;
+    }));
+
+    /* the backup has the same commit, a page is taken from there if it is good */
+    std::vector<uint8_t> page(PAGE_SZ);
+    for (auto p : bad) {
+        uint32_t crc, expected;
+        ASSERT_FN(read_pages(st->backup_fd, page.data(), p, 1));
+        ASSERT_FN(read_crcs(st->crc_fd[!idx], &expected, p, 1));
+        crc32c_pages(page.data(), 1, &crc);
+        if (crc != expected) {
+            DBG("Page %ld is bad in both data files", p);
+            return -1;
+        }
+        if (pwrite(st->storage_fd, page.data(), PAGE_SZ, p * PAGE_SZ) != PAGE_SZ) {
+            DBGE("Failed to write page %ld", p);
+            return -1;
+        }
+        DBG("Page %ld didn't match it's checksum, it was taken from the backup", p);
+    }
+    if (bad.size())
+        ASSERT_FN(fdatasync(st->storage_fd));
+    return 0;
+}
+
+static void crc_close(ap_storage_t *st) {
+    for (int &fd : st->crc_fd) {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+}
+
+static void repl_flush(ap_storage_t *st) {
+    /* a follower that can't be written to is dropped, the storage doesn't depend on it */
+    uint64_t off = 0;
+    while (st->repl_fd >= 0 && off < st->repl_buf.size()) {
+        ssize_t ret = write(st->repl_fd, st->repl_buf.data() + off, st->repl_buf.size() - off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            DBGE("Failed to write the replication stream, it is stopped");
+            st->repl_fd = -1;
+            break;
+        }
+        off += ret;
+    }
+    st->repl_buf.clear();
+}
+
+static void repl_append(ap_storage_t *st, const void *data, uint64_t sz) {
+    auto p = (const uint8_t *)data;
+    st->repl_buf.insert(st->repl_buf.end(), p, p + sz);
+}
+
+static void repl_begin(ap_storage_t *st, uint64_t seq, uint64_t storage_sz) {
+    repl_hdr_t hdr = { .magic = REPL_MAGIC, .reserved = 0, .seq = seq, .storage_sz = storage_sz };
+    repl_append(st, &hdr, sizeof(hdr));
+}
+
+static void repl_end(ap_storage_t *st, uint64_t page) {
+    /* page is REPL_END or REPL_ABORT */
+    if (st->repl_fd < 0)
+        return ;
+    repl_page_hdr_t ph = { .page = page, .enc = 0, .sz = 0 };
+    repl_append(st, &ph, sizeof(ph));
+    repl_flush(st);
+    st->repl_buf.shrink_to_fit();
+    if (page == REPL_END && st->repl_fd >= 0)
+        st->repl_full = false;
+}
+
+static void repl_add_page(ap_storage_t *st, uint64_t page, const uint8_t *data,
+        const uint8_t *old)
+{
+    /* old is the page at the last commit, if it is known */
+    if (st->repl_fd < 0)
+        return ;
+    const uint64_t word_cnt = PAGE_SZ / sizeof(uint64_t);
+    auto words = (const uint64_t *)data;
+    repl_page_hdr_t ph = { .page = page, .enc = REPL_PAGE_ZERO, .sz = 0 };
+    uint64_t hdr_pos = st->repl_buf.size();
+    repl_append(st, &ph, sizeof(ph));
+    if (std::all_of(words, words + word_cnt, [](uint64_t w){ return w == 0; })) {
+        /* the header is enaugh */
+    }
+    else if (old && (st->repl_flags & AP_STORAGE_REPL_DELTA)) {
+        auto old_words = (const uint64_t *)old;
+        uint64_t start = st->repl_buf.size();
+        for (uint64_t i = 0; i < word_cnt && st->repl_buf.size() - start < PAGE_SZ;) {
+            if (words[i] == old_words[i]) {
+                i++;
+                continue;
+            }
+            uint64_t j = i;
+            while (j < word_cnt && words[j] != old_words[j])
+                j++;
+            repl_delta_t d = { .word = uint16_t(i), .cnt = uint16_t(j - i) };
+            repl_append(st, &d, sizeof(d));
+            repl_append(st, words + i, (j - i) * sizeof(uint64_t));
+            i = j;
+        }
+        /* a delta that is not smaller than the page is sent as the page */
+        ph.enc = REPL_PAGE_DELTA;
+        ph.sz = st->repl_buf.size() - start;
+        if (ph.sz >= PAGE_SZ) {
+            st->repl_buf.resize(start);
+            ph.enc = REPL_PAGE_RAW;
+            ph.sz = PAGE_SZ;
+            repl_append(st, data, PAGE_SZ);
+        }
+    }
+    else {
+        ph.enc = REPL_PAGE_RAW;
+        ph.sz = PAGE_SZ;
+        repl_append(st, data, PAGE_SZ);
+    }
+    memcpy(st->repl_buf.data() + hdr_pos, &ph, sizeof(ph));
+    if (st->repl_buf.size() >= REPL_FLUSH_SZ)
+        repl_flush(st);
+}
+
+static void repl_add_run(ap_storage_t *st, uint64_t first, uint64_t last, int old_fd,
+        uint64_t old_cnt)
+{
+    /* the pages [first, last) from the region, old_fd holds the last commit of the first old_cnt
+    pages of the storage (-1 if there is none), it is read only for the deltas */
+    if (st->repl_fd < 0)
+        return ;
+    if (old_fd < 0 || !(st->repl_flags & AP_STORAGE_REPL_DELTA))
+        old_cnt = 0;
+    std::vector<uint8_t> old;
+    for (uint64_t chunk = first; chunk < last; chunk += CRC_CHUNK_PAGES) {
+        uint64_t end = std::min<uint64_t>(chunk + CRC_CHUNK_PAGES, last);
+        uint64_t old_end = std::clamp(old_cnt, chunk, end);
+        old.resize((old_end - chunk) * PAGE_SZ);
+        if (old_end > chunk && read_pages(old_fd, old.data(), chunk, old_end - chunk) < 0)
+            old_end = chunk;
+        for (uint64_t page = chunk; page < end; page++)
+            repl_add_page(st, page, (uint8_t *)st->storage_ctx.region + page * PAGE_SZ,
+                    page < old_end ? old.data() + (page - chunk) * PAGE_SZ : NULL);
+    }
+}
+
+static uint64_t wal_list_sz(uint64_t page_cnt) {
+    return DIV_UP(sizeof(wal_rec_hdr_t) + page_cnt * sizeof(uint64_t), PAGE_SZ) * PAGE_SZ;
+}
+
+static uint64_t wal_checksum(uint64_t h, const void *data, uint64_t sz) {
+    auto words = (const uint64_t *)data;
+    for (uint64_t i = 0; i < sz / sizeof(uint64_t); i++)
+        h = (h ^ words[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static int wal_read_records(ap_storage_t *st, int log, bool verify, std::vector<wal_rec_t> &recs) {
+    /* reads the records of a log until the end or until a record that was not fully written */
+    struct stat st_log;
+    ASSERT_FN(fstat(st->wal_fd[log], &st_log));
+    uint64_t off = 0;
+    std::vector<uint8_t> page(PAGE_SZ);
+    while (off + PAGE_SZ <= uint64_t(st_log.st_size)) {
+        wal_rec_t rec = { .log = log, .off = off, .hdr = {}, .pages = {} };
+        ASSERT_FN(pread(st->wal_fd[log], &rec.hdr, sizeof(rec.hdr), off));
+        uint64_t list_sz = wal_list_sz(rec.hdr.page_cnt);
+        if (rec.hdr.magic != WAL_MAGIC || off + list_sz + rec.hdr.page_cnt * PAGE_SZ >
+                uint64_t(st_log.st_size))
+        {
+            break;
+        }
+        rec.pages.resize(rec.hdr.page_cnt);
+        ssize_t list_bytes = rec.hdr.page_cnt * sizeof(uint64_t);
+        if (pread(st->wal_fd[log], rec.pages.data(), list_bytes, off + sizeof(rec.hdr)) !=
+                list_bytes)
+        {
+            break;
+        }
+        if (verify) {
+            uint64_t h = wal_checksum(rec.hdr.seq, rec.pages.data(), list_bytes);
+            for (uint64_t i = 0; i < rec.hdr.page_cnt; i++) {
+                ASSERT_FN(pread(st->wal_fd[log], page.data(), PAGE_SZ,
+                        off + list_sz + i * PAGE_SZ));
+                h = wal_checksum(h, page.data(), PAGE_SZ);
+            }
+            if (h != rec.hdr.checksum) {
+                DBG("Log %d has a torn record at %ld, it is dropped", log, off);
+                break;
+            }
+        }
+        off += list_sz + rec.hdr.page_cnt * PAGE_SZ;
+        recs.push_back(std::move(rec));
+    }
+    return 0;
+}
+
+static int wal_apply(ap_storage_t *st, const wal_rec_t &rec) {
+    /* the pages are copied in runs that are consecutive both in the log and in the data file */
+    uint64_t pages_off = rec.off + wal_list_sz(rec.hdr.page_cnt);
+    uint64_t i = 0;
+    while (i < rec.pages.size()) {
+        uint64_t j = i + 1;
+        while (j < rec.pages.size() && rec.pages[j] == rec.pages[j - 1] + 1)
+            j++;
+        ASSERT_FN(copy_file_data(st->wal_fd[rec.log], pages_off + i * PAGE_SZ, st->storage_fd,
+                rec.pages[i] * PAGE_SZ, (j - i) * PAGE_SZ));
+        i = j;
+    }
+    return 0;
+}
+
+static int wal_checkpoint(ap_storage_t *st, int log) {
+    /* the log is only read here, the commits go to the other log */
+    std::vector<wal_rec_t> recs;
+    ASSERT_FN(wal_read_records(st, log, false, recs));
+    for (auto &rec : recs)
+        ASSERT_FN(wal_apply(st, rec));
+    ASSERT_FN(fdatasync(st->storage_fd));
+
+    std::lock_guard guard(st->wal_mu);
+    for (auto &rec : recs)
+        for (auto page : rec.pages) {
+            auto it = st->wal_index.find(page);
+            if (it != st->wal_index.end() && it->second.log == log) {
+                st->wal_index.erase(it);
+                st->wal_ckpt_pages.push_back(page);
+            }
+        }
+    ASSERT_FN(ftruncate(st->wal_fd[log], 0));
+    st->wal_sz[log] = 0;
+    return 0;
+}
+
+static void wal_thread_fn(ap_storage_t *st) {
+    std::unique_lock lock(st->wal_mu);
+    while (true) {
+        st->wal_cv.wait(lock, [st]{ return st->wal_ckpt_pending || st->wal_stop; });
+        if (!st->wal_ckpt_pending)
+            return ;
+        int log = st->wal_ckpt_log;
+        lock.unlock();
+        if (wal_checkpoint(st, log) < 0)
+            DBG("Failed to checkpoint log %d, it will be tried again", log);
+        lock.lock();
+        st->wal_ckpt_pending = false;
+        st->wal_cv.notify_all();
+    }
+}
+
+static int wal_recover(ap_storage_t *st) {
+    /* the records of both logs are copied in the data file in the order of the commits, then the
+    logs can be emptied */
+    std::vector<wal_rec_t> recs;
+    ASSERT_FN(wal_read_records(st, 0, true, recs));
+    ASSERT_FN(wal_read_records(st, 1, true, recs));
+    std::sort(recs.begin(), recs.end(), [](auto &a, auto &b){ return a.hdr.seq < b.hdr.seq; });
+    for (auto &rec : recs)
+        ASSERT_FN(wal_apply(st, rec));
+    if (recs.size()) {
+        DBG("Replayed %ld commits from the logs", recs.size());
+        ASSERT_FN(ftruncate(st->storage_fd, recs.back().hdr.storage_sz));
+    }
+    ASSERT_FN(fdatasync(st->storage_fd));
+    ASSERT_FN(ftruncate(st->wal_fd[0], 0));
+    ASSERT_FN(ftruncate(st->wal_fd[1], 0));
+    return 0;
+}
+
+static int wal_open(ap_storage_t *st) {
+    for (int i = 0; i < 2; i++)
+        ASSERT_FN(st->wal_fd[i] = open(st->wal_path[i].c_str(), O_RDWR | O_CREAT, 0666));
+    ASSERT_FN(wal_recover(st));
+    st->wal_sz[0] = st->wal_sz[1] = 0;
+    st->wal_active = 0;
+    st->wal_seq = 1;
+    st->wal_stop = false;
+    st->wal_ckpt_pending = false;
+    st->wal_thread = std::thread(wal_thread_fn, st);
+    return 0;
+}
+
+static void wal_close(ap_storage_t *st) {
+    /* the thread finishes it's checkpoint, then the rest of the logs are written here, the older
+    log first */
+    {
+        std::lock_guard guard(st->wal_mu);
+        st->wal_stop = true;
+        st->wal_cv.notify_all();
+    }
+    st->wal_thread.join();
+    if (wal_checkpoint(st, !st->wal_active) < 0 || wal_checkpoint(st, st->wal_active) < 0)
+        DBG("Failed to checkpoint the logs, they will be replayed at the next init");
+    for (int i = 0; i < 2; i++) {
+        close(st->wal_fd[i]);
+        st->wal_fd[i] = -1;
+    }
+    st->wal_index.clear();
+    st->wal_ckpt_pages.clear();
+}
+
+static int wal_write(ap_storage_t *st, int log, uint64_t off, std::vector<iovec> &iov) {
+    for (uint64_t i = 0; i < iov.size(); ) {
+        int cnt = std::min<uint64_t>(iov.size() - i, IOV_MAX);
+        ssize_t ret;
+        ASSERT_FN(ret = pwritev(st->wal_fd[log], &iov[i], cnt, off));
+        off += ret;
+        /* skip what was written, a partial write leaves the rest of an iovec for the next call */
+        while (i < iov.size() && ret >= ssize_t(iov[i].iov_len)) {
+            ret -= iov[i].iov_len;
+            i++;
+        }
+        if (ret) {
+            iov[i].iov_base = (uint8_t *)iov[i].iov_base + ret;
+            iov[i].iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+static void wal_drop_checkpointed(ap_storage_t *st) {
+    /* the private copies of the pages that are now in the data file and that where not written
+    since are dropped, the mapping reads them again from the data file */
+    std::vector<uint64_t> pages;
+    {
+        std::lock_guard guard(st->wal_mu);
+        pages.swap(st->wal_ckpt_pages);
+        std::erase_if(pages, [st](uint64_t page){ return st->wal_index.count(page); });
+    }
+    std::sort(pages.begin(), pages.end());
+    for (auto page : pages)
+        if (page < st->storage_sz / PAGE_SZ && !st->mod_bmap.get(page))
+            madvise((uint8_t *)st->storage_ctx.region + page * PAGE_SZ, PAGE_SZ, MADV_DONTNEED);
+}
+
+static frozen_commit_t *wal_freeze(ap_storage_t *st) {
+    /* takes the dirty pages of the transaction and starts the next one, the frozen pages are
+    protected again so their next write is seen */
+    if (collect_dirty_pages(st) < 0)
+        return NULL;
+    wal_drop_checkpointed(st);
+
+    auto fc = new frozen_commit_t{};
+    std::vector<std::pair<uint64_t, uint64_t>> runs;
+    uint64_t page_cnt = st->storage_sz / PAGE_SZ;
+    uint64_t first = st->mod_bmap.next_one(0);
+    while (first < page_cnt) {
+        uint64_t last = std::min(st->mod_bmap.next_zero(first), page_cnt);
+        runs.push_back({first, last});
+        for (uint64_t page = first; page < last; page++)
+            fc->pages.push_back(page);
+        first = last < page_cnt ? st->mod_bmap.next_one(last) : page_cnt;
+    }
+    fc->seq = st->wal_seq++;
+    fc->storage_sz = st->storage_sz;
+    fc->last_storage_sz = st->last_storage_sz;
+    fc->sz_changed = st->storage_sz != st->last_storage_sz;
+    fc->state = std::make_unique<std::atomic<uint8_t>[]>(fc->pages.size());
+
+    for (auto [first, last] : runs) {
+        if (protect_pages(st, first * PAGE_SZ, (last - first) * PAGE_SZ) < 0) {
+            delete fc;
+            return NULL;
+        }
+    }
+    if (st->track_mode == TRACK_SOFT_DIRTY && clear_soft_dirty(st) < 0) {
+        delete fc;
+        return NULL;
+    }
+    st->mod_bmap_data.clear();
+    st->mod_bmap_data.resize(DIV_UP(st->storage_sz, PAGE_SZ));
+    st->last_storage_sz = st->storage_sz;
+    return fc;
+}
+
+static void frozen_free(frozen_commit_t *fc) {
+    if (fc->copies)
+        munmap(fc->copies, fc->pages.size() * PAGE_SZ);
+    delete fc;
+}
+
+static void frozen_preserve(ap_storage_t *st, uint64_t first, uint64_t last) {
+    /* called before the pages [first, last) of the region change, the frozen ones that the flush
+    thread didn't write yet are copied aside. If the flush thread is writing one of them we wait,
+    that is at most one batch. */
+    frozen_commit_t *fc = st->async_commit;
+    if (!fc || !fc->copies)
+        return ;
+    auto it = std::lower_bound(fc->pages.begin(), fc->pages.end(), first);
+    for (; it != fc->pages.end() && *it < last; it++) {
+        uint64_t i = it - fc->pages.begin();
+        if (fc->state[i].load() == FROZEN_PENDING) {
+            memcpy(fc->copies + i * PAGE_SZ, (uint8_t *)st->storage_ctx.region + *it * PAGE_SZ,
+                    PAGE_SZ);
+            uint8_t expected = FROZEN_PENDING;
+            if (fc->state[i].compare_exchange_strong(expected, FROZEN_COPIED))
+                continue;
+        }
+        while (fc->state[i].load() == FROZEN_FLUSHING)
+            sched_yield();
+    }
+}
+
+static void sp_capture(ap_storage_t *st, uint64_t first, uint64_t last) {
+    /* called before the pages [first, last) change, the ones that where not copied since the last
+    savepoint are copied in the log. Called from the fault handler, so nothing here allocates */
+    if (st->savepoints.empty() || st->sp_lost)
+        return ;
+    for (uint64_t page = first; page < last; page++) {
+        if (st->sp_captured.get(page))
+            continue;
+        sp_page_t *img = st->sp_images.push();
+        uint64_t *idx = st->sp_pages.push();
+        if (!img || !idx) {
+            st->sp_lost = true;
+            return ;
+        }
+        memcpy(img, (uint8_t *)st->storage_ctx.region + page * PAGE_SZ, PAGE_SZ);
+        *idx = page;
+        st->sp_captured.set(page, true);
+    }
+}
+
+static void sp_writable(ap_storage_t *st, uint64_t first, uint64_t last) {
+    /* the pages [first, last) can be written without a fault from now on */
+    if (!st->sp_tracking)
+        return ;
+    for (uint64_t page = first; page < last; page++) {
+        uint64_t *rw = st->sp_rw.push();
+        if (!rw) {
+            /* the next savepoint protects all the modified pages */
+            st->sp_tracking = false;
+            return ;
+        }
+        *rw = page;
+    }
+}
+
+static void sp_reset(ap_storage_t *st) {
+    /* the commits and the reverts protect all the modified pages, the savepoints end with them */
+    st->savepoints.clear();
+    st->sp_images.truncate(0);
+    st->sp_pages.truncate(0);
+    st->sp_rw.truncate(0);
+    if (st->sp_captured_data.words) {
+        st->sp_captured_data.clear();
+        st->sp_captured_data.resize(SP_MAP_PAGES);
+    }
+    st->sp_tracking = false;
+    st->sp_lost = false;
+}
+
+static int mark_pages(ap_storage_t *st, uint64_t first, uint64_t last) {
+    /* what the fault handler does for a page that is written, for all the pages [first, last) at
+    once. The kernel sees the writes for the other tracking modes, only the dirty map is set */
+    ASSERT_FN(arm_range(st, first * PAGE_SZ, (last - first) * PAGE_SZ));
+    frozen_preserve(st, first, last);
+    sp_capture(st, first, last);
+    for (uint64_t page = first; page < last; page++)
+        st->mod_bmap.set(page, true);
+    if (st->track_mode == TRACK_MPROTECT) {
+        ASSERT_FN(mprotect((uint8_t *)st->storage_ctx.region + first * PAGE_SZ,
+                (last - first) * PAGE_SZ, PROT_READ | PROT_WRITE));
+        sp_writable(st, first, last);
+    }
+    return 0;
+}
+
+static int wal_flush(ap_storage_t *st, frozen_commit_t *fc) {
+    /* one record for the frozen pages, written in batches and then one fdatasync. The header is
+    written last, until then the recovery stops before this record. */
+    uint64_t page_cnt = fc->pages.size();
+    /* the region changes while an async commit is flushed, so all the pages are sent only by a
+    commit that is not async */
+    bool repl = st->repl_fd >= 0;
+    bool repl_full = repl && st->repl_full && st->async_commit != fc;
+    if (!page_cnt && !fc->sz_changed && !repl_full)
+        return 0;
+    FnScope repl_scope;
+    if (repl) {
+        repl_begin(st, fc->seq, fc->storage_sz);
+        repl_scope([st]{ repl_end(st, REPL_ABORT); });
+    }
+
+    std::vector<uint8_t> list(wal_list_sz(page_cnt));
+    auto hdr = (wal_rec_hdr_t *)list.data();
+    *hdr = wal_rec_hdr_t{
+        .magic = 0,         /* the record is valid once the pages are written */
+        .reserved = 0,
+        .seq = fc->seq,
+        .storage_sz = fc->storage_sz,
+        .page_cnt = page_cnt,
+        .checksum = 0,
+    };
+    memcpy(hdr + 1, fc->pages.data(), page_cnt * sizeof(uint64_t));
+    uint64_t checksum = wal_checksum(fc->seq, fc->pages.data(), page_cnt * sizeof(uint64_t));
+
+    int log = st->wal_active;
+    uint64_t rec_off = st->wal_sz[log];
+    std::vector<iovec> iov = {{ list.data(), list.size() }};
+    ASSERT_FN(wal_write(st, log, rec_off, iov));
+
+    uint64_t off = rec_off + list.size();
+    for (uint64_t batch = 0; batch < page_cnt; batch += ASYNC_BATCH) {
+        /* a page that was not copied aside is read from the region, no one writes it meanwhile */
+        uint64_t end = std::min<uint64_t>(batch + ASYNC_BATCH, page_cnt);
+        iov.clear();
+        for (uint64_t i = batch; i < end; i++) {
+            uint8_t expected = FROZEN_PENDING;
+            uint8_t *src = fc->state[i].compare_exchange_strong(expected, FROZEN_FLUSHING) ?
+                    (uint8_t *)st->storage_ctx.region + fc->pages[i] * PAGE_SZ :
+                    fc->copies + i * PAGE_SZ;
+            checksum = wal_checksum(checksum, src, PAGE_SZ);
+            if (repl && !repl_full)
+                repl_add_page(st, fc->pages[i], src, NULL);
+            if (iov.size() && (uint8_t *)iov.back().iov_base + iov.back().iov_len == src)
+                iov.back().iov_len += PAGE_SZ;
+            else
+                iov.push_back({ src, PAGE_SZ });
+        }
+        int ret = wal_write(st, log, off, iov);
+        for (uint64_t i = batch; i < end; i++) {
+            uint8_t expected = FROZEN_FLUSHING;
+            fc->state[i].compare_exchange_strong(expected, FROZEN_FLUSHED);
+        }
+        ASSERT_FN(ret);
+        off += (end - batch) * PAGE_SZ;
+    }
+    hdr->magic = WAL_MAGIC;
+    hdr->checksum = checksum;
+    if (pwrite(st->wal_fd[log], hdr, sizeof(*hdr), rec_off) != sizeof(*hdr)) {
+        DBGE("Failed to write the record header");
+        return -1;
+    }
+    ASSERT_FN(fdatasync(st->wal_fd[log]));
+    if (repl) {
+        repl_scope.disable();
+        if (repl_full)
+            repl_add_run(st, 0, fc->storage_sz / PAGE_SZ, -1, 0);
+        repl_end(st, REPL_END);
+    }
 
-static ap_storage_cbk_t user_cbk;
-static void             *user_ctx;
+    std::lock_guard guard(st->wal_mu);
+    for (uint64_t i = 0; i < page_cnt; i++)
+        st->wal_index[fc->pages[i]] = { log, rec_off + list.size() + i * PAGE_SZ };
+    st->wal_sz[log] = off;
+    if (st->wal_sz[log] >= WAL_CKPT_SZ && !st->wal_ckpt_pending) {
+        st->wal_ckpt_log = log;
+        st->wal_ckpt_pending = true;
+        st->wal_active = !log;
+        st->wal_cv.notify_all();
+    }
+    return 0;
+}
 
-static std::string base_name(std::string path) {
-    return path.substr(path.find_last_of("/") + 1);
+static int wal_unfreeze(ap_storage_t *st, frozen_commit_t *fc) {
+    /* the flush of fc failed, it's pages are modified again, so the next commit writes them and a
+    revert loads them from the last commit that succeeded. The pages past the end of a storage that
+    shrank meanwhile are taken back by the revert anyway */
+    st->last_storage_sz = fc->last_storage_sz;
+    uint64_t page_cnt = st->storage_sz / PAGE_SZ;
+    for (uint64_t i = 0, j; i < fc->pages.size() && fc->pages[i] < page_cnt; i = j) {
+        for (j = i + 1; j < fc->pages.size() && fc->pages[j] == fc->pages[j - 1] + 1; j++)
+            ;
+        ASSERT_FN(mark_pages(st, fc->pages[i], std::min(fc->pages[j - 1] + 1, page_cnt)));
+    }
+    return 0;
 }
 
-static std::string base_dir(std::string path) {
-    return path.substr(0, path.find_last_of("/") + 1);
+static int wal_commit(ap_storage_t *st) {
+    /* nothing writes the region while we flush, so the frozen pages are read in place */
+    frozen_commit_t *fc = wal_freeze(st);
+    ASSERT_FN(CHK_BOOL(fc));
+    int ret = wal_flush(st, fc);
+    if (ret < 0 && wal_unfreeze(st, fc) < 0)
+        DBG("The pages of the failed commit %ld are lost for the next commit", fc->seq);
+    frozen_free(fc);
+    return ret;
 }
 
-static int commit_mem_changes() {
-    uint64_t page = mod_bmap.next_one(0);
-    while (page != uint64_t(-1)) {
-        /* write this page to file */
-        void *page_addr = (uint8_t *)storage_ctx.region + page * PAGE_SZ;
-        ASSERT_FN(msync(page_addr, PAGE_SZ, MS_SYNC));
-        page = mod_bmap.next_one(page + 1);
+static int wal_revert(ap_storage_t *st) {
+    /* a page is loaded from the log if it's last commit is there, else the private copy is dropped
+    and the page is read again from the data file */
+    ASSERT_FN(collect_dirty_pages(st));
+    st->mod_bmap_data.resize(std::max(st->mod_bmap_data.size(),
+            DIV_UP(st->last_storage_sz, PAGE_SZ)));
+    for (uint64_t page = st->storage_sz / PAGE_SZ; page < st->last_storage_sz / PAGE_SZ; page++)
+        st->mod_bmap.set(page, true);
+    st->storage_sz = st->last_storage_sz;
+
+    std::lock_guard guard(st->wal_mu);
+    uint64_t page_cnt = st->storage_sz / PAGE_SZ;
+    uint64_t first = st->mod_bmap.next_one(0);
+    while (first < page_cnt) {
+        uint64_t last = std::min(st->mod_bmap.next_zero(first), page_cnt);
+        uint8_t *run_addr = (uint8_t *)st->storage_ctx.region + first * PAGE_SZ;
+        if (st->track_mode == TRACK_MPROTECT)
+            ASSERT_FN(mprotect(run_addr, (last - first) * PAGE_SZ, PROT_READ | PROT_WRITE));
+        for (uint64_t page = first; page < last; page++) {
+            uint8_t *addr = (uint8_t *)st->storage_ctx.region + page * PAGE_SZ;
+            auto it = st->wal_index.find(page);
+            if (it != st->wal_index.end()) {
+                ASSERT_FN(pread(st->wal_fd[it->second.log], addr, PAGE_SZ, it->second.off));
+            }
+            else {
+                ASSERT_FN(madvise(addr, PAGE_SZ, MADV_DONTNEED));
+            }
+        }
+        ASSERT_FN(protect_pages(st, first * PAGE_SZ, (last - first) * PAGE_SZ));
+        first = last < page_cnt ? st->mod_bmap.next_one(last) : page_cnt;
     }
+    if (st->track_mode == TRACK_SOFT_DIRTY)
+        ASSERT_FN(clear_soft_dirty(st));
+    st->mod_bmap_data.clear();
+    st->mod_bmap_data.resize(DIV_UP(st->storage_sz, PAGE_SZ));
     return 0;
 }
 
-static int increase_storage_by(ap_sz_t sz) {
+static int increase_storage_by(ap_ctx_t *ctx, ap_sz_t sz) {
     /* we know the other storage_data is not mapped and we can't change it's data here, but we
-    can make it larger from here */
-    ASSERT_FN(commit_mem_changes());
-    munmap(storage_ctx.region, storage_sz);
-    storage_sz += sz;
-    ASSERT_FN(ftruncate(storage_fd, storage_sz));
-    ASSERT_FN(fsync(storage_fd));
+    can make it larger from here. The region lives inside the reserved range, so only the new tail
+    is mapped, the pages that are already mapped (and their protection and dirty bits) stay as they
+    are and the region doesn't move. The cost of a grow depends only on sz, not on the storage. */
+    ap_storage_t *st = find_storage(ctx->region);
+    if (st->storage_sz + sz > MAX_STORAGE_SPACE) {
+        DBG("Storage can't grow past the reserved space: %ld + %ld", st->storage_sz, sz);
+        return -1;
+    }
+    if (st->storage_sz % PAGE_SZ || sz % PAGE_SZ) {
+        DBG("The storage grows by whole pages: %ld + %ld", st->storage_sz, sz);
+        return -1;
+    }
+    void *tail_addr = (uint8_t *)st->storage_ctx.region + st->storage_sz;
+    /* after a trim the new tail may hold frozen pages of an async commit */
+    frozen_preserve(st, st->storage_sz / PAGE_SZ, (st->storage_sz + sz) / PAGE_SZ);
+    /* in WAL mode the data file is not truncated while the storage is open, so it may be large
+    enaugh already */
+    if (!st->wal_mode || st->storage_sz + sz > st->data_file_sz) {
+        ASSERT_FN(ftruncate(st->storage_fd, st->storage_sz + sz));
+        st->data_file_sz = st->storage_sz + sz;
+    }
+    ASSERT_FN(CHK_MMAP(mmap(tail_addr, sz, PROT_READ | PROT_WRITE,
+            (st->wal_mode ? MAP_PRIVATE | MAP_NORESERVE : MAP_SHARED) | MAP_FIXED,
+            st->storage_fd, st->storage_sz)));
+    ASSERT_FN(track_pages(st, st->storage_sz, sz));
+    st->storage_sz += sz;
+    st->mod_bmap_data.resize(DIV_UP(st->storage_sz, PAGE_SZ));
+    if (st->bulk_depth)
+        ASSERT_FN(mark_pages(st, (st->storage_sz - sz) / PAGE_SZ, st->storage_sz / PAGE_SZ));
+
+    /* the pages that where trimmed since the last commit are mapped again with new content, so
+    they are modified: a revert must load them back and a commit must save them */
+    for (uint64_t page = (st->storage_sz - sz) / PAGE_SZ;
+            page < std::min<uint64_t>(st->storage_sz, st->last_storage_sz) / PAGE_SZ; page++)
+    {
+        st->mod_bmap.set(page, true);
+    }
+
+    /* the advice belongs to the mapping, so the new tail must get it too */
+    if (st->storage_ctx.flags & AP_MALLOC_FLAG_HUGE_PAGES)
+        madvise(tail_addr, sz, MADV_HUGEPAGE);
+    return 0;
+}
 
-    storage_ctx.region = mmap(storage_ctx.region, storage_sz, PROT_READ | PROT_WRITE,
-            MAP_SHARED | MAP_FIXED, storage_fd, 0);
-    ASSERT_FN((intptr_t)storage_ctx.region);
-    ASSERT_FN(mprotect(storage_ctx.region, storage_sz, PROT_READ));
-    mod_bmap_data.resize(DIV_UP(storage_sz, PAGE_SZ));
+static int decrease_storage_by(ap_ctx_t *ctx, ap_sz_t sz) {
+    /* the pages after the new end stay mapped, if the changes are reverted the file grows back and
+    those pages are loaded from the backup. In WAL mode the data file holds the last commit, so
+    it stays as it is. */
+    ap_storage_t *st = find_storage(ctx->region);
+    /* the pages that where not there at the last savepoint are not needed by it's rollback */
+    if (st->savepoints.size()) {
+        sp_capture(st, (st->storage_sz - sz) / PAGE_SZ, std::min(st->storage_sz,
+                st->savepoints.back().storage_sz) / PAGE_SZ);
+    }
+    if (st->wal_mode) {
+        st->storage_sz -= sz;
+        st->mod_bmap_data.resize(DIV_UP(st->storage_sz, PAGE_SZ));
+        return 0;
+    }
+    /* nothing is synced here, the backup holds the last commit and after a crash the data file is
+    copied again from it */
+    st->storage_sz -= sz;
+    ASSERT_FN(ftruncate(st->storage_fd, st->storage_sz));
+    st->mod_bmap_data.resize(DIV_UP(st->storage_sz, PAGE_SZ));
+
+    return 0;
+}
 
+static int release_storage_pages(ap_ctx_t *ctx, ap_off_t off, ap_sz_t sz) {
+    /* the pages become holes in the file, they are marked as modified such that a revert loads them
+    back from the backup */
+    ap_storage_t *st = find_storage(ctx->region);
+    void *addr = (uint8_t *)st->storage_ctx.region + off;
+    ASSERT_FN(arm_range(st, off, sz));
+    sp_capture(st, off / PAGE_SZ, DIV_UP(off + sz, PAGE_SZ));
+    if (st->track_mode == TRACK_MPROTECT) {
+        ASSERT_FN(mprotect(addr, sz, PROT_READ | PROT_WRITE));
+        sp_writable(st, off / PAGE_SZ, DIV_UP(off + sz, PAGE_SZ));
+    }
+    for (uint64_t page = off / PAGE_SZ; page < DIV_UP(off + sz, PAGE_SZ); page++)
+        st->mod_bmap.set(page, true);
+    if (st->wal_mode) {
+        /* the data file holds the last commit, only the private copies are given back */
+        frozen_preserve(st, off / PAGE_SZ, DIV_UP(off + sz, PAGE_SZ));
+        ASSERT_FN(madvise(addr, sz, MADV_DONTNEED));
+        return 0;
+    }
+    ASSERT_FN(fallocate(st->storage_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, sz));
+    st->released_ranges.push_back({off, sz});
     return 0;
 }
 
+static bool is_released_hole(ap_storage_t *st, uint64_t page, void *page_addr) {
+    bool released = false;
+    for (auto [off, sz] : st->released_ranges)
+        if (page * PAGE_SZ >= off && (page + 1) * PAGE_SZ <= off + sz)
+            released = true;
+    if (!released)
+        return false;
+    auto words = (uint64_t *)page_addr;
+    for (uint64_t i = 0; i < PAGE_SZ / sizeof(uint64_t); i++)
+        if (words[i])
+            return false;
+    return true;
+}
+
 static void mprot_handl(int sig, siginfo_t *si, void *uc) {
-    if ((uint8_t *)si->si_addr < (uint8_t *)storage_ctx.region || (uint8_t *)si->si_addr >= 
-            ((uint8_t *)storage_ctx.region + storage_sz))
-    {
+    /* the fault is given to the storage that holds the address */
+    ap_storage_t *st = find_storage(si->si_addr);
+    bool in_storage = st && (uint8_t *)si->si_addr >= (uint8_t *)st->storage_ctx.region &&
+            (uint8_t *)si->si_addr < ((uint8_t *)st->storage_ctx.region + st->storage_sz);
+    uint64_t seg = in_storage ? uintptr_t((uint8_t *)si->si_addr -
+            (uint8_t *)st->storage_ctx.region) / LAZY_SEG_SZ : 0;
+    if (in_storage && st->lazy && !st->seg_armed[seg]) {
+        /* the access is done again after this, a write faults once more if it must be seen */
+        if (arm_segment(st, seg) < 0) {
+            DBGE("Failed to set up the segment %ld, will kill the program", seg);
+            exit(-1);
+        }
+    }
+    else if (!in_storage || st->track_mode != TRACK_MPROTECT) {
         DBG("broke at: %p", si->si_addr);
         /* not the sigsegv that we expected */
         if (old_sa.sa_flags & SA_SIGINFO)
@@ -122,9 +1780,13 @@ static void mprot_handl(int sig, siginfo_t *si, void *uc) {
             (*old_sa.sa_handler)(sig);
     }
     else {
-        uint64_t page = uintptr_t((uint8_t *)si->si_addr - (uint8_t *)storage_ctx.region) / PAGE_SZ;
-        void *addr0 = (void *)((uint8_t *)storage_ctx.region + page * PAGE_SZ);
-        mod_bmap.set(page, true);
+        uint64_t page = uintptr_t((uint8_t *)si->si_addr - (uint8_t *)st->storage_ctx.region) /
+                PAGE_SZ;
+        void *addr0 = (void *)((uint8_t *)st->storage_ctx.region + page * PAGE_SZ);
+        frozen_preserve(st, page, page + 1);
+        sp_capture(st, page, page + 1);
+        sp_writable(st, page, page + 1);
+        st->mod_bmap.set(page, true);
         if (mprotect(addr0, PAGE_SZ, PROT_READ | PROT_WRITE) < 0) {
             DBGE("Failed mprotect(addr: %p)(page: %ld), wierd, but will kill the program",
                     addr0, page);
@@ -134,139 +1796,632 @@ static void mprot_handl(int sig, siginfo_t *si, void *uc) {
 }
 
 void ap_except_cbk(const char *str, ap_except_info_t *exc_inf) {
-    if (user_cbk) {
-        user_cbk(user_ctx, str, exc_inf);
+    /* the error doesn't say which storage it comes from, the callback of the default storage is
+    used, or the one of the first open storage */
+    ap_storage_t *st = default_storage;
+    for (int i = 0; !st && i < MAX_STORAGE_CNT; i++)
+        st = storages[i].load();
+    if (st && st->user_cbk) {
+        st->user_cbk(st->user_ctx, str, exc_inf);
     }
     else {
         throw std::runtime_error("ap_except_cbk: unhandled error in ap_region");
     }
 }
 
-int ap_storage_do_changes(int action) {
+int ap_storage_wait_commit(ap_storage_t *st) {
+    if (!st->async_commit)
+        return 0;
+    st->async_thread.join();
+    frozen_commit_t *fc = st->async_commit;
+    st->async_commit = NULL;
+    int ret = fc->result;
+    if (ret < 0 && wal_unfreeze(st, fc) < 0)
+        DBG("The pages of the failed commit %ld are lost for the next commit", fc->seq);
+    frozen_free(fc);
+    return ret;
+}
+
+int ap_storage_commit_async(ap_storage_t *st, ap_storage_commit_cbk_t cbk, void *ctx) {
+    /* the result of the previous commit was given to it's callback */
+    ap_storage_wait_commit(st);
+    sp_reset(st);
+    if (!st->wal_mode) {
+        /* the data file is shared with the region, it can't hold a frozen state while the region
+        changes */
+        int ret = ap_storage_do_changes(st, AP_STORAGE_COMMIT_CHANGES);
+        if (cbk)
+            cbk(ctx, ret);
+        return ret;
+    }
+
+    frozen_commit_t *fc = wal_freeze(st);
+    ASSERT_FN(CHK_BOOL(fc));
+    fc->cbk = cbk;
+    fc->ctx = ctx;
+    if (fc->pages.size()) {
+        /* the copies are made only for the pages that are written again, the mapping is reserved
+        for all of them */
+        fc->copies = (uint8_t *)mmap(NULL, fc->pages.size() * PAGE_SZ, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (fc->copies == MAP_FAILED) {
+            DBGE("Failed to map the copies of the frozen pages");
+            fc->copies = NULL;
+            int ret = wal_flush(st, fc);
+            if (ret < 0 && wal_unfreeze(st, fc) < 0)
+                DBG("The pages of the failed commit %ld are lost for the next commit", fc->seq);
+            frozen_free(fc);
+            if (cbk)
+                cbk(ctx, ret);
+            return ret;
+        }
+    }
+    /* without mprotect there is no fault to copy a page on it's next write, so all of them are
+    copied now */
+    if (st->track_mode != TRACK_MPROTECT) {
+        for (uint64_t i = 0; i < fc->pages.size(); i++) {
+            memcpy(fc->copies + i * PAGE_SZ,
+                    (uint8_t *)st->storage_ctx.region + fc->pages[i] * PAGE_SZ, PAGE_SZ);
+            fc->state[i] = FROZEN_COPIED;
+        }
+    }
+
+    st->async_commit = fc;
+    st->async_thread = std::thread([st, fc]{
+        fc->result = wal_flush(st, fc);
+        if (fc->result < 0)
+            DBG("The async commit %ld failed", fc->seq);
+        if (fc->cbk)
+            fc->cbk(fc->ctx, fc->result);
+    });
+    return 0;
+}
+
+int ap_storage_do_changes(ap_storage_t *st, int action) {
     bool reverse_changes = (action & AP_STORAGE_REVERT_CHANGES) != 0;
-    ASSERT_FN(commit_mem_changes());
+    /* a revert goes back to the last commit, so the one in flight must end first */
+    ap_storage_wait_commit(st);
+    sp_reset(st);
+    if (st->wal_mode)
+        return reverse_changes ? wal_revert(st) : wal_commit(st);
+    ASSERT_FN(commit_mem_changes(st));
     /* now all the data is stored in our current file, so we know the current file is valid and
     we are going to change the backup file */
 
     uint64_t backup_sz;
+    bool backup_fresh = false;
+    int storage_idx = st->ctrl->data_used;
+    std::vector<crc_run_t> crc_runs;
+    std::unique_lock crc_lock(st->crc_mu, std::defer_lock);
 
     if (!reverse_changes) {
-        ctrl->data_used = !ctrl->data_used;
-        ASSERT_FN(msync(ctrl, CTRL_SZ, MS_SYNC));
+        /* the checksums of the storage file are synced before it becomes the valid one */
+        if (st->checksums) {
+            crc_compute(st, crc_runs);
+            ASSERT_FN(crc_write(st->crc_fd[storage_idx], crc_runs, st->storage_sz / PAGE_SZ));
+        }
+        crc_lock.lock();
+        st->ctrl->data_used = !st->ctrl->data_used;
+        ASSERT_FN(msync(st->ctrl, CTRL_SZ, MS_SYNC));
+
+        /* if a reader holds the last commit the backup is a new copy of the storage file, that
+        already has all the changes */
+        int ret;
+        ASSERT_FN(ret = take_data_file(st, st->ctrl->data_used, &st->backup_fd, st->storage_fd,
+                st->storage_sz));
+        backup_fresh = ret == 1;
 
         /* now we also increase the size of the other file such that on submit_changes we will have
-        enaugh space to submit the changes to the backup */
-        ASSERT_FN(ftruncate(backup_fd, storage_sz));
-        ASSERT_FN(fsync(backup_fd));
-        backup_sz = storage_sz;
+        enaugh space to submit the changes to the backup, the size is synced with the data */
+        ASSERT_FN(ftruncate(st->backup_fd, st->storage_sz));
+        backup_sz = st->storage_sz;
     }
     else {
-        ASSERT_FN(ftruncate(storage_fd, last_storage_sz));
-        ASSERT_FN(fsync(storage_fd));
-        backup_sz = last_storage_sz;
+        /* if the storage was trimmed, the end of the file was lost and must be taken again from
+        the backup */
+        st->mod_bmap_data.resize(std::max(st->mod_bmap_data.size(),
+                DIV_UP(st->last_storage_sz, PAGE_SZ)));
+        for (uint64_t page = DIV_UP(st->storage_sz, PAGE_SZ);
+                page < DIV_UP(st->last_storage_sz, PAGE_SZ); page++)
+        {
+            st->mod_bmap.set(page, true);
+        }
+        ASSERT_FN(ftruncate(st->storage_fd, st->last_storage_sz));
+        backup_sz = st->last_storage_sz;
+        st->storage_sz = st->last_storage_sz;
     }
 
-    void *oth_region = mmap(NULL, backup_sz, PROT_READ | PROT_WRITE, MAP_SHARED, backup_fd, 0);
-    ASSERT_FN(CHK_MMAP(oth_region));
-    FnScope scope([&oth_region, &backup_sz]{ munmap(oth_region, backup_sz); });
+    /* the pages are sent to the follower as they are copied, the deltas are made against the
+    backup before it changes (a new backup has the changes already). The record ends only if the
+    commit does */
+    bool repl = !reverse_changes && st->repl_fd >= 0;
+    uint64_t repl_old_cnt = backup_fresh ? 0 : st->last_storage_sz / PAGE_SZ;
+    FnScope repl_scope;
+    if (repl) {
+        repl_begin(st, st->ctrl->generation + 1, st->storage_sz);
+        repl_scope([st]{ repl_end(st, REPL_ABORT); });
+    }
 
-    uint64_t page = mod_bmap.next_one(0);
-    while (page != uint64_t(-1)) {
-        /* write this page to file */
-        if ((page + 1) * PAGE_SZ > backup_sz)
-            break;
-        void *page_addr = (uint8_t *)storage_ctx.region + page * PAGE_SZ;
-        void *oth_paddr = (uint8_t *)oth_region + page * PAGE_SZ;
-        if (!reverse_changes) {
-            memcpy(oth_paddr, page_addr, PAGE_SZ);
-            ASSERT_FN(msync(oth_paddr, PAGE_SZ, MS_SYNC));
+    /* the backup is only read from when the changes are reverted */
+    void *oth_region = NULL;
+    if (reverse_changes) {
+        oth_region = mmap(NULL, backup_sz, PROT_READ, MAP_SHARED, st->backup_fd, 0);
+        ASSERT_FN(CHK_MMAP(oth_region));
+    }
+    FnScope scope([&oth_region, &backup_sz]{ if (oth_region) munmap(oth_region, backup_sz); });
+
+    /* the dirty pages are handled in runs of consecutive pages, each run is copied and protected
+    again with one call */
+    uint64_t page_cnt = backup_sz / PAGE_SZ;
+    uint64_t first = st->mod_bmap.next_one(0);
+    while (first < page_cnt) {
+        uint64_t last = std::min(st->mod_bmap.next_zero(first), page_cnt);
+        auto page_addr = [st](uint64_t page) {
+            return (uint8_t *)st->storage_ctx.region + page * PAGE_SZ;
+        };
+        if (repl && !st->repl_full)
+            repl_add_run(st, first, last, st->backup_fd, repl_old_cnt);
+        if (!reverse_changes && !backup_fresh) {
+            /* the pages that where given back and not used since are holes in the backup too */
+            uint64_t page = first;
+            while (page < last) {
+                bool hole = is_released_hole(st, page, page_addr(page));
+                uint64_t end = page + 1;
+                while (end < last && is_released_hole(st, end, page_addr(end)) == hole)
+                    end++;
+                if (hole) {
+                    ASSERT_FN(fallocate(st->backup_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            page * PAGE_SZ, (end - page) * PAGE_SZ));
+                }
+                else {
+                    ASSERT_FN(copy_file_data(st->storage_fd, page * PAGE_SZ, st->backup_fd,
+                            page * PAGE_SZ, (end - page) * PAGE_SZ));
+                }
+                page = end;
+            }
         }
-        else {
+        else if (reverse_changes) {
             /* this case is unsubmitting the changes, loading them from backup */
-            memcpy(page_addr, oth_paddr, PAGE_SZ);
-            ASSERT_FN(msync(page_addr, PAGE_SZ, MS_SYNC));
+            memcpy(page_addr(first), (uint8_t *)oth_region + first * PAGE_SZ,
+                    (last - first) * PAGE_SZ);
+        }
+        ASSERT_FN(protect_pages(st, first * PAGE_SZ, (last - first) * PAGE_SZ));
+        first = last < page_cnt ? st->mod_bmap.next_one(last) : page_cnt;
+    }
+    ASSERT_FN(fdatasync(reverse_changes ? st->storage_fd : st->backup_fd));
+    if (!reverse_changes && st->checksums) {
+        /* a new backup is a copy of the whole storage file, so are it's checksums */
+        int crc_fd = st->crc_fd[!storage_idx];
+        if (backup_fresh) {
+            uint64_t crc_sz = backup_sz / PAGE_SZ * sizeof(uint32_t);
+            ASSERT_FN(ftruncate(crc_fd, crc_sz));
+            ASSERT_FN(copy_file_data(st->crc_fd[storage_idx], 0, crc_fd, 0, crc_sz));
+            ASSERT_FN(fdatasync(crc_fd));
+        }
+        else {
+            ASSERT_FN(crc_write(crc_fd, crc_runs, backup_sz / PAGE_SZ));
         }
-        ASSERT_FN(mprotect(page_addr, PAGE_SZ, PROT_READ));
-        page = mod_bmap.next_one(page + 1);
     }
+    if (st->track_mode == TRACK_SOFT_DIRTY)
+        ASSERT_FN(clear_soft_dirty(st));
+    st->released_ranges.clear();
 
-    mod_bmap_data.clear();
-    mod_bmap_data.resize(DIV_UP(backup_sz, PAGE_SZ));
+    st->mod_bmap_data.clear();
+    st->mod_bmap_data.resize(DIV_UP(backup_sz, PAGE_SZ));
 
-    /* switch back to the storage_data that we where using */
+    /* switch back to the storage_data that we where using, the generation changes before the
+    backup is unlocked, such that a reader that locks it sees the new one */
     if (!reverse_changes) {
-        last_storage_sz = backup_sz;
-        ctrl->data_used = !ctrl->data_used;
-        ASSERT_FN(msync(ctrl, CTRL_SZ, MS_SYNC));
+        st->last_storage_sz = backup_sz;
+        __atomic_store_n(&st->ctrl->generation, st->ctrl->generation + 1, __ATOMIC_SEQ_CST);
+        ASSERT_FN(flock(st->backup_fd, LOCK_UN));
+        st->ctrl->data_used = !st->ctrl->data_used;
+        ASSERT_FN(msync(st->ctrl, CTRL_SZ, MS_SYNC));
+    }
+    if (repl) {
+        repl_scope.disable();
+        if (st->repl_full)
+            repl_add_run(st, 0, st->storage_sz / PAGE_SZ, -1, 0);
+        repl_end(st, REPL_END);
+    }
+    return 0;
+}
+
+int ap_storage_mark_dirty(void *ptr, uint64_t len) {
+    ap_storage_t *st = find_storage(ptr);
+    uint8_t *region = st ? (uint8_t *)st->storage_ctx.region : NULL;
+    if (!st || (uint8_t *)ptr < region || (uint8_t *)ptr + len > region + st->storage_sz) {
+        DBG("The range %p + %ld is not inside a storage", ptr, len);
+        return -1;
+    }
+    if (!len)
+        return 0;
+    uint64_t off = (uint8_t *)ptr - region;
+    return mark_pages(st, off / PAGE_SZ, DIV_UP(off + len, PAGE_SZ));
+}
+
+void ap_storage_bulk_begin(ap_storage_t *st) {
+    st->bulk_depth++;
+}
+
+int ap_storage_bulk_end(ap_storage_t *st) {
+    if (st->bulk_depth <= 0) {
+        DBG("There is no bulk write to end");
+        return -1;
+    }
+    st->bulk_depth--;
+    return 0;
+}
+
+int ap_storage_savepoint(ap_storage_t *st) {
+    if (st->track_mode != TRACK_MPROTECT) {
+        DBG("The savepoints need the default tracking of the modified pages");
+        return -1;
+    }
+    if (!st->sp_captured_data.words) {
+        /* the map of the copied pages covers the reservation, as the dirty map */
+        uint64_t page_cnt = st->storage_sz / PAGE_SZ;
+        ASSERT_FN(st->sp_images.init(page_cnt));
+        ASSERT_FN(st->sp_pages.init(page_cnt));
+        ASSERT_FN(st->sp_rw.init(page_cnt));
+        ASSERT_FN(st->sp_captured_data.init(SP_MAP_PAGES));
+        st->sp_captured_data.resize(SP_MAP_PAGES);
+        st->sp_captured.o.data = &st->sp_captured_data;
+    }
+
+    /* the pages that can be written without a fault are protected again, such that their next
+    write copies them in the log. The first savepoint protects all the modified pages, the next ones
+    only the pages that became writable since the last one */
+    uint64_t page_cnt = st->storage_sz / PAGE_SZ;
+    if (!st->sp_tracking) {
+        uint64_t first = st->mod_bmap.next_one(0);
+        while (first < page_cnt) {
+            uint64_t last = std::min(st->mod_bmap.next_zero(first), page_cnt);
+            ASSERT_FN(protect_pages(st, first * PAGE_SZ, (last - first) * PAGE_SZ));
+            first = last < page_cnt ? st->mod_bmap.next_one(last) : page_cnt;
+        }
+        st->sp_tracking = true;
+    }
+    else {
+        for (uint64_t i = 0; i < st->sp_rw.cnt;) {
+            uint64_t first = st->sp_rw.items[i++];
+            uint64_t last = first + 1;
+            while (i < st->sp_rw.cnt && st->sp_rw.items[i] == last) {
+                last++;
+                i++;
+            }
+            last = std::min(last, page_cnt);
+            if (first < last)
+                ASSERT_FN(protect_pages(st, first * PAGE_SZ, (last - first) * PAGE_SZ));
+        }
+    }
+    st->sp_rw.truncate(0);
+    st->sp_captured_data.clear();
+    st->sp_captured_data.resize(SP_MAP_PAGES);
+    st->savepoints.push_back({ st->sp_pages.cnt, st->storage_sz });
+    return st->savepoints.size();
+}
+
+int ap_storage_rollback_to(ap_storage_t *st, int sp) {
+    if (sp < 1 || sp > (int)st->savepoints.size()) {
+        DBG("There is no savepoint %d", sp);
+        return -1;
+    }
+    if (st->sp_lost) {
+        DBG("The savepoint log is full, only the whole transaction can be reverted");
+        return -1;
+    }
+    savepoint_t spt = st->savepoints[sp - 1];
+    st->savepoints.resize(sp);
+
+    /* the storage gets back it's size first, such that the pages trimmed since can be copied back,
+    then the log is copied from it's end, so the oldest copy of a page is the one that stays */
+    if (st->storage_sz < spt.storage_sz)
+        ASSERT_FN(increase_storage_by(&st->storage_ctx, spt.storage_sz - st->storage_sz));
+    for (uint64_t i = st->sp_pages.cnt; i-- > spt.log_cnt;) {
+        uint64_t page = st->sp_pages.items[i];
+        if (page >= spt.storage_sz / PAGE_SZ)
+            continue;
+        uint8_t *addr = (uint8_t *)st->storage_ctx.region + page * PAGE_SZ;
+        frozen_preserve(st, page, page + 1);
+        ASSERT_FN(mprotect(addr, PAGE_SZ, PROT_READ | PROT_WRITE));
+        memcpy(addr, &st->sp_images.items[i], PAGE_SZ);
+        ASSERT_FN(protect_pages(st, page * PAGE_SZ, PAGE_SZ));
+        st->mod_bmap.set(page, true);
+    }
+
+    /* all the pages written after the savepoint are in the log, so now they are protected again
+    and nothing is writable */
+    st->sp_images.truncate(spt.log_cnt);
+    st->sp_pages.truncate(spt.log_cnt);
+    st->sp_rw.truncate(0);
+    st->sp_captured_data.clear();
+    st->sp_captured_data.resize(SP_MAP_PAGES);
+    if (st->storage_sz > spt.storage_sz)
+        ASSERT_FN(decrease_storage_by(&st->storage_ctx, st->storage_sz - spt.storage_sz));
+    return 0;
+}
+
+int ap_storage_release(ap_storage_t *st, int sp) {
+    /* the log of the released savepoints belongs to the one before them */
+    if (sp < 1 || sp > (int)st->savepoints.size()) {
+        DBG("There is no savepoint %d", sp);
+        return -1;
+    }
+    st->savepoints.resize(sp - 1);
+    if (st->savepoints.empty()) {
+        st->sp_images.truncate(0);
+        st->sp_pages.truncate(0);
+        st->sp_captured_data.clear();
+        st->sp_captured_data.resize(SP_MAP_PAGES);
+        st->sp_lost = false;
+    }
+    return 0;
+}
+
+int ap_storage_replicate(ap_storage_t *st, int fd, uint32_t flags) {
+    /* the commit in flight may be writing to the old stream */
+    ap_storage_wait_commit(st);
+    st->repl_fd = fd;
+    st->repl_flags = flags;
+    st->repl_full = flags & AP_STORAGE_REPL_FULL;
+    return 0;
+}
+
+static int repl_read(int fd, void *buff, uint64_t sz, bool eof_ok = false) {
+    /* returns 0 if the stream ended before the first byte and eof_ok, 1 if buff was read */
+    uint64_t off = 0;
+    while (off < sz) {
+        ssize_t ret = read(fd, (uint8_t *)buff + off, sz - off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            DBGE("Failed to read the replication stream");
+            return -1;
+        }
+        if (ret == 0) {
+            if (!off && eof_ok)
+                return 0;
+            DBG("The replication stream ended in the middle of a record");
+            return -1;
+        }
+        off += ret;
+    }
+    return 1;
+}
+
+static int repl_apply_delta(uint8_t *page, const uint8_t *data, uint64_t sz) {
+    uint64_t pos = 0;
+    while (pos < sz) {
+        repl_delta_t d;
+        if (pos + sizeof(d) > sz) {
+            DBG("The delta is cut");
+            return -1;
+        }
+        memcpy(&d, data + pos, sizeof(d));
+        pos += sizeof(d);
+        uint64_t bytes = d.cnt * sizeof(uint64_t);
+        if ((d.word + d.cnt) * sizeof(uint64_t) > PAGE_SZ || pos + bytes > sz) {
+            DBG("Bad delta: word %d count %d", d.word, d.cnt);
+            return -1;
+        }
+        memcpy(page + d.word * sizeof(uint64_t), data + pos, bytes);
+        pos += bytes;
     }
     return 0;
 }
 
+int64_t ap_storage_replica_apply(ap_storage_t *st, int fd) {
+    repl_hdr_t hdr;
+    int ret;
+    ASSERT_FN(ret = repl_read(fd, &hdr, sizeof(hdr), true));
+    if (!ret)
+        return 0;
+    if (hdr.magic != REPL_MAGIC) {
+        DBG("Not a replication record");
+        return -1;
+    }
+
+    /* the record is a transaction of the follower, if it is not whole it is reverted */
+    FnScope revert([st]{ ap_storage_do_changes(st, AP_STORAGE_REVERT_CHANGES); });
+    int64_t rec_sz = sizeof(hdr);
+    if (hdr.storage_sz > st->storage_sz)
+        ASSERT_FN(increase_storage_by(&st->storage_ctx, hdr.storage_sz - st->storage_sz));
+    std::vector<uint8_t> data(PAGE_SZ);
+    while (true) {
+        repl_page_hdr_t ph;
+        ASSERT_FN(repl_read(fd, &ph, sizeof(ph)));
+        rec_sz += sizeof(ph);
+        if (ph.page == REPL_END)
+            break;
+        if (ph.page == REPL_ABORT) {
+            /* the commit failed on the leader, the next record follows */
+            revert.call();
+            return ap_storage_replica_apply(st, fd);
+        }
+        if (ph.page >= hdr.storage_sz / PAGE_SZ || ph.sz > PAGE_SZ) {
+            DBG("Bad page %ld in the replication record", ph.page);
+            return -1;
+        }
+        if (ph.sz)
+            ASSERT_FN(repl_read(fd, data.data(), ph.sz));
+        rec_sz += ph.sz;
+
+        ASSERT_FN(mark_pages(st, ph.page, ph.page + 1));
+        uint8_t *addr = (uint8_t *)st->storage_ctx.region + ph.page * PAGE_SZ;
+        if (ph.enc == REPL_PAGE_RAW && ph.sz == PAGE_SZ) {
+            memcpy(addr, data.data(), PAGE_SZ);
+        }
+        else if (ph.enc == REPL_PAGE_ZERO) {
+            memset(addr, 0, PAGE_SZ);
+        }
+        else if (ph.enc == REPL_PAGE_DELTA) {
+            ASSERT_FN(repl_apply_delta(addr, data.data(), ph.sz));
+        }
+        else {
+            DBG("Bad encoding %d of the page %ld", ph.enc, ph.page);
+            return -1;
+        }
+    }
+    if (hdr.storage_sz < st->storage_sz)
+        ASSERT_FN(decrease_storage_by(&st->storage_ctx, st->storage_sz - hdr.storage_sz));
+    revert.disable();
+    ASSERT_FN(ap_storage_do_changes(st, AP_STORAGE_COMMIT_CHANGES));
+    return rec_sz;
+}
+
+static int storage_register(ap_storage_t *st) {
+    /* a storage is registered after it's reservation exists and before anything in it is
+    protected, the handler is installed once, with the first storage that uses it */
+    std::lock_guard guard(storages_mu);
+    for (auto &slot : storages) {
+        ap_storage_t *other = slot.load();
+        if (other && other->track_mode == TRACK_SOFT_DIRTY && st->track_mode == TRACK_SOFT_DIRTY) {
+            /* the bits are cleared for the whole process, so they can't be shared */
+            DBG("Only one storage can use AP_STORAGE_FLAG_TRACK_SOFT_DIRTY");
+            return -1;
+        }
+    }
+    if ((st->track_mode == TRACK_MPROTECT || st->lazy) && !handler_installed) {
+        struct sigaction sa = {};
+
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_sigaction = mprot_handl;
+        ASSERT_FN(sigaction(SIGSEGV, &sa, &old_sa));
+        handler_installed = true;
+    }
+    for (auto &slot : storages) {
+        if (!slot.load()) {
+            slot = st;
+            return 0;
+        }
+    }
+    DBG("Too many open storages, the limit is %d", MAX_STORAGE_CNT);
+    return -1;
+}
+
+static void storage_unregister(ap_storage_t *st) {
+    std::lock_guard guard(storages_mu);
+    for (auto &slot : storages)
+        if (slot.load() == st)
+            slot = NULL;
+}
+
 /* How this works:
     - a sigaction is set for SIGSEGV, such that on invalid access this handler will be called. Next
     we use mprotect for the entire storage region such that any write will raise a SIGSEGV. In the
     mprot_handl we catch this write and we mark that page as dirty, fallowing that we remove the
     protection because we don't want other writes to the same dirty page to go through the handler.
+    With AP_STORAGE_FLAG_TRACK_SOFT_DIRTY or AP_STORAGE_FLAG_TRACK_UFFD the kernel remembers the
+    written pages instead and they are copied in the dirty map when the changes are done, there is
+    no signal and no syscall for each first write.
     - when function ap_storage_do_changes is called all the pages that are dirty can be written to
     file or the dirty pages can be taken from backup. In this way only the pages that where changed
     are modified or reverted and in case a fail occours we allways have the backup. In case the
     commit operation is succesfull we can use the current file as the backup and mirror the changes
-    in the old backup. */
-int ap_storage_init(const char *ctrl_file, ap_storage_cbk_t cbk, void *ctx) {
-    user_cbk = cbk;
-    user_ctx = ctx;
+    in the old backup.
+    - with AP_STORAGE_FLAG_WAL there is no backup, the data file is mapped private and a commit
+    appends the dirty pages to a log that is later copied in the data file (see wal_commit).
+    - each open storage has it's own reservation, the handler and the ap_malloc callbacks find the
+    storage that owns an address in the list of open storages. */
+static int storage_open(ap_storage_t *st, const char *ctrl_file, uint32_t flags) {
     if (PAGE_SZ != sysconf(_SC_PAGESIZE)) {
         DBG("Incorect page size: %ld", sysconf(_SC_PAGESIZE));
         return -1;
     }
-    struct sigaction sa = {};
-
-    sa.sa_flags = SA_SIGINFO;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_sigaction = mprot_handl;
-    ASSERT_FN(sigaction(SIGSEGV, &sa, &old_sa));
-
-    int ctrl_fd;
     struct stat st_ctrl;
-    ASSERT_FN(ctrl_fd = open(ctrl_file, O_RDWR | O_CREAT, 0666));
-    FnScope err_scope([&ctrl_fd]{ close(ctrl_fd); });
+    ASSERT_FN(st->ctrl_fd = open(ctrl_file, O_RDWR | O_CREAT, 0666));
+    FnScope err_scope([st]{ close(st->ctrl_fd); });
 
-    ASSERT_FN(ftruncate(ctrl_fd, CTRL_SZ));
-    ASSERT_FN(fstat(ctrl_fd, &st_ctrl));
-    ASSERT_FN(fsync(ctrl_fd));
+    err_scope([st]{ track_uninit(st); });
+    ASSERT_FN(track_init(st, flags));
+
+    ASSERT_FN(ftruncate(st->ctrl_fd, CTRL_SZ));
+    ASSERT_FN(fstat(st->ctrl_fd, &st_ctrl));
+    ASSERT_FN(fsync(st->ctrl_fd));
 
     if (st_ctrl.st_size != CTRL_SZ) {
         DBG("Malformed ctrl block: size");
         return -1;
     }
 
-    ASSERT_FN(ctrl = (storage_ctrl_t *)mmap(NULL, st_ctrl.st_size,
-            PROT_READ | PROT_WRITE, MAP_SHARED, ctrl_fd, 0));
-    err_scope([]{ munmap(ctrl, CTRL_SZ); });
+    ASSERT_FN(st->ctrl = (storage_ctrl_t *)mmap(NULL, st_ctrl.st_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, st->ctrl_fd, 0));
+    err_scope([st]{ munmap(st->ctrl, CTRL_SZ); });
 
-    if (ctrl->magic != STORAGE_MAGIC && ctrl->magic != 0) {
+    if (st->ctrl->magic != STORAGE_MAGIC && st->ctrl->magic != 0) {
         DBG("Malformed ctrl block: magic");
         return -1;
     }
 
-    storage_dir = base_dir(ctrl_file);
-    storage_name = base_name(ctrl_file);
-
-    storage_data_path[0] = storage_dir + storage_name + "_0.data";
-    storage_data_path[1] = storage_dir + storage_name + "_1.data";
-
-    storage_ctx.region = mmap(0, MAX_STORAGE_SPACE, PROT_NONE, MAP_SHARED |
-            MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-    ASSERT_FN((intptr_t)storage_ctx.region);
+    st->storage_dir = base_dir(ctrl_file);
+    st->storage_name = base_name(ctrl_file);
+
+    st->storage_data_path[0] = st->storage_dir + st->storage_name + "_0.data";
+    st->storage_data_path[1] = st->storage_dir + st->storage_name + "_1.data";
+    st->wal_path[0] = st->storage_dir + st->storage_name + "_0.wal";
+    st->wal_path[1] = st->storage_dir + st->storage_name + "_1.wal";
+    st->crc_path[0] = st->storage_dir + st->storage_name + "_0.crc";
+    st->crc_path[1] = st->storage_dir + st->storage_name + "_1.crc";
+
+    st->wal_mode = flags & AP_STORAGE_FLAG_WAL;
+    st->lazy = flags & AP_STORAGE_FLAG_LAZY;
+    st->prefetch = flags & AP_STORAGE_FLAG_PREFETCH;
+    st->hot_path = st->storage_dir + st->storage_name + ".hot";
+    if (st->prefetch && !st->lazy) {
+        DBG("AP_STORAGE_FLAG_PREFETCH needs AP_STORAGE_FLAG_LAZY");
+        return -1;
+    }
+    st->checksums = flags & AP_STORAGE_FLAG_CHECKSUMS;
+    if ((flags & AP_STORAGE_FLAG_VERIFY) && !st->checksums) {
+        DBG("AP_STORAGE_FLAG_VERIFY needs AP_STORAGE_FLAG_CHECKSUMS");
+        return -1;
+    }
+    if (st->checksums && st->wal_mode) {
+        DBG("AP_STORAGE_FLAG_CHECKSUMS can't be used with AP_STORAGE_FLAG_WAL");
+        return -1;
+    }
+    if (st->ctrl->magic == STORAGE_MAGIC && bool(st->ctrl->wal) != st->wal_mode) {
+        DBG("The storage was created %s AP_STORAGE_FLAG_WAL", st->ctrl->wal ? "with" : "without");
+        return -1;
+    }
 
-    if (ctrl->magic != STORAGE_MAGIC) {
+    /* with huge pages the reservation is larger by one huge page, such that it's start can be
+    aligned */
+    bool huge = flags & AP_STORAGE_FLAG_HUGE_PAGES;
+    st->reserved_sz = MAX_STORAGE_SPACE + (huge ? AP_MALLOC_HUGE_PAGE_SZ : 0);
+    st->reserved_region = mmap(0, st->reserved_sz, PROT_NONE,
+            MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT_FN(CHK_MMAP(st->reserved_region));
+    FnScope reserved_scope([st]{ munmap(st->reserved_region, st->reserved_sz); });
+    st->storage_ctx.region = st->reserved_region;
+    if (huge) {
+        st->storage_ctx.region = (void *)(((uintptr_t)st->reserved_region +
+                AP_MALLOC_HUGE_PAGE_SZ - 1) & ~uintptr_t(AP_MALLOC_HUGE_PAGE_SZ - 1));
+        st->storage_ctx.flags |= AP_MALLOC_FLAG_HUGE_PAGES;
+    }
+    ASSERT_FN(st->mod_bmap_data.init(MAX_STORAGE_SPACE / PAGE_SZ));
+    if (st->lazy)
+        st->seg_armed.resize(MAX_STORAGE_SPACE / LAZY_SEG_SZ);
+    ASSERT_FN(storage_register(st));
+    /* err_scope calls it's functions in the order they where added, so the steps that depend on
+    each other are undone by one function: the fault handler must not find the storage once the
+    reservation is gone */
+    reserved_scope.disable();
+    err_scope([st]{
+        storage_unregister(st);
+        munmap(st->reserved_region, st->reserved_sz);
+    });
+
+    if (st->ctrl->magic != STORAGE_MAGIC) {
         DBG("Initializing new storage");
-        memset(ctrl, 0, CTRL_SZ);
-        ASSERT_FN(msync(ctrl, CTRL_SZ, MS_SYNC));
+        memset(st->ctrl, 0, CTRL_SZ);
+        ASSERT_FN(msync(st->ctrl, CTRL_SZ, MS_SYNC));
 
         int fd0;
-        unlink(storage_data_path[0].c_str());
-        ASSERT_FN(fd0 = open(storage_data_path[0].c_str(), O_RDWR | O_CREAT, 0666));
+        unlink(st->storage_data_path[0].c_str());
+        ASSERT_FN(fd0 = open(st->storage_data_path[0].c_str(), O_RDWR | O_CREAT, 0666));
         FnScope scope([fd0]{ close(fd0); });
 
         ASSERT_FN(ftruncate(fd0, 0));
@@ -284,88 +2439,414 @@ int ap_storage_init(const char *ctrl_file, ap_storage_cbk_t cbk, void *ctx) {
 
         scope.call();
 
-        unlink(storage_data_path[1].c_str());
-        if (!std::filesystem::copy_file(storage_data_path[0], storage_data_path[1])) {
+        unlink(st->storage_data_path[1].c_str());
+        unlink(st->hot_path.c_str());
+        unlink(st->crc_path[0].c_str());
+        unlink(st->crc_path[1].c_str());
+        unlink(st->wal_path[0].c_str());
+        unlink(st->wal_path[1].c_str());
+        if (!st->wal_mode &&
+                !std::filesystem::copy_file(st->storage_data_path[0], st->storage_data_path[1]))
+        {
             DBGE("Can't create backup file");
             return -1;
         }
+        st->ctrl->wal = st->wal_mode;
 
         /* at this point we have two malloc initialized data storages so we can write the magic
         inside the ctrl struct */
-        ctrl->magic = STORAGE_MAGIC;
-        ASSERT_FN(msync(ctrl, CTRL_SZ, MS_SYNC));
+        st->ctrl->magic = STORAGE_MAGIC;
+        ASSERT_FN(msync(st->ctrl, CTRL_SZ, MS_SYNC));
     }
     else {
         DBG("Storage was already initialized before");
     }
 
-    if (ctrl->flag_in_use) {
+    if (st->ctrl->checksums && !st->checksums) {
+        /* the commits of this session don't update the checksums */
+        st->ctrl->checksums = false;
+        ASSERT_FN(msync(st->ctrl, CTRL_SZ, MS_SYNC));
+        unlink(st->crc_path[0].c_str());
+        unlink(st->crc_path[1].c_str());
+    }
+
+    if (st->ctrl->flag_in_use && !st->wal_mode) {
         /* This means that ctrl->data_used was corrupted during the last sesion and we must restore
-        it from the backup */
-        unlink(storage_data_path[ctrl->data_used].c_str());
-        if (!std::filesystem::copy_file(storage_data_path[!ctrl->data_used],
-                storage_data_path[ctrl->data_used]))
+        it from the backup, the checksums go with it */
+        int used = st->ctrl->data_used;
+        unlink(st->storage_data_path[used].c_str());
+        if (!std::filesystem::copy_file(st->storage_data_path[!used],
+                st->storage_data_path[used]))
         {
             DBGE("Can't copy from backup file");
             return -1;
         }
+        if (st->ctrl->checksums) {
+            unlink(st->crc_path[used].c_str());
+            if (!std::filesystem::copy_file(st->crc_path[!used], st->crc_path[used])) {
+                DBGE("Can't copy the checksums of the backup file");
+                return -1;
+            }
+        }
     }
 
-    ctrl->flag_in_use = true;
-    err_scope([]{ ctrl->flag_in_use = false; });
-
-    /* now ctrl is initialized and both files hold the same data */
-    ctrl->data_used = !ctrl->data_used;
-    ASSERT_FN(storage_fd = open(storage_data_path[ctrl->data_used].c_str(), O_RDWR));
-    err_scope([]{ close(storage_fd); });
-
-    ASSERT_FN(backup_fd = open(storage_data_path[!ctrl->data_used].c_str(), O_RDWR));
-    err_scope([]{ close(backup_fd); });
+    /* err_scope unmaps the ctrl page, so the flag is cleared by a scope that ends before it */
+    st->ctrl->flag_in_use = true;
+    FnScope in_use_scope([st]{ st->ctrl->flag_in_use = false; });
+
+    if (st->wal_mode) {
+        /* the logs are replayed before the data file is mapped */
+        st->backup_fd = -1;
+        ASSERT_FN(st->storage_fd = open(st->storage_data_path[0].c_str(), O_RDWR));
+        FnScope fd_scope([st]{ close(st->storage_fd); });
+        ASSERT_FN(wal_open(st));
+        /* the logs are checkpointed in the data file before it is closed */
+        fd_scope.disable();
+        err_scope([st]{
+            wal_close(st);
+            close(st->storage_fd);
+        });
+    }
+    else {
+        /* now ctrl is initialized and both files hold the same data */
+        st->ctrl->data_used = !st->ctrl->data_used;
+        ASSERT_FN(st->storage_fd = open(st->storage_data_path[st->ctrl->data_used].c_str(),
+                O_RDWR | O_CLOEXEC));
+        err_scope([st]{ close(st->storage_fd); });
+
+        ASSERT_FN(st->backup_fd = open(st->storage_data_path[!st->ctrl->data_used].c_str(),
+                O_RDWR | O_CLOEXEC));
+        err_scope([st]{ close(st->backup_fd); });
+
+        /* the storage file was the backup until now, a reader may still hold it. The writer keeps
+        it's lock until the storage is closed */
+        struct stat st_backup;
+        ASSERT_FN(fstat(st->backup_fd, &st_backup));
+        ASSERT_FN(take_data_file(st, st->ctrl->data_used, &st->storage_fd, st->backup_fd,
+                st_backup.st_size));
+    }
 
     struct stat st_data;
-    ASSERT_FN(fstat(storage_fd, &st_data));
-    storage_sz = st_data.st_size;
-    last_storage_sz = storage_sz;
+    ASSERT_FN(fstat(st->storage_fd, &st_data));
+    st->storage_sz = st_data.st_size;
+    st->last_storage_sz = st->storage_sz;
+    st->data_file_sz = st->storage_sz;
+
+    if (st->checksums) {
+        ASSERT_FN(crc_open(st, st->storage_sz / PAGE_SZ, flags & AP_STORAGE_FLAG_VERIFY));
+        err_scope([st]{ crc_close(st); });
+    }
 
-    storage_ctx.region = mmap(storage_ctx.region, storage_sz, PROT_READ | PROT_WRITE,
-            MAP_SHARED | MAP_FIXED, storage_fd, 0);
-    storage_ctx.add_mem_fn = increase_storage_by;
+    /* the private mapping of the WAL mode would be charged for all it's pages, it gets memory
+    only for the ones that are written */
+    st->storage_ctx.region = mmap(st->storage_ctx.region, st->storage_sz, PROT_READ | PROT_WRITE,
+            (st->wal_mode ? MAP_PRIVATE | MAP_NORESERVE : MAP_SHARED) | MAP_FIXED,
+            st->storage_fd, 0);
+    st->storage_ctx.add_mem_fn = increase_storage_by;
+    st->storage_ctx.rm_mem_fn = decrease_storage_by;
+    st->storage_ctx.release_mem_fn = release_storage_pages;
 
-    DBG("Storage region %p storage_sz %ld", storage_ctx.region, storage_sz);
-    ASSERT_FN((intptr_t)storage_ctx.region);
+    DBG("Storage region %p storage_sz %ld", st->storage_ctx.region, st->storage_sz);
+    ASSERT_FN((intptr_t)st->storage_ctx.region);
 
-    ASSERT_FN(mprotect(storage_ctx.region, storage_sz, PROT_READ));
-    mod_bmap_data.resize(DIV_UP(storage_sz, PAGE_SZ));
+    ASSERT_FN(track_pages(st, 0, st->storage_sz));
+    if (st->track_mode == TRACK_SOFT_DIRTY)
+        ASSERT_FN(clear_soft_dirty(st));
+    st->mod_bmap_data.resize(DIV_UP(st->storage_sz, PAGE_SZ));
+    if (st->prefetch)
+        hot_ranges_prefetch(st);
 
-    ASSERT_FN(ap_malloc_init(&storage_ctx, storage_sz));
+    ASSERT_FN(ap_malloc_init(&st->storage_ctx, st->storage_sz));
 
-    ap_static_ctx = &storage_ctx;
+    in_use_scope.disable();
     err_scope.disable();
     return 0;
 }
 
-void ap_storage_uninit() {
-    ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES);
-    munmap(storage_ctx.region, MAX_STORAGE_SPACE);
+ap_storage_t *ap_storage_open(const char *ctrl_file, ap_storage_cbk_t cbk, void *ctx,
+        uint32_t flags)
+{
+    ap_storage_t *st = new ap_storage_t{};
+    st->user_cbk = cbk;
+    st->user_ctx = ctx;
+    st->mod_bmap.o.data = &st->mod_bmap_data;
+    if (storage_open(st, ctrl_file, flags) < 0) {
+        delete st;
+        return NULL;
+    }
+    return st;
+}
+
+void ap_storage_close(ap_storage_t *st) {
+    ap_storage_do_changes(st, AP_STORAGE_REVERT_CHANGES);
+    if (st->wal_mode)
+        wal_close(st);
+    if (st->prefetch)
+        hot_ranges_save(st);
+    storage_unregister(st);
+    munmap(st->reserved_region, st->reserved_sz);
+    track_uninit(st);
+    crc_close(st);
 
     int ignres;
 
-    ignres = ftruncate(storage_fd, last_storage_sz);
-    close(storage_fd);
+    ignres = ftruncate(st->storage_fd, st->last_storage_sz);
+    close(st->storage_fd);
 
-    ignres = ftruncate(backup_fd, last_storage_sz);
-    close(backup_fd);
+    if (st->backup_fd >= 0) {
+        ignres = ftruncate(st->backup_fd, st->last_storage_sz);
+        close(st->backup_fd);
+    }
 
     (void)ignres;
 
-    ctrl->flag_in_use = false;
-    msync(ctrl, CTRL_SZ, MS_SYNC);
-    munmap(ctrl, CTRL_SZ);
-    close(ctrl_fd);
+    st->ctrl->flag_in_use = false;
+    msync(st->ctrl, CTRL_SZ, MS_SYNC);
+    munmap(st->ctrl, CTRL_SZ);
+    close(st->ctrl_fd);
+    delete st;
+}
+
+ap_ctx_t *ap_storage_get_mctx(ap_storage_t *st) {
+    return &st->storage_ctx;
+}
+
+int64_t ap_storage_verify(ap_storage_t *st) {
+    if (!st->checksums) {
+        DBG("The storage has no checksums, see AP_STORAGE_FLAG_CHECKSUMS");
+        return -1;
+    }
+    uint64_t page_cnt;
+    {
+        std::lock_guard guard(st->crc_mu);
+        page_cnt = st->last_storage_sz / PAGE_SZ;
+    }
+    std::atomic<int64_t> bad = 0;
+    int ret = crc_parallel(page_cnt, [st, &bad](uint64_t first, uint64_t cnt, uint8_t *buff) {
+        uint32_t crcs[CRC_CHUNK_PAGES], expected[CRC_CHUNK_PAGES];
+        {
+            /* the backup and it's checksums are read between two commits, the storage may have
+            become smaller since the start */
+            std::lock_guard guard(st->crc_mu);
+            cnt = std::min(cnt, std::max(st->last_storage_sz / PAGE_SZ, first) - first);
+            ASSERT_FN(read_pages(st->backup_fd, buff, first, cnt));
+            ASSERT_FN(read_crcs(st->crc_fd[!st->ctrl->data_used], expected, first, cnt));
+        }
+        crc32c_pages(buff, cnt, crcs);
+        for (uint64_t i = 0; i < cnt; i++) {
+            if (crcs[i] != expected[i]) {
+                DBG("Page %ld of the backup doesn't match it's checksum", first + i);
+                bad++;
+            }
+        }
+        return 0;
+    });
+    return ret < 0 ? -1 : bad.load();
+}
+
+/* the default storage */
+
+int ap_storage_init(const char *ctrl_file, ap_storage_cbk_t cbk, void *ctx, uint32_t flags) {
+    if (default_storage) {
+        DBG("The default storage is already open");
+        return -1;
+    }
+    ASSERT_FN(CHK_BOOL(default_storage = ap_storage_open(ctrl_file, cbk, ctx, flags)));
+    ap_static_ctx = &default_storage->storage_ctx;
+    return 0;
+}
 
+void ap_storage_uninit() {
+    if (!default_storage)
+        return ;
+    ap_storage_close(default_storage);
+    default_storage = NULL;
     ap_static_ctx = NULL;
 }
 
+int ap_storage_do_changes(int action) {
+    return ap_storage_do_changes(default_storage, action);
+}
+
+int ap_storage_commit_async(ap_storage_commit_cbk_t cbk, void *ctx) {
+    return ap_storage_commit_async(default_storage, cbk, ctx);
+}
+
+int ap_storage_wait_commit() {
+    return ap_storage_wait_commit(default_storage);
+}
+
+int ap_storage_replicate(int fd, uint32_t flags) {
+    return ap_storage_replicate(default_storage, fd, flags);
+}
+
+void ap_storage_bulk_begin() {
+    ap_storage_bulk_begin(default_storage);
+}
+
+int ap_storage_bulk_end() {
+    return ap_storage_bulk_end(default_storage);
+}
+
+int ap_storage_savepoint() {
+    return ap_storage_savepoint(default_storage);
+}
+
+int ap_storage_rollback_to(int sp) {
+    return ap_storage_rollback_to(default_storage, sp);
+}
+
+int ap_storage_release(int sp) {
+    return ap_storage_release(default_storage, sp);
+}
+
+int64_t ap_storage_verify() {
+    return ap_storage_verify(default_storage);
+}
+
 ap_ctx_t *ap_storage_get_mctx() {
-    return &storage_ctx;
+    return default_storage ? &default_storage->storage_ctx : NULL;
+}
+
+/* the readers */
+
+struct ap_storage_reader_t {
+    storage_ctrl_t *ctrl;
+    int ctrl_fd = -1;
+    std::string data_path[2];
+
+    /* the pinned snapshot */
+    int data_fd = -1;
+    uint64_t data_sz;
+    uint64_t generation;
+    ap_ctx_t ctx;
+};
+
+static void reader_drop(ap_storage_reader_t *r) {
+    if (r->ctx.region)
+        munmap(r->ctx.region, r->data_sz);
+    if (r->data_fd >= 0)
+        close(r->data_fd);
+    r->ctx.region = NULL;
+    r->data_fd = -1;
+}
+
+static int reader_pin(ap_storage_reader_t *r, int *fd, uint64_t *generation) {
+    /* The last commit is in the file that the writer doesn't use, it is pinned with a shared lock.
+    The writer holds an exclusive lock on the files it writes, so if the lock fails the file is
+    written right now. The pin is good only if no commit started or ended while it was taken, a
+    commit changes data_used when it starts and the generation before it unlocks the backup. */
+    for (int tries = 0; ; tries++) {
+        if (tries >= 16)
+            usleep(1000);
+        else if (tries)
+            sched_yield();
+        uint64_t gen = __atomic_load_n(&r->ctrl->generation, __ATOMIC_SEQ_CST);
+        uint32_t used = __atomic_load_n(&r->ctrl->data_used, __ATOMIC_SEQ_CST);
+        int data_fd = open(r->data_path[!used].c_str(), O_RDONLY | O_CLOEXEC);
+        if (data_fd < 0 && errno == ENOENT)
+            continue;   /* restored from the other file while the writer opens */
+        ASSERT_FN(data_fd);
+        if (flock(data_fd, LOCK_SH | LOCK_NB) < 0) {
+            int err = errno;
+            close(data_fd);
+            if (err != EWOULDBLOCK) {
+                DBG("Failed to lock %s: %s", r->data_path[!used].c_str(), strerror(err));
+                return -1;
+            }
+            continue;
+        }
+        if (gen == __atomic_load_n(&r->ctrl->generation, __ATOMIC_SEQ_CST) &&
+                used == __atomic_load_n(&r->ctrl->data_used, __ATOMIC_SEQ_CST))
+        {
+            *fd = data_fd;
+            *generation = gen;
+            return 0;
+        }
+        close(data_fd);
+    }
+}
+
+int ap_storage_reader_snapshot(ap_storage_reader_t *r) {
+    if (r->data_fd >= 0 && !ap_storage_reader_stale(r))
+        return 0;
+    int fd;
+    uint64_t generation;
+    ASSERT_FN(reader_pin(r, &fd, &generation));
+    FnScope err_scope([fd]{ close(fd); });
+
+    struct stat st_data;
+    ASSERT_FN(fstat(fd, &st_data));
+    void *region = mmap(NULL, st_data.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ASSERT_FN(CHK_MMAP(region));
+    err_scope.disable();
+
+    /* the old snapshot is dropped only now, if the new one fails the reader has none */
+    reader_drop(r);
+    r->data_fd = fd;
+    r->data_sz = st_data.st_size;
+    r->generation = generation;
+    r->ctx.region = region;
+    ASSERT_FN(ap_malloc_init(&r->ctx, r->data_sz));
+    return 0;
+}
+
+static int reader_open(ap_storage_reader_t *r, const char *ctrl_file) {
+    struct stat st_ctrl;
+    ASSERT_FN(r->ctrl_fd = open(ctrl_file, O_RDONLY | O_CLOEXEC));
+    ASSERT_FN(fstat(r->ctrl_fd, &st_ctrl));
+    if (st_ctrl.st_size != CTRL_SZ) {
+        DBG("Malformed ctrl block: size");
+        return -1;
+    }
+    void *ctrl = mmap(NULL, CTRL_SZ, PROT_READ, MAP_SHARED, r->ctrl_fd, 0);
+    ASSERT_FN(CHK_MMAP(ctrl));
+    r->ctrl = (storage_ctrl_t *)ctrl;
+
+    if (r->ctrl->magic != STORAGE_MAGIC) {
+        DBG("The storage %s was not initialized", ctrl_file);
+        return -1;
+    }
+    if (r->ctrl->wal) {
+        /* the data file of a WAL storage doesn't hold the commits that are only in the logs */
+        DBG("Readers need a storage without AP_STORAGE_FLAG_WAL");
+        return -1;
+    }
+    std::string dir = base_dir(ctrl_file), name = base_name(ctrl_file);
+    r->data_path[0] = dir + name + "_0.data";
+    r->data_path[1] = dir + name + "_1.data";
+    r->ctx.flags = AP_MALLOC_FLAG_READ_ONLY;
+    ASSERT_FN(ap_storage_reader_snapshot(r));
+    return 0;
+}
+
+ap_storage_reader_t *ap_storage_reader_open(const char *ctrl_file) {
+    ap_storage_reader_t *r = new ap_storage_reader_t{};
+    if (reader_open(r, ctrl_file) < 0) {
+        ap_storage_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void ap_storage_reader_close(ap_storage_reader_t *r) {
+    reader_drop(r);
+    ap_malloc_unregister_ctx(&r->ctx);
+    if (r->ctrl)
+        munmap(r->ctrl, CTRL_SZ);
+    if (r->ctrl_fd >= 0)
+        close(r->ctrl_fd);
+    delete r;
+}
+
+bool ap_storage_reader_stale(ap_storage_reader_t *r) {
+    return __atomic_load_n(&r->ctrl->generation, __ATOMIC_SEQ_CST) != r->generation;
+}
+
+uint64_t ap_storage_reader_generation(ap_storage_reader_t *r) {
+    return r->generation;
+}
+
+ap_ctx_t *ap_storage_reader_get_mctx(ap_storage_reader_t *r) {
+    return &r->ctx;
 }
@@ -27,10 +27,233 @@ enum {
     AP_STORAGE_COMMIT_CHANGES = 2,
 };
 
-/* this commits or discards the data modified since the last commit */
+enum {
+    /* The storage is mapped at a huge page aligned address, it grows by whole huge pages and it is
+    advised with MADV_HUGEPAGE (see AP_MALLOC_FLAG_HUGE_PAGES). The file mapping gets huge pages
+    only if the file system supports them (for example tmpfs mounted with huge=within_size). The
+    pages are still write protected one by one to find the modified ones, so a write splits the
+    huge page it lands in until the next commit, the gain is for the lookups. */
+    AP_STORAGE_FLAG_HUGE_PAGES = 1,
+
+    /* The modified pages are found by default by write protecting the storage with mprotect and
+    catching the first write to each page in a SIGSEGV handler. That costs a signal and a
+    mprotect for each page, the two flags bellow let the kernel remember the written pages instead
+    and the dirty map is built from /proc/self/pagemap at each commit. At most one can be used and
+    ap_storage_init fails if the kernel doesn't support it. */
+
+    /* Soft dirty bits, cleared with /proc/self/clear_refs after each commit. The clear is for the
+    whole process, so nothing else in the process may use them. The bit is lost if a written page
+    is written back and dropped from memory before the commit, so the storage must fit in memory. */
+    AP_STORAGE_FLAG_TRACK_SOFT_DIRTY = 2,
+
+    /* userfaultfd write protection in async mode, the pages are found with PAGEMAP_SCAN, needs
+    linux 6.7. The protection is kept by the kernel even if the page is dropped from memory. */
+    AP_STORAGE_FLAG_TRACK_UFFD = 4,
+
+    /* Write ahead log instead of the two mirrored data files. The data file is mapped private so
+    it only holds committed data, a commit appends the modified pages to a log with one write and
+    one fdatasync and a background thread copies the log in the data file. ap_storage_init replays
+    the logs that where not copied. The modified pages are private memory until they are copied
+    in the data file. A storage can't change it's mode after it was created. */
+    AP_STORAGE_FLAG_WAL = 8,
+
+    /* The tracking of the modified pages is set up for each segment of 64MB at the first access
+    to it, instead of for the whole storage at open, the segments that where not used yet are
+    mapped without access. The open doesn't depend on the size of the storage, with
+    AP_STORAGE_FLAG_TRACK_UFFD this also spares the page tables of the pages that are never used.
+    The first access to each segment costs a fault. */
+    AP_STORAGE_FLAG_LAZY = 16,
+
+    /* Needs AP_STORAGE_FLAG_LAZY. At close the pages of the used segments that are in memory are
+    saved as the hot ranges of the storage (in <ctrl_file>.hot) and the next open asks the kernel
+    to read them in advance (MADV_WILLNEED), without waiting for them. */
+    AP_STORAGE_FLAG_PREFETCH = 32,
+
+    /* A CRC32C of each page of the two data files is kept in <ctrl_file>_0.crc and _1.crc, the
+    commits write them with the pages. The checksums are made at the first open with this flag and
+    an open without it drops them. Not for AP_STORAGE_FLAG_WAL, the log records have their own
+    checksum. See ap_storage_verify. */
+    AP_STORAGE_FLAG_CHECKSUMS = 64,
+
+    /* Needs AP_STORAGE_FLAG_CHECKSUMS. The open checks all the pages of the storage, a page that
+    doesn't match it's checksum is taken from the backup if the backup's copy is good, else the
+    open fails. */
+    AP_STORAGE_FLAG_VERIFY = 128,
+};
+
+/* result is 0 if the commit is durable, -1 otherwise */
+using ap_storage_commit_cbk_t = void (*)(void *usr_ctx, int result);
+
+/* An open storage. A process can have more of them, each with it's own files, region, dirty pages
+and commits, so different storages can commit in parallel from different threads (one storage is
+used by one thread at a time). The functions that don't take a storage work on the default one,
+the one opened by ap_storage_init, whose ctx is ap_static_ctx. At most one storage can use
+AP_STORAGE_FLAG_TRACK_SOFT_DIRTY. */
+struct ap_storage_t;
+
+/* flags are AP_STORAGE_FLAG_*, returns NULL on error */
+ap_storage_t *ap_storage_open(const char *ctrl_file, ap_storage_cbk_t cbk, void *ctx,
+        uint32_t flags = 0);
+void ap_storage_close(ap_storage_t *st);
+
+int ap_storage_do_changes(ap_storage_t *st, int action);
+int ap_storage_commit_async(ap_storage_t *st, ap_storage_commit_cbk_t cbk = NULL,
+        void *ctx = NULL);
+int ap_storage_wait_commit(ap_storage_t *st);
+ap_ctx_t *ap_storage_get_mctx(ap_storage_t *st);
+
+/* Checks the pages of the last commit against their checksums (AP_STORAGE_FLAG_CHECKSUMS), with
+a thread for each core. It reads the backup file, so it can run in another thread while the
+storage is used, a commit waits at most for the chunk that is being read. Returns the number of
+bad pages or -1 on error. */
+int64_t ap_storage_verify(ap_storage_t *st);
+
+/* Savepoints inside the transaction that the next commit ends. A page that is written for the first
+time after a savepoint is copied by it's write fault before it changes, so a rollback copies back
+only the pages written after the savepoint and a savepoint costs a mprotect for each page that was
+written since the previous one. The storage must use the default tracking (no
+AP_STORAGE_FLAG_TRACK_*). ap_storage_do_changes and ap_storage_commit_async drop all the savepoints.
+
+ap_storage_savepoint returns the number of the new savepoint (the number of savepoints, from 1) or
+-1. ap_storage_rollback_to undoes the changes made after the savepoint sp and drops the savepoints
+after it, sp stays. ap_storage_release drops sp and the savepoints after it and keeps the changes.
+The copies stay until the savepoints are dropped, so a rollback fails if more pages than the
+storage can hold where copied, the whole transaction can still be reverted. */
+int ap_storage_savepoint(ap_storage_t *st);
+int ap_storage_rollback_to(ap_storage_t *st, int sp);
+int ap_storage_release(ap_storage_t *st, int sp);
+
+/* Marks the pages of [ptr, ptr + len) as modified and makes them writable with one mprotect, for
+the code that knows what it will write: the writes that follow don't fault one by one. The pages
+are saved by the next commit even if they are not written. The storage is the one that holds ptr.
+With AP_STORAGE_FLAG_TRACK_* the writes don't fault anyway, only the dirty map is set. */
+int ap_storage_mark_dirty(void *ptr, uint64_t len);
+
+/* While a bulk write is active the memory that the storage gets when it grows is marked as
+modified and left writable, as with ap_storage_mark_dirty, instead of faulting at the first write
+of each page. For loads that fill the memory they allocate (an ap_vector that is pushed to), all the
+growth is saved at the next commit, written or not. Only the growth: the writes to the memory that
+the storage already had still fault once per page, unless that memory is given to
+ap_storage_mark_dirty (or to ap_storage_bulk_write_t as a range). Can be nested, see
+ap_storage_bulk_write_t. ap_storage_bulk_end returns -1 if there is no bulk write to end. */
+void ap_storage_bulk_begin(ap_storage_t *st);
+int ap_storage_bulk_end(ap_storage_t *st);
+
+enum {
+    /* the pages are sent as the runs of 8 byte words that changed since their last commit, if that
+    is smaller. Only without AP_STORAGE_FLAG_WAL, where the last commit of a page is in the
+    backup */
+    AP_STORAGE_REPL_DELTA = 1,
+
+    /* the next commit sends all the pages of the storage, for a follower that starts empty. In
+    WAL mode that is the next commit done with ap_storage_do_changes */
+    AP_STORAGE_REPL_FULL = 2,
+};
+
+/* Replication to a warm standby. Each commit writes a record with the pages it changed to fd
+(a pipe or a socket), so the stream grows with the changes, not with the storage. The record ends
+after the commit is durable, a follower that reads it with ap_storage_replica_apply commits the
+same pages in it's own storage. The follower must start as a copy of the storage at the commit
+where the replication starts (or use AP_STORAGE_REPL_FULL) and must not be changed otherwise.
+
+The commit writes the record, so a slow follower slows the commits and if fd fails the
+replication stops (the commit doesn't). Writing to a pipe that was closed raises SIGPIPE. Reverted
+changes are not sent. flags are AP_STORAGE_REPL_*, fd < 0 stops the replication. */
+int ap_storage_replicate(ap_storage_t *st, int fd, uint32_t flags = 0);
+
+/* reads one record from fd and commits it, returns the size of the record, 0 at the end of the
+stream or -1 on error (the changes of the record are reverted then) */
+int64_t ap_storage_replica_apply(ap_storage_t *st, int fd);
+
+/* This commits or discards the data modified since the last commit. If a commit fails the pages
+it had stay modified, the next commit writes them again and a revert still goes back to the last
+commit that succeeded. */
 int ap_storage_do_changes(int action);
 
-int ap_storage_init(const char *ctrl_file, ap_storage_cbk_t cbk, void *ctx);
+/* Starts a commit and returns while it is written, the application can keep changing the storage,
+those changes belong to the next commit. In WAL mode the modified pages are frozen and a thread
+appends them to the log, a frozen page that is written again before it reached the log is copied
+first (by the write fault with the default tracking, with the other AP_STORAGE_FLAG_TRACK_* all of
+them are copied here). Without AP_STORAGE_FLAG_WAL the commit is done here, before the return.
+
+cbk is called when the commit is durable or failed, from the background thread. At most one
+commit is in flight, the next commit, a revert or ap_storage_uninit wait for it. If it fails it's
+pages are modified again once it is waited for, as for a failed ap_storage_do_changes. */
+int ap_storage_commit_async(ap_storage_commit_cbk_t cbk = NULL, void *ctx = NULL);
+
+/* waits for the commit started by ap_storage_commit_async, returns it's result (0 if there is
+none) */
+int ap_storage_wait_commit();
+
+/* ap_storage_replicate for the default storage */
+int ap_storage_replicate(int fd, uint32_t flags = 0);
+
+/* the bulk writes of the default storage */
+void ap_storage_bulk_begin();
+int ap_storage_bulk_end();
+
+/* a bulk write for as long as the scope is alive, on the default storage if none is given. The
+range of the last constructor is marked with ap_storage_mark_dirty when the scope starts, ret is
+it's result */
+struct ap_storage_bulk_write_t {
+    ap_storage_t *st;
+    int ret = 0;
+
+    ap_storage_bulk_write_t() : st(NULL) { ap_storage_bulk_begin(); }
+    ap_storage_bulk_write_t(ap_storage_t *st) : st(st) { ap_storage_bulk_begin(st); }
+    ap_storage_bulk_write_t(void *ptr, uint64_t len, ap_storage_t *st = NULL) : st(st) {
+        if (st)
+            ap_storage_bulk_begin(st);
+        else
+            ap_storage_bulk_begin();
+        ret = ap_storage_mark_dirty(ptr, len);
+    }
+    ~ap_storage_bulk_write_t() {
+        if (st)
+            ap_storage_bulk_end(st);
+        else
+            ap_storage_bulk_end();
+    }
+
+    ap_storage_bulk_write_t(const ap_storage_bulk_write_t&) = delete;
+    ap_storage_bulk_write_t &operator = (const ap_storage_bulk_write_t&) = delete;
+};
+
+/* the savepoints of the default storage */
+int ap_storage_savepoint();
+int ap_storage_rollback_to(int sp);
+int ap_storage_release(int sp);
+
+/* ap_storage_verify for the default storage */
+int64_t ap_storage_verify();
+
+/* Read only snapshots of the last commit, for other processes that only scan the data (an
+ap_map or an ap_vector can be read in place with the ctx of the reader). A reader pins the data
+file that holds the last commit with a shared flock, the writer doesn't wait for it: if the next
+commit must write a pinned file it writes a new copy of the storage file in it's place and the
+reader keeps the old one. That copy is of the whole storage, unless the file system can share the
+blocks (see copy_file_range), so the readers should not keep a snapshot for longer than needed.
+Only storages without AP_STORAGE_FLAG_WAL can be read this way and a process can't read a storage
+that it has open (see AP_MALLOC_FLAG_READ_ONLY). */
+struct ap_storage_reader_t;
+
+/* opens the storage of ctrl_file and pins it's last commit, returns NULL on error */
+ap_storage_reader_t *ap_storage_reader_open(const char *ctrl_file);
+void ap_storage_reader_close(ap_storage_reader_t *r);
+
+/* moves the reader to the last commit, it does nothing if there is no newer one. The pointers of
+the old snapshot are invalid after this, the ctx stays the same */
+int ap_storage_reader_snapshot(ap_storage_reader_t *r);
+
+/* true if a commit was done after the pinned one */
+bool ap_storage_reader_stale(ap_storage_reader_t *r);
+
+/* the number of commits of the storage at the pinned one */
+uint64_t ap_storage_reader_generation(ap_storage_reader_t *r);
+ap_ctx_t *ap_storage_reader_get_mctx(ap_storage_reader_t *r);
+
+/* flags are AP_STORAGE_FLAG_* */
+int ap_storage_init(const char *ctrl_file, ap_storage_cbk_t cbk, void *ctx, uint32_t flags = 0);
 void ap_storage_uninit();
 
 ap_ctx_t *ap_storage_get_mctx();
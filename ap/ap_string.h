@@ -73,6 +73,10 @@ public:
         return vec.data();
     }
 
+    void reloc(const ap_malloc_reloc_table_t *table) {
+        vec.reloc(table);
+    }
+
     void clear() {
         vec.clear();
         vec.push_back('\0');
@@ -3,6 +3,7 @@
 
 #include <utility>
 #include <iterator>
+#include <type_traits>
 #include "ap_malloc.h"
 #include "misc_utils.h"
 #include "bit_utils.h"
@@ -179,6 +180,25 @@ public:
 
         uint64_t new_sz = new_cap * sizeof(T);
 
+        /* objects that can be copied byte by byte are left to realloc, the others can only be
+        grown in place, else they must be moved one by one */
+        if constexpr (std::is_trivially_copyable_v<T> &&
+                std::is_same_v<FNS_T, ap_vector_cpp_fns_t<T>>)
+        {
+            ap_off_t new_data = ap_malloc_realloc(ctx, datap, new_sz);
+            if (!new_data) {
+                AP_EXCEPT("Failed to realloc mem");
+                return -1;
+            }
+            datap = new_data;
+            cap = new_cap;
+            return 0;
+        }
+        if (datap && ap_malloc_realloc_inplace(ctx, datap, new_sz) == 0) {
+            cap = new_cap;
+            return 0;
+        }
+
         ap_off_t new_data = ap_malloc_alloc(ctx, new_sz);
         if (!new_data) {
             AP_EXCEPT("Failed to alloc new mem");
@@ -364,6 +384,14 @@ public:
         return *(cbegin() + n);
     }
 
+    /* after ap_malloc_compact, replaces the offsets owned by the vector and by it's elements */
+    void reloc(const ap_malloc_reloc_table_t *table) {
+        datap = ap_malloc_reloc_off(table, datap);
+        if constexpr (requires (T &obj) { obj.reloc(table); })
+            for (auto &obj : *this)
+                obj.reloc(table);
+    }
+
     /* TODO: implement others */
 };
 
@@ -246,7 +246,7 @@ private:
     avl_ptr_t balance_insert(avl_ptr_t node, avl_ptr_t new_node) {
         int bal = compute_bal(node);
 
-        if (bal > 1 && get_left(node) && cmp(new_node, node) < 0)
+        if (bal > 1 && cmp(new_node, get_left(node)) < 0)
             return right_rotate(node);
 
         // DBG("1blake?");
@@ -128,7 +128,7 @@ struct generic_bitmap_t : public ap::ap_bmap_ctx_wrap_t<bmap_ctx_t> {
                 } while (i % bpw);
             }
             else
-                i = (i / bpw + 1) * bpw;
+                i = next_word(i / bpw + 1) * bpw;
             word_idx = i / bpw;
         }
         return I(-1);
@@ -161,6 +161,15 @@ struct generic_bitmap_t : public ap::ap_bmap_ctx_wrap_t<bmap_ctx_t> {
         return iter_t(this, get_sz() * bpw);
     }
 
+    /* a ctx that knows where the set words are (for example a sparse bitmap) can provide
+    next_word_fn, that returns the first word from i on that may be non zero */
+    I next_word(I i) const {
+        if constexpr (requires (const bmap_ctx_t &o) { o.next_word_fn(i); })
+            return ctx_t::o.next_word_fn(i);
+        else
+            return i;
+    }
+
     W       get_word(I i)       const   { return ctx_t::o.get_word_fn(i); }
     void    set_word(I i, W w)          { ctx_t::o.set_word_fn(i, w); }
     SZ      get_sz()            const   { return ctx_t::o.get_sz_fn(); }
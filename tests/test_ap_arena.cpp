@@ -0,0 +1,206 @@
+#define AP_EXCEPT_THROW
+
+#include "ap_arena.h"
+#include "ap_string.h"
+#include "ap_map.h"
+#include "debug.h"
+
+#include <string>
+
+#define TOTAL_MEM   (8*1024*1024)
+#define INIT_MEM    (4096)
+
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz);
+
+alignas(16) static uint8_t mem[TOTAL_MEM];
+static ap_ctx_t mc = {
+    .region = mem,
+    .add_mem_fn = add_mem_fn
+};
+
+static ap_sz_t tot_mem = INIT_MEM;
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    tot_mem += sz;
+    if (tot_mem > TOTAL_MEM)
+        return -1;
+    return 0;
+}
+
+/* a parent whose region is copied to the other buffer at each grow, the old one is poisoned, as
+if it was remapped somewhere else */
+#define MOVE_MEM    (2*1024*1024)
+
+static int move_mem_fn(ap_ctx_t *ctx, ap_sz_t sz);
+
+alignas(16) static uint8_t move_mem[2][MOVE_MEM];
+static ap_ctx_t move_mc = {
+    .region = move_mem[0],
+    .add_mem_fn = move_mem_fn
+};
+
+static ap_sz_t move_tot_mem = INIT_MEM;
+static int move_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    if (move_tot_mem + sz > MOVE_MEM)
+        return -1;
+    uint8_t *old = (uint8_t *)ctx->region;
+    uint8_t *dst = old == move_mem[0] ? move_mem[1] : move_mem[0];
+    memcpy(dst, old, move_tot_mem);
+    memset(old, 0xff, move_tot_mem);
+    ctx->region = dst;
+    move_tot_mem += sz;
+    return 0;
+}
+
+/* the vector grows in place, as it is allways the last allocation of the arena, 4096 elements
+fit in a block */
+static int test_vector(ap_arena_t *arena) {
+    using vec_t = ap_vector_t<uint64_t>;
+    auto vec = (vec_t *)ap_malloc_ptr(&arena->ctx, ap_arena_alloc(arena, sizeof(vec_t)));
+    ASSERT_FN(vec->init(&arena->ctx));
+    ap_arena_block_t *block = (ap_arena_block_t *)ap_malloc_ptr(&mc, arena->block);
+    for (uint64_t i = 0; i < 4000; i++)
+        vec->push_back(i * 3);
+    for (uint64_t i = 0; i < 4000; i++)
+        if ((*vec)[i] != i * 3) {
+            DBG("vector element %ld is wrong", i);
+            return -1;
+        }
+    if ((ap_arena_block_t *)ap_malloc_ptr(&mc, arena->block) != block) {
+        DBG("the vector did not grow in place");
+        return -1;
+    }
+    return 0;
+}
+
+/* each scope drops what was allocated in it, the outer objects must stay intact */
+static int test_scopes(ap_arena_t *arena) {
+    auto outer = (ap_string_t *)ap_malloc_ptr(&arena->ctx,
+            ap_arena_alloc(arena, sizeof(ap_string_t)));
+    ASSERT_FN(outer->init(&arena->ctx));
+    outer->append("outer string");
+
+    auto mark = ap_arena_mark(arena);
+    for (int round = 0; round < 3; round++) {
+        ap_arena_scope_t scope(arena);
+        using map_t = ap_map_t<int, int>;
+        auto map = (map_t *)ap_malloc_ptr(&arena->ctx, ap_arena_alloc(arena, sizeof(map_t)));
+        map->init(&arena->ctx);
+        for (int i = 0; i < 10000; i++)
+            (*map)[i] = i + round;
+        {
+            ap_arena_scope_t inner(arena);
+            std::string expect;
+            auto str = (ap_string_t *)ap_malloc_ptr(&arena->ctx,
+                    ap_arena_alloc(arena, sizeof(ap_string_t)));
+            ASSERT_FN(str->init(&arena->ctx));
+            for (int i = 0; i < 1000; i++) {
+                str->append(std::to_string(i));
+                expect += std::to_string(i);
+            }
+            if (expect != str->c_str()) {
+                DBG("the inner string is wrong");
+                return -1;
+            }
+        }
+        for (int i = 0; i < 10000; i++)
+            if ((*map)[i] != i + round) {
+                DBG("map element %d is wrong", i);
+                return -1;
+            }
+    }
+    auto after = ap_arena_mark(arena);
+    if (after.block != mark.block || after.cur != mark.cur) {
+        DBG("the scopes did not release their allocations");
+        return -1;
+    }
+    if (std::string("outer string") != outer->c_str()) {
+        DBG("the outer string was overwritten");
+        return -1;
+    }
+    return 0;
+}
+
+/* the parent grows and moves through it's own allocations, the containers of the arena must
+follow it */
+static int test_moving_parent() {
+    ASSERT_FN(ap_malloc_init(&move_mc, INIT_MEM));
+    ap_arena_t arena;
+    ASSERT_FN(ap_arena_init(&arena, &move_mc, 16 * 1024));
+    using vec_t = ap_vector_t<uint64_t>;
+    ap_off_t vec_off = ap_arena_alloc(&arena, sizeof(vec_t));
+    ASSERT_FN(CHK_BOOL(vec_off));
+    ASSERT_FN(((vec_t *)ap_malloc_ptr(&arena.ctx, vec_off))->init(&arena.ctx));
+    ap_malloc_set_usr(&arena.ctx, vec_off);
+
+    int moves = 0;
+    for (uint64_t round = 0; round < 8; round++) {
+        void *region = move_mc.region;
+        ASSERT_FN(CHK_BOOL(ap_malloc_alloc(&move_mc, 64 * 1024)));
+        moves += move_mc.region != region;
+
+        auto vec = (vec_t *)ap_malloc_ptr(&arena.ctx, ap_malloc_get_usr(&arena.ctx));
+        for (uint64_t i = 0; i < 100; i++)
+            vec->push_back(round * 100 + i);
+        for (uint64_t i = 0; i < vec->size(); i++)
+            if ((*vec)[i] != i) {
+                DBG("vector element %ld is wrong after the parent moved", i);
+                return -1;
+            }
+    }
+    if (!moves) {
+        DBG("the parent's region never moved");
+        return -1;
+    }
+    ap_arena_uninit(&arena);
+    ASSERT_FN(ap_malloc_validate(&move_mc));
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    DBG_SCOPE();
+    ap_ctx_t *ctx = &mc;
+    ASSERT_FN(ap_malloc_init(ctx, INIT_MEM));
+    auto st0 = ap_malloc_stats(ctx);
+
+    ap_arena_t arena;
+    ASSERT_FN(ap_arena_init(&arena, ctx, 64 * 1024));
+    if (ap_malloc_get_ctx(arena.ctx.ctx_id) != &arena.ctx) {
+        DBG("the arena's ctx is not registered");
+        return -1;
+    }
+
+    ASSERT_FN(test_vector(&arena));
+    ASSERT_FN(test_scopes(&arena));
+
+    /* after a reset the same blocks are used again */
+    auto st = ap_malloc_stats(ctx);
+    ap_arena_reset(&arena);
+    ASSERT_FN(test_vector(&arena));
+    ASSERT_FN(test_scopes(&arena));
+    if (ap_malloc_stats(ctx).used_bytes != st.used_bytes) {
+        DBG("the arena did not reuse it's blocks");
+        return -1;
+    }
+
+    /* large and aligned allocations */
+    ap_off_t big = ap_arena_alloc(&arena, 1024 * 1024);
+    ap_off_t aligned = ap_arena_alloc(&arena, 100, 4096);
+    ASSERT_FN(CHK_BOOL(big && aligned));
+    memset(ap_malloc_ptr(ctx, big), 1, 1024 * 1024);
+    if ((uintptr_t)ap_malloc_ptr(ctx, aligned) % 4096) {
+        DBG("the allocation is not aligned");
+        return -1;
+    }
+
+    ap_arena_uninit(&arena);
+    ASSERT_FN(ap_malloc_validate(ctx));
+    ASSERT_FN(test_moving_parent());
+    auto st1 = ap_malloc_stats(ctx);
+    if (st1.used_bytes != st0.used_bytes) {
+        DBG("the arena did not give back all it's blocks: %ld/%ld", st1.used_bytes,
+                st0.used_bytes);
+        return -1;
+    }
+    return 0;
+}
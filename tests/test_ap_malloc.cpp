@@ -1,28 +1,38 @@
 #include "ap_malloc.h"
 #include <cstddef>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <random>
 #include "debug.h"
 #include "bit_utils.h"
 
 #define TOTAL_MEM   (1024*1024)
 #define INIT_MEM    (4096)
 
-static int add_mem_fn(ap_sz_t sz);
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz);
+static int rm_mem_fn(ap_ctx_t *ctx, ap_sz_t sz);
 
 static uint8_t mem[TOTAL_MEM];
 static ap_ctx_t mc = {
     .region = mem,
-    .add_mem_fn = add_mem_fn
+    .add_mem_fn = add_mem_fn,
+    .rm_mem_fn = rm_mem_fn,
 };
 
 static ap_sz_t tot_mem = INIT_MEM;
-static int add_mem_fn(ap_sz_t sz) {
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
     tot_mem += sz;
     if (tot_mem > TOTAL_MEM)
         return -1;
     return 0;
 }
 
+static int rm_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    tot_mem -= sz;
+    return 0;
+}
+
 static void *p(ap_off_t off) {
     ap_ctx_t *ctx = &mc;
     auto ret = ap_malloc_ptr(ctx, off);
@@ -64,6 +74,181 @@ static void free(ap_off_t off) {
 static void tdbg() {
     ap_ctx_t *ctx = &mc;
     ap_malloc_dbg_print(ctx);
+    if (ap_malloc_validate(ctx) < 0) {
+        DBG("the region is not consistent");
+        exit(-1);
+    }
+}
+
+struct walk_sum_t {
+    uint64_t cnt;
+    uint64_t free_cnt;
+    ap_sz_t free_bytes;
+};
+
+static int walk_cbk(const ap_malloc_chunk_info_t *info, void *usr) {
+    auto sum = (walk_sum_t *)usr;
+    sum->cnt++;
+    sum->free_cnt += info->is_free;
+    sum->free_bytes += info->is_free ? info->sz : 0;
+    return 0;
+}
+
+/* the compaction test keeps the offsets of it's objects in an index that is in the region */
+#define COMPACT_OBJ_CNT 2000
+
+static void compact_reloc_fn(ap_ctx_t *ctx, const ap_malloc_reloc_table_t *table, void *usr) {
+    auto index = (ap_off_t *)ap_malloc_ptr(ctx, ap_malloc_get_usr(ctx));
+    for (int i = 0; i < COMPACT_OBJ_CNT; i++)
+        index[i] = ap_malloc_reloc_off(table, index[i]);
+}
+
+static int test_compact() {
+    /* every 8th object is aligned, from 32 to 4096 bytes, and a few are page isolated, they must
+    keep their alignment when they are moved */
+    ap_ctx_t *ctx = &mc;
+    std::vector<ap_sz_t> sizes(COMPACT_OBJ_CNT);
+    std::vector<ap_sz_t> aligns(COMPACT_OBJ_CNT, 16);
+    std::vector<ap_off_t> first_offs(COMPACT_OBJ_CNT);
+    ap_off_t index_off = ap_malloc_alloc(ctx, COMPACT_OBJ_CNT * sizeof(ap_off_t));
+    ASSERT_FN(CHK_BOOL(index_off));
+    ap_malloc_set_usr(ctx, index_off);
+
+    std::mt19937 rng(5);
+    for (int i = 0; i < COMPACT_OBJ_CNT; i++) {
+        sizes[i] = rng() % 4 ? rng() % 200 + 1 : rng() % 2000 + 1;
+        ap_off_t off;
+        if (i % 100 == 3) {
+            sizes[i] = AP_MALLOC_PAGE_MIN_SZ + rng() % 2000;
+            aligns[i] = AP_MALLOC_PAGE_SZ;
+            mc.flags |= AP_MALLOC_FLAG_PAGE_ISOLATE;
+            off = ap_malloc_alloc(ctx, sizes[i]);
+            mc.flags &= ~AP_MALLOC_FLAG_PAGE_ISOLATE;
+        }
+        else if (i % 8 == 0) {
+            aligns[i] = 32 << (i / 8 % 8);
+            off = ap_malloc_alloc_aligned(ctx, sizes[i], aligns[i]);
+        }
+        else {
+            off = ap_malloc_alloc(ctx, sizes[i]);
+        }
+        ASSERT_FN(CHK_BOOL(off));
+        first_offs[i] = off;
+        memset(p(off), i, sizes[i]);
+        ((ap_off_t *)p(ap_malloc_get_usr(ctx)))[i] = off;
+    }
+    for (int i = 0; i < COMPACT_OBJ_CNT; i++)
+        if (rng() % 3) {
+            auto index = (ap_off_t *)p(ap_malloc_get_usr(ctx));
+            ap_malloc_free(ctx, index[i]);
+            index[i] = 0;
+        }
+    ap_sz_t region_sz = tot_mem;
+    auto st0 = ap_malloc_stats(ctx);
+
+    int ret, calls = 0;
+    while ((ret = ap_malloc_compact(ctx, compact_reloc_fn, NULL, 100)) == 0)
+        calls++;
+    ASSERT_FN(ret);
+    ASSERT_FN(ap_malloc_validate(ctx));
+    auto st = ap_malloc_stats(ctx);
+    DBG("compacted in %d calls, region: %ld -> %ld free: %ld -> %ld", calls + 1, region_sz,
+            tot_mem, st0.free_bytes, st.free_bytes);
+
+    auto index = (ap_off_t *)p(ap_malloc_get_usr(ctx));
+    int moved_aligned = 0;
+    for (int i = 0; i < COMPACT_OBJ_CNT; i++) {
+        if (!index[i])
+            continue;
+        auto obj = (uint8_t *)p(index[i]);
+        if ((uintptr_t)obj % aligns[i] != 0) {
+            DBG("object %d lost it's alignment of %ld", i, aligns[i]);
+            return -1;
+        }
+        moved_aligned += aligns[i] > 16 && index[i] != first_offs[i];
+        for (ap_sz_t j = 0; j < sizes[i]; j++)
+            if (obj[j] != uint8_t(i)) {
+                DBG("object %d was not moved correctly", i);
+                return -1;
+            }
+        ap_malloc_free(ctx, index[i]);
+    }
+    if (tot_mem >= region_sz || st.region_sz != tot_mem) {
+        DBG("the region was not trimmed");
+        return -1;
+    }
+    if (!moved_aligned) {
+        DBG("no aligned object was moved");
+        return -1;
+    }
+    ap_malloc_free(ctx, ap_malloc_get_usr(ctx));
+    ap_malloc_set_usr(ctx, 0);
+    return 0;
+}
+
+static int test_old_layout() {
+    /* a region with the magic of the first layout, that has no version, must not be used and must
+    not be initialized again over it's data */
+    alignas(16) static uint64_t old_mem[INIT_MEM / sizeof(uint64_t)];
+    old_mem[1] = 0xd0caffe;
+    old_mem[2] = INIT_MEM;
+    old_mem[8] = 0x1234;
+    ap_ctx_t old_ctx{};
+    old_ctx.region = old_mem;
+    if (ap_malloc_init(&old_ctx, INIT_MEM) == 0) {
+        DBG("a region with the old layout was used");
+        return -1;
+    }
+    if (old_mem[1] != 0xd0caffe || old_mem[8] != 0x1234) {
+        DBG("a region with the old layout was changed");
+        return -1;
+    }
+    return 0;
+}
+
+static int test_trim() {
+    /* a large free chunk at the end of the region gives back it's pages, without rm_mem_fn the tail
+    is not cut. A part of it is then allocated again and the rest must stay released. */
+    ap_ctx_t *ctx = &mc;
+    ctx->rm_mem_fn = nullptr;
+    ap_off_t big = alloc(300 * 1024);
+    free(big);
+    auto st0 = ap_malloc_stats(ctx);
+    ASSERT_FN(ap_malloc_trim(ctx));
+    ASSERT_FN(ap_malloc_validate(ctx));
+    auto st = ap_malloc_stats(ctx);
+    DBG("released: %ld -> %ld trimmed: %ld", st0.released_bytes, st.released_bytes,
+            st.trimmed_bytes);
+    if (st.released_bytes < st0.released_bytes + 280 * 1024 ||
+            st.trimmed_bytes != st0.trimmed_bytes + st.released_bytes - st0.released_bytes)
+    {
+        DBG("the free chunk was not released");
+        return -1;
+    }
+
+    /* trimming again does nothing */
+    ASSERT_FN(ap_malloc_trim(ctx));
+    if (ap_malloc_stats(ctx).trimmed_bytes != st.trimmed_bytes) {
+        DBG("the chunk was released twice");
+        return -1;
+    }
+
+    ap_off_t part = alloc(100 * 1024);
+    ASSERT_FN(ap_malloc_validate(ctx));
+    auto st2 = ap_malloc_stats(ctx);
+    DBG("after alloc released: %ld refault: %ld", st2.released_bytes, st2.refault_bytes);
+    if (st2.refault_bytes < st.refault_bytes + 90 * 1024 ||
+            st2.released_bytes + st2.refault_bytes != st.released_bytes + st.refault_bytes ||
+            st2.released_bytes <= st0.released_bytes)
+    {
+        DBG("the refaulted bytes are not counted");
+        return -1;
+    }
+    free(part);
+    ctx->rm_mem_fn = rm_mem_fn;
+    ASSERT_FN(ap_malloc_trim(ctx));
+    ASSERT_FN(ap_malloc_validate(ctx));
+    return 0;
 }
 
 int main(int argc, char const *argv[])
@@ -114,6 +299,146 @@ int main(int argc, char const *argv[])
     free(p5);
     tdbg();
 
+    /* small bins: allocate objects of all the small sizes, free them in a random order and check
+    that the remaining objects where not touched */
+    std::vector<std::pair<ap_off_t, uint8_t>> small;
+    for (int i = 0; i < 4096; i++) {
+        ap_sz_t sz = rand() % AP_MALLOC_SBIN_MAX_SZ + 1;
+        auto off = alloc(sz);
+        if (off % 16 != 0) {
+            DBG("small bin object not aligned: %lx", off);
+            return -1;
+        }
+        memset(p(off), i & 0xff, sz);
+        small.push_back({off, i & 0xff});
+    }
+    std::shuffle(small.begin(), small.end(), std::mt19937{});
+    for (auto [off, val] : small) {
+        uint8_t *ptr = (uint8_t *)p(off);
+        for (ap_sz_t i = 0; i < off_sz[off]; i++) {
+            if (ptr[i] != val) {
+                DBG("small bin object was overwritten: %lx", off);
+                return -1;
+            }
+        }
+        free(off);
+    }
+    tdbg();
+
+    /* realloc: a chunk that is followed by a free chunk grows in place, a chunk that is followed by
+    a used one is copied, and the content is kept in both cases */
+    auto r0 = alloc(1024);
+    auto r1 = alloc(1024);
+    auto r2 = alloc(1024);
+    memset(p(r0), 0x11, 1024);
+    free(r1);
+    auto r0_new = ap_malloc_realloc(ctx, r0, 2000);
+    if (r0_new != r0) {
+        DBG("realloc did not grow in place");
+        return -1;
+    }
+    auto r0_copy = ap_malloc_realloc(ctx, r0, 8192);
+    if (r0_copy == r0 || ((uint8_t *)p(r0_copy))[1023] != 0x11) {
+        DBG("realloc failed to copy");
+        return -1;
+    }
+    if (ap_malloc_realloc(ctx, r0_copy, 512) != r0_copy || ap_malloc_realloc_inplace(ctx, r2, 8)) {
+        DBG("realloc failed to shrink in place");
+        return -1;
+    }
+    off_sz[r2] = 8;
+    auto s0 = ap_malloc_realloc(ctx, 0, 10);
+    if (ap_malloc_realloc_inplace(ctx, s0, 15) < 0 || ap_malloc_realloc_inplace(ctx, s0, 100) == 0) {
+        DBG("small bin realloc in place");
+        return -1;
+    }
+    s0 = ap_malloc_realloc(ctx, s0, 100);
+    ap_malloc_free(ctx, s0);
+    ap_malloc_free(ctx, r0_copy);
+    off_sz.erase(r0);
+    free(r2);
+    tdbg();
+
+    /* aligned allocations, the padding in front must be usable again after they are freed */
+    std::vector<ap_off_t> aligned;
+    for (ap_sz_t align = 32; align <= 8192; align *= 2) {
+        for (int i = 0; i < 4; i++) {
+            ap_sz_t sz = rand() % 2048 + 1;
+            auto off = ap_malloc_alloc_aligned(ctx, sz, align);
+            if (!off || (uintptr_t)p(off) % align != 0) {
+                DBG("aligned allocation failed: %lx align: %ld", off, align);
+                return -1;
+            }
+            memset(p(off), 0xff, sz);
+            aligned.push_back(off);
+        }
+    }
+    for (auto off : aligned)
+        ap_malloc_free(ctx, off);
+    tdbg();
+
+    /* page isolated objects: the object has it's pages for itself */
+    mc.flags |= AP_MALLOC_FLAG_PAGE_ISOLATE;
+    auto pg0 = ap_malloc_alloc(ctx, 5000);
+    auto pg1 = ap_malloc_alloc(ctx, 100);
+    auto pg2 = ap_malloc_alloc(ctx, 4096);
+    if ((uintptr_t)p(pg0) % AP_MALLOC_PAGE_SZ || (uintptr_t)p(pg2) % AP_MALLOC_PAGE_SZ ||
+            (pg1 > pg0 && pg1 < pg0 + 2 * AP_MALLOC_PAGE_SZ))
+    {
+        DBG("page isolation failed: %lx %lx %lx", pg0, pg1, pg2);
+        return -1;
+    }
+    ap_malloc_free(ctx, pg0);
+    ap_malloc_free(ctx, pg1);
+    ap_malloc_free(ctx, pg2);
+    mc.flags &= ~AP_MALLOC_FLAG_PAGE_ISOLATE;
+    tdbg();
+
+    /* stats: a free chunk in the middle of used ones fragments the free space, the walk must see
+    the same chunks as the counters, after all is freed the free space must be as before */
+    auto st0 = ap_malloc_stats(ctx);
+    auto f0 = alloc(4000);
+    auto f1 = alloc(4000);
+    auto f2 = alloc(4000);
+    free(f1);
+    auto st = ap_malloc_stats(ctx);
+    walk_sum_t sum{};
+    ASSERT_FN(ap_malloc_walk(ctx, walk_cbk, &sum));
+    DBG("stats: region: %ld used: %ld free: %ld largest: %ld chunks: %ld free chunks: %ld "
+            "sbins: %ld allocs: %ld frees: %ld frag: %.3f search: %.2f", st.region_sz,
+            st.used_bytes, st.free_bytes, st.largest_free, st.chunk_cnt, st.free_chunk_cnt,
+            st.sbin_cnt, st.alloc_cnt, st.free_cnt, st.frag_ratio, st.avg_search_len);
+    ap_sz_t l2_sum = 0;
+    for (auto b : st.free_bytes_l2)
+        l2_sum += b;
+    if (sum.cnt != st.chunk_cnt || sum.free_cnt != st.free_chunk_cnt ||
+            sum.free_bytes != st.free_bytes || l2_sum != st.free_bytes || st.free_chunk_cnt < 2 ||
+            st.frag_ratio <= 0 || st.largest_free >= st.free_bytes || st.used_bytes < 8000 ||
+            st.alloc_cnt < st.free_cnt || st.avg_search_len < 1)
+    {
+        DBG("stats don't match the region");
+        return -1;
+    }
+    free(f0);
+    free(f2);
+    st = ap_malloc_stats(ctx);
+    if (st.free_chunk_cnt != st0.free_chunk_cnt || st.free_bytes != st0.free_bytes ||
+            st.largest_free != st0.largest_free || st.alloc_cnt != st0.alloc_cnt + 3 ||
+            st.free_cnt != st0.free_cnt + 3)
+    {
+        DBG("the free space is not as before the allocations");
+        return -1;
+    }
+    tdbg();
+
+    ASSERT_FN(test_compact());
+    tdbg();
+
+    ASSERT_FN(test_trim());
+    tdbg();
+
+    ASSERT_FN(test_old_layout());
+
     /* TODO: more tests */
     return 0;
 }
@@ -0,0 +1,449 @@
+#define AP_EXCEPT_THROW
+
+#include "ap_map.h"
+#include "ap_hashmap.h"
+#include "ap_vector.h"
+#include "ap_string.h"
+#include "ap_arena.h"
+#include "debug.h"
+#include "misc_utils.h"
+#include "time_utils.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <tuple>
+
+/* Allocator benchmarks: each workload runs on a fresh region, once with the small bins disabled
+and once with them enabled. For each run we print the time it took and the size that the region
+grew to. Workloads that record the latency of each operation also get their percentiles
+printed. The last ones measure what ap_malloc_trim gives back on a file backed region and the
+effect of huge pages on random map lookups. */
+
+#define REGION_SZ   (1ULL << 32)
+#define INIT_MEM    (4096)
+
+static uint8_t *region;
+static ap_sz_t region_sz;
+static std::vector<uint64_t> lat_ns;
+
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    if (region_sz + sz > REGION_SZ)
+        return -1;
+    region_sz += sz;
+    return 0;
+}
+
+static int new_region(ap_ctx_t *ctx, uint32_t flags) {
+    if (region)
+        munmap(region, REGION_SZ);
+    region = (uint8_t *)mmap(NULL, REGION_SZ, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT_FN(CHK_MMAP(region));
+    region_sz = INIT_MEM;
+
+    *ctx = ap_ctx_t{};
+    ctx->region = region;
+    ctx->add_mem_fn = add_mem_fn;
+    ctx->flags = flags;
+    ASSERT_FN(ap_malloc_init(ctx, INIT_MEM));
+    return 0;
+}
+
+using bench_fn_t = void (*)(ap_ctx_t *ctx, uint64_t n);
+
+static int run_bench(const char *name, bench_fn_t fn, uint64_t n) {
+    const std::pair<const char *, uint32_t> modes[] = {
+        {"chunks", AP_MALLOC_FLAG_NO_SBIN},
+        {"sbins", 0},
+    };
+    for (auto [mode, flags] : modes) {
+        ap_ctx_t ctx;
+        ASSERT_FN(new_region(&ctx, flags));
+        uint64_t start = get_time_us();
+        fn(&ctx, n);
+        uint64_t dt = get_time_us() - start;
+        DBG("%-16s %-8s n: %8ld time: %8.3fms ns/op: %8.2f region: %10ld", name, mode, n,
+                dt / 1000., dt * 1000. / n, region_sz);
+        if (lat_ns.size()) {
+            std::sort(lat_ns.begin(), lat_ns.end());
+            auto pct = [](double p) { return lat_ns[(lat_ns.size() - 1) * p]; };
+            DBG("%-16s %-8s p50: %6ldns p99: %6ldns p99.9: %6ldns p99.99: %6ldns max: %8ldns",
+                    name, mode, pct(.5), pct(.99), pct(.999), pct(.9999), lat_ns.back());
+            lat_ns.clear();
+        }
+    }
+    return 0;
+}
+
+/* inserts, searches and erases random keys in an ap_map_t */
+static void bench_map(ap_ctx_t *ctx, uint64_t n) {
+    using map_t = ap_map_t<uint64_t, uint64_t>;
+    auto map = (map_t *)ap_malloc_ptr(ctx, ap_malloc_alloc(ctx, sizeof(map_t)));
+    map->init(ctx);
+
+    std::mt19937_64 rng(n);
+    std::vector<uint64_t> keys(n);
+    for (auto &k : keys) {
+        k = rng();
+        map->insert(k, k);
+    }
+    for (auto k : keys)
+        if (map->find(k) == map->end())
+            DBG("key not found: %lx", k);
+    for (auto k : keys)
+        map->erase(k);
+}
+
+/* push_back and indexed reads on an ap_vector_t, each of them resolves the ctx_id */
+static void bench_vector(ap_ctx_t *ctx, uint64_t n) {
+    using vec_t = ap_vector_t<uint64_t>;
+    auto vec = (vec_t *)ap_malloc_ptr(ctx, ap_malloc_alloc(ctx, sizeof(vec_t)));
+    vec->init(ctx);
+
+    for (uint64_t i = 0; i < n; i++)
+        vec->push_back(i);
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i++)
+        sum += (*vec)[i];
+    if (sum != n * (n - 1) / 2)
+        DBG("wrong sum: %ld", sum);
+    vec->uninit();
+}
+
+/* the lookup that all the containers do */
+static void bench_ctx_lookup(ap_ctx_t *ctx, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++)
+        if (ap_malloc_get_ctx(ctx->ctx_id) != ctx)
+            DBG("wrong ctx");
+}
+
+/* does the allocations an ap_hashmap_t does for it's nodes, with a random half of them freed
+and reallocated in the middle */
+static void bench_hmap_nodes(ap_ctx_t *ctx, uint64_t n) {
+    using node_t = ap_hashmap_t<uint64_t, uint64_t>::hmap_node_t;
+    std::mt19937_64 rng(n);
+    std::vector<ap_off_t> nodes(n);
+    for (auto &node : nodes)
+        node = ap_malloc_alloc(ctx, sizeof(node_t));
+    for (uint64_t i = 0; i < n / 2; i++) {
+        auto &node = nodes[rng() % n];
+        ap_malloc_free(ctx, node);
+        node = ap_malloc_alloc(ctx, sizeof(node_t));
+    }
+    for (auto node : nodes)
+        ap_malloc_free(ctx, node);
+}
+
+/* random small sizes, allocated and freed in a random order */
+static void bench_small_mixed(ap_ctx_t *ctx, uint64_t n) {
+    std::mt19937_64 rng(n);
+    std::vector<ap_off_t> objs(n);
+    for (auto &obj : objs)
+        obj = ap_malloc_alloc(ctx, rng() % 256 + 1);
+    std::shuffle(objs.begin(), objs.end(), rng);
+    for (auto obj : objs)
+        ap_malloc_free(ctx, obj);
+}
+
+/* keeps n / 8 objects alive, with sizes spread logarithmically between 1 byte and 64K, and
+replaces random ones of them, this leaves a lot of free pieces of all sizes in the region, each
+alloc and free is timed */
+static void bench_frag(ap_ctx_t *ctx, uint64_t n) {
+    using clk = std::chrono::steady_clock;
+    std::mt19937_64 rng(n);
+    auto rand_sz = [&rng]{ return (rng() % 1024 + 1) << (rng() % 4 * 2); };
+    std::vector<ap_off_t> objs(std::max(n / 8, 1UL));
+    for (auto &obj : objs)
+        obj = ap_malloc_alloc(ctx, rand_sz());
+
+    lat_ns.reserve(2 * n);
+    for (uint64_t i = 0; i < n; i++) {
+        auto &obj = objs[rng() % objs.size()];
+        ap_sz_t sz = rand_sz();
+
+        auto start = clk::now();
+        ap_malloc_free(ctx, obj);
+        auto mid = clk::now();
+        obj = ap_malloc_alloc(ctx, sz);
+        auto end = clk::now();
+
+        lat_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(mid - start).count());
+        lat_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - mid).count());
+    }
+    for (auto obj : objs)
+        ap_malloc_free(ctx, obj);
+}
+
+/* builds n short strings in an array that is allocated from the same ctx */
+static ap_string_t *build_strings(ap_ctx_t *ctx, uint64_t n) {
+    auto strs = (ap_string_t *)ap_malloc_ptr(ctx, ap_malloc_alloc(ctx, n * sizeof(ap_string_t)));
+    char buff[32];
+    for (uint64_t i = 0; i < n; i++) {
+        strs[i].init(ctx);
+        snprintf(buff, sizeof(buff), "str-%ld", i * 7919);
+        strs[i].append(buff);
+    }
+    uint64_t len = 0;
+    for (uint64_t i = 0; i < n; i++)
+        len += strs[i].size();
+    if (len < n * 5)
+        DBG("wrong length: %ld", len);
+    return strs;
+}
+
+/* each string is given back by itself */
+static void bench_strings(ap_ctx_t *ctx, uint64_t n) {
+    auto strs = build_strings(ctx, n);
+    for (uint64_t i = 0; i < n; i++)
+        strs[i].uninit();
+    ap_malloc_free(ctx, ap_malloc_off(ctx, strs));
+}
+
+/* the same strings, but allocated from an arena that is dropped at once */
+static void bench_strings_arena(ap_ctx_t *ctx, uint64_t n) {
+    ap_arena_t arena;
+    if (ap_arena_init(&arena, ctx) < 0)
+        return ;
+    build_strings(&arena.ctx, n);
+    ap_arena_reset(&arena);
+    ap_arena_uninit(&arena);
+}
+
+/* the grow/shrink workload keeps it's region in a file, as ap_storage does */
+static int trim_fd;
+
+static int file_add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    ASSERT_FN(add_mem_fn(ctx, sz));
+    ASSERT_FN(ftruncate(trim_fd, region_sz));
+    return 0;
+}
+
+static int file_rm_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    region_sz -= sz;
+    ASSERT_FN(ftruncate(trim_fd, region_sz));
+    return 0;
+}
+
+static int file_release_mem_fn(ap_ctx_t *ctx, ap_off_t off, ap_sz_t sz) {
+    return fallocate(trim_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, sz);
+}
+
+static void print_usage(const char *when) {
+    uint64_t vm_pages = 0, rss_pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &vm_pages, &rss_pages) != 2)
+            rss_pages = 0;
+        fclose(f);
+    }
+    struct stat st = {};
+    fstat(trim_fd, &st);
+    DBG("%-16s rss: %10ld disk: %10ld file: %10ld", when, rss_pages * getpagesize(),
+            st.st_blocks * 512, st.st_size);
+}
+
+/* fills the region with n objects of up to 64K, frees 90% of them, in random order, such that
+most of the free space is in the middle of the region and then trims it. The objects are then
+allocated again, to see the cost of loading back the released pages. */
+static int bench_grow_shrink(uint64_t n) {
+    char path[] = "/tmp/ap_malloc_trim_XXXXXX";
+    ASSERT_FN(trim_fd = mkstemp(path));
+    unlink(path);
+    FnScope close_fd([]{ close(trim_fd); });
+
+    if (region)
+        munmap(region, REGION_SZ);
+    region = (uint8_t *)mmap(NULL, REGION_SZ, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_NORESERVE, trim_fd, 0);
+    ASSERT_FN(CHK_MMAP(region));
+    region_sz = INIT_MEM;
+    ASSERT_FN(ftruncate(trim_fd, region_sz));
+
+    ap_ctx_t ctx{};
+    ctx.region = region;
+    ctx.add_mem_fn = file_add_mem_fn;
+    ctx.rm_mem_fn = file_rm_mem_fn;
+    ctx.release_mem_fn = file_release_mem_fn;
+    ASSERT_FN(ap_malloc_init(&ctx, INIT_MEM));
+
+    std::mt19937_64 rng(n);
+    std::vector<ap_off_t> objs(n);
+    std::vector<ap_sz_t> sizes(n);
+    for (uint64_t i = 0; i < n; i++) {
+        sizes[i] = rng() % (64 * 1024) + 1;
+        ASSERT_FN(CHK_BOOL(objs[i] = ap_malloc_alloc(&ctx, sizes[i])));
+        memset(ap_malloc_ptr(&ctx, objs[i]), 1, sizes[i]);
+    }
+    print_usage("grow_shrink full");
+    for (uint64_t i = 0; i < n; i++)
+        if (rng() % 10) {
+            ap_malloc_free(&ctx, objs[i]);
+            objs[i] = 0;
+        }
+    print_usage("grow_shrink freed");
+
+    uint64_t start = get_time_us();
+    ASSERT_FN(ap_malloc_trim(&ctx));
+    uint64_t dt = get_time_us() - start;
+    auto st = ap_malloc_stats(&ctx);
+    print_usage("grow_shrink trim");
+    DBG("trim: %.3fms released: %ld trimmed: %ld region: %ld", dt / 1000., st.released_bytes,
+            st.trimmed_bytes, region_sz);
+
+    start = get_time_us();
+    for (uint64_t i = 0; i < n; i++)
+        if (!objs[i]) {
+            ASSERT_FN(CHK_BOOL(objs[i] = ap_malloc_alloc(&ctx, sizes[i])));
+            memset(ap_malloc_ptr(&ctx, objs[i]), 1, sizes[i]);
+        }
+    dt = get_time_us() - start;
+    st = ap_malloc_stats(&ctx);
+    print_usage("grow_shrink regrow");
+    DBG("regrow: %.3fms refault: %ld released: %ld", dt / 1000., st.refault_bytes,
+            st.released_bytes);
+    ASSERT_FN(ap_malloc_validate(&ctx));
+
+    munmap(region, REGION_SZ);
+    region = NULL;
+    return 0;
+}
+
+/* counts the data TLB misses of this thread in user space, returns -1 if perf is not available */
+static int open_dtlb_counter() {
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_proc_val(const char *path, const char *fmt) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    char line[256];
+    uint64_t val = 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, fmt, &val) == 1)
+            break;
+    fclose(f);
+    return val;
+}
+
+/* the hugetlb region can't be larger than the free huge pages, touching more would end in a
+SIGBUS */
+static ap_sz_t tlb_region_max;
+
+static int tlb_add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    if (region_sz + sz > tlb_region_max)
+        return -1;
+    region_sz += sz;
+    return 0;
+}
+
+/* builds a map of n random keys and looks up random ones of them, on a region with normal pages,
+with transparent huge pages and with hugetlb pages (only if the system has some reserved) */
+static int bench_tlb(uint64_t n) {
+    using map_t = ap_map_t<uint64_t, uint64_t>;
+    const std::tuple<const char *, int, int> modes[] = {
+        {"4k", MAP_NORESERVE, MADV_NOHUGEPAGE},
+        {"thp", MAP_NORESERVE, MADV_HUGEPAGE},
+        {"hugetlb", MAP_HUGETLB, 0},
+    };
+    for (auto [mode, mmap_flags, advice] : modes) {
+        if (region)
+            munmap(region, REGION_SZ);
+        region = NULL;
+        tlb_region_max = REGION_SZ;
+        if (mmap_flags & MAP_HUGETLB) {
+            tlb_region_max = std::min(tlb_region_max, AP_MALLOC_HUGE_PAGE_SZ *
+                    read_proc_val("/proc/meminfo", "HugePages_Free: %ld"));
+        }
+        ap_sz_t map_sz = tlb_region_max + AP_MALLOC_HUGE_PAGE_SZ;
+        void *raw = tlb_region_max ? mmap(NULL, map_sz, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | mmap_flags, -1, 0) : MAP_FAILED;
+        if (raw == MAP_FAILED) {
+            DBG("%-8s can't map the region, skipped", mode);
+            continue;
+        }
+        FnScope unmap([raw, map_sz]{ munmap(raw, map_sz); });
+        auto base = (uint8_t *)(((uintptr_t)raw + AP_MALLOC_HUGE_PAGE_SZ - 1) &
+                ~uintptr_t(AP_MALLOC_HUGE_PAGE_SZ - 1));
+        if (advice)
+            madvise(base, tlb_region_max, advice);
+        region_sz = AP_MALLOC_HUGE_PAGE_SZ;
+
+        ap_ctx_t ctx{};
+        ctx.region = base;
+        ctx.add_mem_fn = tlb_add_mem_fn;
+        ctx.flags = (mmap_flags & MAP_HUGETLB) || advice == MADV_HUGEPAGE ?
+                AP_MALLOC_FLAG_HUGE_PAGES : 0;
+        ASSERT_FN(ap_malloc_init(&ctx, AP_MALLOC_HUGE_PAGE_SZ));
+
+        auto map = (map_t *)ap_malloc_ptr(&ctx, ap_malloc_alloc(&ctx, sizeof(map_t)));
+        map->init(&ctx);
+        std::mt19937_64 rng(n);
+        std::vector<uint64_t> keys(n);
+        for (auto &k : keys) {
+            k = rng();
+            map->insert(k, k);
+        }
+
+        int fd = open_dtlb_counter();
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        uint64_t start = get_time_us();
+        uint64_t found = 0;
+        for (uint64_t i = 0; i < 4 * n; i++)
+            found += map->find(keys[rng() % n]) != map->end();
+        uint64_t dt = get_time_us() - start;
+        int64_t misses = -1;
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+                misses = -1;
+            close(fd);
+        }
+        if (found != 4 * n)
+            DBG("only %ld keys where found", found);
+        DBG("%-8s lookups: %9ld time: %9.3fms ns/op: %7.2f dtlb misses/op: %6.3f huge: %10ld "
+                "region: %10ld", mode, 4 * n, dt / 1000., dt * 1000. / (4 * n),
+                misses < 0 ? -1. : misses / (4. * n),
+                read_proc_val("/proc/self/smaps_rollup", "AnonHugePages: %ld kB") * 1024, region_sz);
+    }
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    DBG_SCOPE();
+    uint64_t n = argc > 1 ? std::stoull(argv[1]) : 100000;
+
+    ASSERT_FN(run_bench("ctx_lookup", bench_ctx_lookup, n));
+    ASSERT_FN(run_bench("vector", bench_vector, n));
+    ASSERT_FN(run_bench("map", bench_map, n));
+    ASSERT_FN(run_bench("hmap_nodes", bench_hmap_nodes, n));
+    ASSERT_FN(run_bench("small_mixed", bench_small_mixed, n));
+    ASSERT_FN(run_bench("frag", bench_frag, n));
+    ASSERT_FN(run_bench("strings", bench_strings, 10 * n));
+    ASSERT_FN(run_bench("strings_arena", bench_strings_arena, 10 * n));
+    ASSERT_FN(bench_grow_shrink(std::max(n / 20, 1UL)));
+    ASSERT_FN(bench_tlb(10 * n));
+
+    return 0;
+}
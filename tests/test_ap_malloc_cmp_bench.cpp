@@ -0,0 +1,349 @@
+#include "ap_malloc.h"
+#include "debug.h"
+#include "misc_utils.h"
+#include "time_utils.h"
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+/* Compares ap_malloc with the glibc malloc and, if libjemalloc.so.2 can be loaded, with jemalloc,
+on a few usual allocator workloads. Each (allocator, workload) pair runs in a child process, such
+that the peak RSS that the parent gets from wait4 is the one of that run alone. For each run the
+ops/s, the latency percentiles of the single operations, the peak RSS and, for ap_malloc, the size
+of the region are printed and also written as JSON to the file given as the second argument
+(data/ap_malloc_cmp.json by default), to be compared between versions.
+
+ap_malloc runs with AP_MALLOC_FLAG_THREAD_SAFE, as the other allocators are thread safe too. */
+
+#define REGION_SZ   (1ULL << 34)
+#define INIT_MEM    (4096)
+
+struct alloc_if_t {
+    const char *name;
+    int (*init)();
+    void *(*alloc)(size_t sz);
+    void (*free)(void *p);
+    void *(*realloc)(void *p, size_t sz);
+};
+
+/* ap_malloc on a private anonymous region */
+static ap_ctx_t ap_ctx;
+static ap_sz_t ap_region_sz;
+
+static int ap_add_mem(ap_ctx_t *ctx, ap_sz_t sz) {
+    if (ap_region_sz + sz > REGION_SZ)
+        return -1;
+    ap_region_sz += sz;
+    return 0;
+}
+
+static int ap_init() {
+    void *region = mmap(NULL, REGION_SZ, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT_FN(CHK_MMAP(region));
+    ap_region_sz = INIT_MEM;
+    ap_ctx = ap_ctx_t{};
+    ap_ctx.region = region;
+    ap_ctx.add_mem_fn = ap_add_mem;
+    ap_ctx.flags = AP_MALLOC_FLAG_THREAD_SAFE;
+    ASSERT_FN(ap_malloc_init(&ap_ctx, INIT_MEM));
+    return 0;
+}
+
+static void *ap_alloc(size_t sz) {
+    return ap_malloc_ptr(&ap_ctx, ap_malloc_alloc(&ap_ctx, sz));
+}
+
+static void ap_free(void *p) {
+    ap_malloc_free(&ap_ctx, ap_malloc_off(&ap_ctx, p));
+}
+
+static void *ap_realloc(void *p, size_t sz) {
+    return ap_malloc_ptr(&ap_ctx, ap_malloc_realloc(&ap_ctx, ap_malloc_off(&ap_ctx, p), sz));
+}
+
+/* glibc */
+static int libc_init() { return 0; }
+static void *libc_alloc(size_t sz) { return malloc(sz); }
+static void libc_free(void *p) { free(p); }
+static void *libc_realloc(void *p, size_t sz) { return realloc(p, sz); }
+
+/* jemalloc, loaded with RTLD_LOCAL such that it doesn't replace the malloc of the process */
+static void *(*je_malloc)(size_t sz);
+static void (*je_free)(void *p);
+static void *(*je_realloc)(void *p, size_t sz);
+
+static int je_load() {
+    void *lib = dlopen("libjemalloc.so.2", RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+        return -1;
+    je_malloc = (decltype(je_malloc))dlsym(lib, "malloc");
+    je_free = (decltype(je_free))dlsym(lib, "free");
+    je_realloc = (decltype(je_realloc))dlsym(lib, "realloc");
+    return je_malloc && je_free && je_realloc ? 0 : -1;
+}
+
+static int je_init() { return 0; }
+static void *je_alloc(size_t sz) { return je_malloc(sz); }
+static void je_free_fn(void *p) { je_free(p); }
+static void *je_realloc_fn(void *p, size_t sz) { return je_realloc(p, sz); }
+
+/* the latencies of the operations of a run, each thread has it's own list */
+using clk = std::chrono::steady_clock;
+static std::vector<std::vector<uint32_t>> lat_ns;
+
+static uint32_t elapsed_ns(clk::time_point start, clk::time_point end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+using workload_fn_t = int (*)(const alloc_if_t *a, uint64_t n);
+
+/* random sizes between 16 and 128 bytes, a window of live objects of which random ones are
+replaced */
+static int wl_uniform_small(const alloc_if_t *a, uint64_t n) {
+    std::mt19937_64 rng(n);
+    std::vector<void *> objs(4096);
+    auto &lat = lat_ns[0];
+    for (uint64_t i = 0; i < n; i++) {
+        auto &obj = objs[rng() % objs.size()];
+        ap_sz_t sz = rng() % 113 + 16;
+        auto t0 = clk::now();
+        if (obj)
+            a->free(obj);
+        auto t1 = clk::now();
+        obj = a->alloc(sz);
+        auto t2 = clk::now();
+        ASSERT_FN(CHK_BOOL(obj));
+        *(uint64_t *)obj = i;
+        lat.push_back(elapsed_ns(t0, t1));
+        lat.push_back(elapsed_ns(t1, t2));
+    }
+    for (auto obj : objs)
+        a->free(obj);
+    return 0;
+}
+
+/* most objects are small, but some of them are up to 64K: the size class is geometric and the
+size is uniform inside the class */
+static int wl_power_law(const alloc_if_t *a, uint64_t n) {
+    std::mt19937_64 rng(n);
+    std::vector<void *> objs(1024);
+    auto &lat = lat_ns[0];
+    for (uint64_t i = 0; i < n; i++) {
+        auto &obj = objs[rng() % objs.size()];
+        int cls = __builtin_ctzll(rng() | (1ULL << 12));
+        ap_sz_t sz = (rng() % 16 + 1) << cls;
+        auto t0 = clk::now();
+        if (obj)
+            a->free(obj);
+        auto t1 = clk::now();
+        obj = a->alloc(sz);
+        auto t2 = clk::now();
+        ASSERT_FN(CHK_BOOL(obj));
+        memset(obj, 0, std::min(sz, ap_sz_t(64)));
+        lat.push_back(elapsed_ns(t0, t1));
+        lat.push_back(elapsed_ns(t1, t2));
+    }
+    for (auto obj : objs)
+        a->free(obj);
+    return 0;
+}
+
+/* one thread allocates and the other one frees, through a single producer single consumer ring,
+so all the objects are freed by another thread than the one that allocated them */
+#define RING_SZ 1024
+
+static int wl_prod_cons(const alloc_if_t *a, uint64_t n) {
+    std::vector<void *> ring(RING_SZ);
+    std::atomic<uint64_t> head = 0, tail = 0;
+    std::atomic<bool> failed = false;
+
+    std::thread consumer([&]{
+        auto &lat = lat_ns[1];
+        for (uint64_t i = 0; i < n; i++) {
+            while (tail.load(std::memory_order_acquire) == i)
+                std::this_thread::yield();
+            void *obj = ring[i % RING_SZ];
+            if (*(uint64_t *)obj != i)
+                failed = true;
+            auto t0 = clk::now();
+            a->free(obj);
+            lat.push_back(elapsed_ns(t0, clk::now()));
+            head.store(i + 1, std::memory_order_release);
+        }
+    });
+
+    std::mt19937_64 rng(n);
+    auto &lat = lat_ns[0];
+    for (uint64_t i = 0; i < n; i++) {
+        while (i - head.load(std::memory_order_acquire) >= RING_SZ)
+            std::this_thread::yield();
+        auto t0 = clk::now();
+        void *obj = a->alloc(rng() % 241 + 16);
+        lat.push_back(elapsed_ns(t0, clk::now()));
+        if (!obj) {
+            DBG("Failed to allocate");
+            exit(-1);
+        }
+        *(uint64_t *)obj = i;
+        ring[i % RING_SZ] = obj;
+        tail.store(i + 1, std::memory_order_release);
+    }
+    consumer.join();
+    if (failed) {
+        DBG("An object was overwritten");
+        return -1;
+    }
+    return 0;
+}
+
+/* vectors that grow by a few elements at a time with realloc, once a vector reaches 64K it is
+dropped and it starts again */
+static int wl_realloc_vec(const alloc_if_t *a, uint64_t n) {
+    std::mt19937_64 rng(n);
+    struct vec_t { void *p; ap_sz_t sz; };
+    std::vector<vec_t> vecs(256);
+    auto &lat = lat_ns[0];
+    for (uint64_t i = 0; i < n; i++) {
+        auto &vec = vecs[rng() % vecs.size()];
+        ap_sz_t sz = vec.sz + (rng() % 8 + 1) * 8;
+        auto t0 = clk::now();
+        if (sz > 64 * 1024) {
+            a->free(vec.p);
+            vec = vec_t{};
+            sz = 8;
+        }
+        void *p = a->realloc(vec.p, sz);
+        lat.push_back(elapsed_ns(t0, clk::now()));
+        ASSERT_FN(CHK_BOOL(p));
+        if (vec.p && *(uint64_t *)p != vec.sz) {
+            DBG("The content was not kept by realloc");
+            return -1;
+        }
+        *(uint64_t *)p = sz;
+        vec = vec_t{ p, sz };
+    }
+    for (auto &vec : vecs)
+        a->free(vec.p);
+    return 0;
+}
+
+struct result_t {
+    uint64_t ops;
+    uint64_t time_ns;
+    uint32_t p50_ns;
+    uint32_t p99_ns;
+    uint32_t p999_ns;
+    uint64_t region_sz;
+    uint64_t peak_rss;
+};
+
+static int run_child(const alloc_if_t *a, workload_fn_t fn, uint64_t n, result_t *res) {
+    ASSERT_FN(a->init());
+    lat_ns.assign(2, {});
+    for (auto &lat : lat_ns)
+        lat.reserve(2 * n);
+
+    auto start = clk::now();
+    ASSERT_FN(fn(a, n));
+    res->time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clk::now() - start).count();
+
+    std::vector<uint32_t> all;
+    for (auto &lat : lat_ns)
+        all.insert(all.end(), lat.begin(), lat.end());
+    std::sort(all.begin(), all.end());
+    auto pct = [&all](double p) { return all.size() ? all[(all.size() - 1) * p] : 0; };
+    res->ops = all.size();
+    res->p50_ns = pct(.5);
+    res->p99_ns = pct(.99);
+    res->p999_ns = pct(.999);
+    res->region_sz = a->init == ap_init ? ap_region_sz : 0;
+    return 0;
+}
+
+static int run(const alloc_if_t *a, const char *wl_name, workload_fn_t fn, uint64_t n,
+        result_t *res)
+{
+    int fds[2];
+    ASSERT_FN(pipe(fds));
+    int pid = fork();
+    ASSERT_FN(pid);
+    if (pid == 0) {
+        close(fds[0]);
+        *res = result_t{};
+        int ret = run_child(a, fn, n, res);
+        if (ret == 0 && write(fds[1], res, sizeof(*res)) != sizeof(*res))
+            ret = -1;
+        _exit(ret < 0 ? 1 : 0);
+    }
+    close(fds[1]);
+    ssize_t rd = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+
+    int status;
+    struct rusage ru;
+    ASSERT_FN(wait4(pid, &status, 0, &ru));
+    if (rd != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        DBG("%s on %s failed", wl_name, a->name);
+        return -1;
+    }
+    res->peak_rss = ru.ru_maxrss * 1024;
+    DBG("%-8s %-14s ops/s: %12.0f p50: %6dns p99: %6dns p99.9: %7dns rss: %10ld region: %10ld",
+            a->name, wl_name, res->ops * 1e9 / res->time_ns, res->p50_ns, res->p99_ns,
+            res->p999_ns, res->peak_rss, res->region_sz);
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    DBG_SCOPE();
+    uint64_t n = argc > 1 ? std::stoull(argv[1]) : 200000;
+    std::string json_path = argc > 2 ? argv[2] : "data/ap_malloc_cmp.json";
+
+    std::vector<alloc_if_t> allocs = {
+        {"ap", ap_init, ap_alloc, ap_free, ap_realloc},
+        {"glibc", libc_init, libc_alloc, libc_free, libc_realloc},
+    };
+    if (je_load() == 0)
+        allocs.push_back({"jemalloc", je_init, je_alloc, je_free_fn, je_realloc_fn});
+    else
+        DBG("libjemalloc.so.2 was not found, jemalloc is skipped");
+
+    const std::pair<const char *, workload_fn_t> workloads[] = {
+        {"uniform_small", wl_uniform_small},
+        {"power_law", wl_power_law},
+        {"prod_cons", wl_prod_cons},
+        {"realloc_vec", wl_realloc_vec},
+    };
+
+    FILE *json = fopen(json_path.c_str(), "w");
+    ASSERT_FN(CHK_BOOL(json));
+    FnScope close_json([json]{ fclose(json); });
+    fprintf(json, "{\n  \"time_us\": %ld,\n  \"n\": %ld,\n  \"runs\": [", get_time_us(), n);
+
+    bool first = true;
+    for (auto [wl_name, fn] : workloads) {
+        for (auto &a : allocs) {
+            result_t res;
+            ASSERT_FN(run(&a, wl_name, fn, n, &res));
+            fprintf(json, "%s\n    {\"allocator\": \"%s\", \"workload\": \"%s\", \"ops\": %ld, "
+                    "\"ops_per_s\": %.0f, \"p50_ns\": %d, \"p99_ns\": %d, \"p999_ns\": %d, "
+                    "\"peak_rss\": %ld, \"region_sz\": %ld}", first ? "" : ",", a.name, wl_name,
+                    res.ops, res.ops * 1e9 / res.time_ns, res.p50_ns, res.p99_ns, res.p999_ns,
+                    res.peak_rss, res.region_sz);
+            first = false;
+        }
+    }
+    fprintf(json, "\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "ap_malloc.h"
+#include "debug.h"
+#include "time_utils.h"
+
+#include <sys/mman.h>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <vector>
+
+/* Multi-threaded stress test and benchmark: each thread keeps a window of live objects on the same
+region and replaces random ones of them, the objects are filled with a pattern that is checked
+before free. The objects left at the end are freed by the main thread, so slots are also given
+back by threads that did not allocate them. This is done once with a global mutex around each
+call, as it must be done without AP_MALLOC_FLAG_THREAD_SAFE, and once with the flag set.
+
+The scaling with the number of threads is only seen with as many cores as threads, the runs with
+more threads than cores are marked in the output. */
+
+#define REGION_SZ   (1ULL << 32)
+#define INIT_MEM    (4096)
+#define WINDOW      1024
+
+static uint8_t *region;
+static ap_sz_t region_sz;
+static std::mutex global_mu;
+static bool failed;
+
+struct obj_t {
+    ap_off_t off;
+    ap_sz_t sz;
+    uint8_t pattern;
+};
+
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    if (region_sz + sz > REGION_SZ)
+        return -1;
+    region_sz += sz;
+    return 0;
+}
+
+static int new_region(ap_ctx_t *ctx, uint32_t flags) {
+    if (region)
+        munmap(region, REGION_SZ);
+    region = (uint8_t *)mmap(NULL, REGION_SZ, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT_FN(CHK_MMAP(region));
+    region_sz = INIT_MEM;
+
+    *ctx = ap_ctx_t{};
+    ctx->region = region;
+    ctx->add_mem_fn = add_mem_fn;
+    ctx->flags = flags;
+    ASSERT_FN(ap_malloc_init(ctx, INIT_MEM));
+    return 0;
+}
+
+static ap_off_t alloc(ap_ctx_t *ctx, ap_sz_t sz) {
+    if (ctx->flags & AP_MALLOC_FLAG_THREAD_SAFE)
+        return ap_malloc_alloc(ctx, sz);
+    std::lock_guard guard(global_mu);
+    return ap_malloc_alloc(ctx, sz);
+}
+
+static void free(ap_ctx_t *ctx, ap_off_t off) {
+    if (ctx->flags & AP_MALLOC_FLAG_THREAD_SAFE) {
+        ap_malloc_free(ctx, off);
+        return ;
+    }
+    std::lock_guard guard(global_mu);
+    ap_malloc_free(ctx, off);
+}
+
+static void check_free(ap_ctx_t *ctx, obj_t &obj) {
+    if (!obj.off)
+        return ;
+    auto p = (uint8_t *)ap_malloc_ptr(ctx, obj.off);
+    for (ap_sz_t i = 0; i < obj.sz; i++)
+        if (p[i] != obj.pattern) {
+            DBG("Object %lx was overwritten at %ld", obj.off, i);
+            failed = true;
+            break;
+        }
+    free(ctx, obj.off);
+    obj.off = 0;
+}
+
+static void worker(ap_ctx_t *ctx, int id, uint64_t n, std::vector<obj_t> *objs) {
+    std::mt19937_64 rng(id);
+    for (uint64_t i = 0; i < n; i++) {
+        auto &obj = (*objs)[rng() % objs->size()];
+        check_free(ctx, obj);
+
+        /* mostly small objects, as the containers do */
+        obj.sz = rng() % 16 ? rng() % 248 + 1 : rng() % 4096 + 1;
+        obj.pattern = rng();
+        obj.off = alloc(ctx, obj.sz);
+        if (!obj.off) {
+            DBG("Failed to allocate %ld bytes", obj.sz);
+            failed = true;
+            return ;
+        }
+        memset(ap_malloc_ptr(ctx, obj.off), obj.pattern, obj.sz);
+    }
+}
+
+static int run(const char *name, uint32_t flags, int thread_cnt, uint64_t n) {
+    ap_ctx_t ctx;
+    ASSERT_FN(new_region(&ctx, flags));
+
+    std::vector<std::vector<obj_t>> objs(thread_cnt, std::vector<obj_t>(WINDOW));
+    std::vector<std::thread> threads;
+
+    uint64_t start = get_time_us();
+    for (int i = 0; i < thread_cnt; i++)
+        threads.emplace_back(worker, &ctx, i, n, &objs[i]);
+    for (auto &t : threads)
+        t.join();
+    uint64_t dt = get_time_us() - start;
+
+    for (auto &thread_objs : objs)
+        for (auto &obj : thread_objs)
+            check_free(&ctx, obj);
+    ap_malloc_flush_tcache(&ctx);
+    ASSERT_FN(ap_malloc_validate(&ctx));
+
+    DBG("%-8s threads: %2d ops: %9ld time: %9.3fms Mops/s: %7.3f region: %10ld%s", name,
+            thread_cnt, n * thread_cnt, dt / 1000., n * thread_cnt / (double)dt, region_sz,
+            thread_cnt > (int)std::thread::hardware_concurrency() ? " (more threads than cores)" :
+            "");
+    if (failed) {
+        DBG("Stress test failed");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    DBG_SCOPE();
+    uint64_t n = argc > 1 ? std::stoull(argv[1]) : 100000;
+    int max_threads = std::max(4U, std::thread::hardware_concurrency());
+
+    for (int thread_cnt = 1; thread_cnt <= max_threads; thread_cnt *= 2) {
+        ASSERT_FN(run("mutex", 0, thread_cnt, n));
+        ASSERT_FN(run("tcache", AP_MALLOC_FLAG_THREAD_SAFE, thread_cnt, n));
+    }
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include "ap_malloc.h"
+#include "debug.h"
+#include "time_utils.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <atomic>
+#include <random>
+#include <vector>
+
+/* Many processes allocate from the same memfd backed region with AP_MALLOC_FLAG_SHARED. The
+objects are passed between processes through a mailbox that lives inside the region: each worker
+puts it's new object in a random mailbox slot and checks and frees the object that was there, so
+most of the objects are freed by another process than the one that allocated them. In the second
+part the workers are killed at random moments, possibly while they hold the region's lock, and the
+survivors must recover the region and continue. They are killed again while doing aligned
+allocations with large alignments, which split the chunks they fit in on both sides and often grow
+the region, such that the dead owner leaves behind as many changed borders as one operation can. */
+
+#define REGION_SZ       (1ULL << 30)
+#define INIT_MEM        (4096)
+#define MAILBOX_SZ      4096
+
+struct shared_t {
+    std::atomic<uint64_t> region_sz;
+    std::atomic<uint64_t> bad_objs;
+};
+
+static int memfd;
+static uint8_t *region;
+static shared_t *shared;
+static ap_ctx_t ctx;
+
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
+    /* the memfd has it's full size from the start, we only keep track of the used part */
+    if (shared->region_sz + sz > REGION_SZ)
+        return -1;
+    shared->region_sz += sz;
+    return 0;
+}
+
+static std::atomic<ap_off_t> *mailbox() {
+    return (std::atomic<ap_off_t> *)ap_malloc_ptr(&ctx, ap_malloc_get_usr(&ctx));
+}
+
+/* the first 8 bytes of an object hold it's size, the rest is filled with a byte from the size */
+static ap_off_t new_obj(ap_sz_t sz, ap_sz_t align = 0) {
+    ap_off_t off = align ? ap_malloc_alloc_aligned(&ctx, sz, align) : ap_malloc_alloc(&ctx, sz);
+    if (!off)
+        return 0;
+    auto p = (uint8_t *)ap_malloc_ptr(&ctx, off);
+    *(ap_sz_t *)p = sz;
+    memset(p + sizeof(ap_sz_t), sz * 7, sz - sizeof(ap_sz_t));
+    return off;
+}
+
+static void check_free_obj(ap_off_t off) {
+    auto p = (uint8_t *)ap_malloc_ptr(&ctx, off);
+    ap_sz_t sz = *(ap_sz_t *)p;
+    for (ap_sz_t i = sizeof(ap_sz_t); i < sz; i++)
+        if (p[i] != uint8_t(sz * 7)) {
+            DBG("Object %lx of size %ld was overwritten at %ld", off, sz, i);
+            shared->bad_objs++;
+            break;
+        }
+    ap_malloc_free(&ctx, off);
+}
+
+static int attach() {
+    /* each process maps the memfd by itself, so the region has a different address in each */
+    region = (uint8_t *)mmap(NULL, REGION_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    ASSERT_FN(CHK_MMAP(region));
+    ctx = ap_ctx_t{};
+    ctx.region = region;
+    ctx.add_mem_fn = add_mem_fn;
+    ctx.flags = AP_MALLOC_FLAG_SHARED;
+    ASSERT_FN(ap_malloc_init(&ctx, INIT_MEM));
+    return 0;
+}
+
+static void worker(int id, uint64_t n, bool aligned) {
+    if (attach() < 0)
+        exit(-1);
+    std::mt19937_64 rng(id * 1000 + getpid());
+    for (uint64_t i = 0; i < n; i++) {
+        ap_sz_t sz = rng() % 8 ? rng() % 240 + 8 : rng() % 8192 + 8;
+        ap_sz_t align = aligned ? 16ULL << rng() % 13 : 0;
+        ap_off_t off = new_obj(sz, align);
+        if (!off) {
+            DBG("Failed to allocate %ld bytes", sz);
+            exit(-1);
+        }
+        ap_off_t old = mailbox()[rng() % MAILBOX_SZ].exchange(off);
+        if (old)
+            check_free_obj(old);
+    }
+    exit(0);
+}
+
+static int spawn(int id, uint64_t n, bool aligned = false) {
+    int pid = fork();
+    ASSERT_FN(pid);
+    if (pid == 0)
+        worker(id, n, aligned);
+    return pid;
+}
+
+static int drain_mailbox() {
+    for (int i = 0; i < MAILBOX_SZ; i++) {
+        ap_off_t old = mailbox()[i].exchange(0);
+        if (old)
+            check_free_obj(old);
+    }
+    if (shared->bad_objs) {
+        DBG("Found %ld overwritten objects", shared->bad_objs.load());
+        return -1;
+    }
+    return 0;
+}
+
+static int test_concurrent(int worker_cnt, uint64_t n) {
+    std::vector<int> pids;
+    uint64_t start = get_time_us();
+    for (int i = 0; i < worker_cnt; i++)
+        pids.push_back(spawn(i, n));
+    for (auto pid : pids) {
+        int status;
+        ASSERT_FN(waitpid(pid, &status, 0));
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            DBG("Worker %d failed", pid);
+            return -1;
+        }
+    }
+    uint64_t dt = get_time_us() - start;
+    DBG("workers: %d ops: %ld time: %.3fms region: %ld", worker_cnt, n * worker_cnt, dt / 1000.,
+            shared->region_sz.load());
+    ASSERT_FN(drain_mailbox());
+    return 0;
+}
+
+static int test_kill(int worker_cnt, int rounds, bool aligned) {
+    std::mt19937_64 rng(rounds);
+    for (int r = 0; r < rounds; r++) {
+        std::vector<int> pids;
+        for (int i = 0; i < worker_cnt; i++)
+            pids.push_back(spawn(i, UINT64_MAX, aligned));
+        usleep(1000 + rng() % 20000);
+        for (auto pid : pids) {
+            kill(pid, SIGKILL);
+            ASSERT_FN(waitpid(pid, NULL, 0));
+        }
+
+        /* the region must still work, from this process too */
+        ASSERT_FN(ap_malloc_validate(&ctx));
+        ap_off_t off = new_obj(100);
+        ASSERT_FN(CHK_BOOL(off));
+        check_free_obj(off);
+    }
+    DBG("killed %d workers, aligned: %d region: %ld", worker_cnt * rounds, aligned,
+            shared->region_sz.load());
+    ASSERT_FN(drain_mailbox());
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    DBG_SCOPE();
+    uint64_t n = argc > 1 ? std::stoull(argv[1]) : 20000;
+
+    shared = (shared_t *)mmap(NULL, sizeof(shared_t), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT_FN(CHK_MMAP(shared));
+    shared->region_sz = INIT_MEM;
+
+    ASSERT_FN(memfd = memfd_create("ap_malloc_shm", 0));
+    ASSERT_FN(ftruncate(memfd, REGION_SZ));
+    ASSERT_FN(attach());
+
+    /* the mailbox is a plain array of offsets, the region is zero when created */
+    ap_off_t mailbox_off = ap_malloc_alloc(&ctx, MAILBOX_SZ * sizeof(ap_off_t));
+    ASSERT_FN(CHK_BOOL(mailbox_off));
+    memset(ap_malloc_ptr(&ctx, mailbox_off), 0, MAILBOX_SZ * sizeof(ap_off_t));
+    ap_malloc_set_usr(&ctx, mailbox_off);
+
+    ASSERT_FN(test_concurrent(1, n));
+    ASSERT_FN(test_concurrent(4, n));
+    ASSERT_FN(test_kill(4, 50, false));
+    ASSERT_FN(test_kill(4, 50, true));
+    ASSERT_FN(test_concurrent(4, n));
+
+    return 0;
+}
@@ -8,7 +8,7 @@
 #define TOTAL_MEM   (1024*1024)
 #define INIT_MEM    (4096)
 
-static int add_mem_fn(ap_sz_t sz);
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz);
 
 static uint8_t mem[TOTAL_MEM];
 static ap_ctx_t mc = {
@@ -17,7 +17,7 @@ static ap_ctx_t mc = {
 };
 
 static ap_sz_t tot_mem = INIT_MEM;
-static int add_mem_fn(ap_sz_t sz) {
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
     tot_mem += sz;
     if (tot_mem > TOTAL_MEM)
         return -1;
@@ -43,6 +43,50 @@ static void ap_free(void *p) {
     ap_malloc_free(ctx, off);
 }
 
+/* the map and it's nodes are mixed with fillers that are freed, after the compaction the map must
+still hold all it's elements */
+using cmap_t = ap_map_t<int, int>;
+static ap_off_t cmap_off;
+
+static void cmap_reloc_fn(ap_ctx_t *ctx, const ap_malloc_reloc_table_t *table, void *usr) {
+    cmap_off = ap_malloc_reloc_off(table, cmap_off);
+    ((cmap_t *)ap_malloc_ptr(ctx, cmap_off))->reloc(table);
+}
+
+static int test_compact() {
+    ap_ctx_t *ctx = &mc;
+    cmap_off = ap_malloc_alloc(ctx, sizeof(cmap_t));
+    ((cmap_t *)ap_malloc_ptr(ctx, cmap_off))->init(ctx);
+    std::vector<ap_off_t> fillers;
+    for (int i = 0; i < 2000; i++) {
+        ((cmap_t *)ap_malloc_ptr(ctx, cmap_off))->insert(i, i * 3);
+        fillers.push_back(ap_malloc_alloc(ctx, 100 + i % 300));
+    }
+    for (auto off : fillers)
+        ap_malloc_free(ctx, off);
+
+    while (ap_malloc_compact(ctx, cmap_reloc_fn, NULL, 0) == 0)
+        ;
+    ASSERT_FN(ap_malloc_validate(ctx));
+
+    auto &cmap = *(cmap_t *)ap_malloc_ptr(ctx, cmap_off);
+    int i = 0;
+    for (auto &[key, val] : cmap) {
+        if (key != i || val != i * 3 || cmap.find(i) == cmap.end()) {
+            DBG("map was not relocated correctly at %d", i);
+            return -1;
+        }
+        i++;
+    }
+    if (i != 2000) {
+        DBG("map lost elements: %d", i);
+        return -1;
+    }
+    cmap.uninit();
+    ap_malloc_free(ctx, cmap_off);
+    return 0;
+}
+
 int main(int argc, char const *argv[])
 {
     DBG_SCOPE();
@@ -130,5 +174,7 @@ int main(int argc, char const *argv[])
 
     ap_free(&map64);
 
+    ASSERT_FN(test_compact());
+
     return 0;
 }
\ No newline at end of file
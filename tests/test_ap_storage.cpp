@@ -10,10 +10,14 @@
 #include "time_utils.h"
 
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <map>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <thread>
 
 #define SOCK_PATH "./ap_storage_test_comm"
 
@@ -40,6 +44,29 @@ struct test_ap_malloc_t {
     uint64_t sz[8192] = {0};
 };
 
+/* each commit of reader_test writes the number of it's round in all the slots */
+#define READER_ROUNDS   60
+#define READER_SLOTS    1024
+
+struct test_reader_t {
+    uint64_t round;
+    ap_vector_t<uint64_t> rounds;
+    test_ap_malloc_t slots;
+};
+
+/* savepoint_test writes a block of this size after it's first savepoints */
+#define SP_BIG_SZ       (8 * 1024 * 1024)
+
+/* bulk_test loads the vector inside a bulk write and fills the block after marking it, by hand
+or as the range of the bulk write */
+#define BULK_ELEMS      (1024 * 1024)
+#define BULK_BLOCK_SZ   (1024 * 1024)
+
+struct test_bulk_t {
+    ap_vector_t<uint64_t> vec;
+    ap_off_t block;
+};
+
 struct test_ap_vector_t {};
 struct test_ap_map_t {};
 struct test_ap_hashmap_t {};
@@ -51,7 +78,7 @@ void ap_storage_except_cbk(void *ctx, const char *errmsg, ap_except_info_t *ei)
     exit(1);
 }
 
-static int run_program(const char *prog_name, const char *param) {
+static int start_program(const char *prog_name, const char *param) {
     int pid;
     ASSERT_FN(pid = fork());
     if (pid == 0) {
@@ -59,40 +86,95 @@ static int run_program(const char *prog_name, const char *param) {
         std::vector<const char *> argv = {prog_name, param, NULL};
         ASSERT_FN(execv(prog_name, (char* const*)argv.data()));
     }
-    else {
-        int status = 0;
-        ASSERT_FN(waitpid(pid, &status, 0));
-        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-            DBG("Guest program failed");
-            return -1;
-        }
+    return pid;
+}
+
+static int wait_program(int pid) {
+    int status = 0;
+    ASSERT_FN(waitpid(pid, &status, 0));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        DBG("Guest program failed");
+        return -1;
     }
     return 0;
 }
 
+static int run_program(const char *prog_name, const char *param) {
+    int pid;
+    ASSERT_FN(pid = start_program(prog_name, param));
+    ASSERT_FN(wait_program(pid));
+    return 0;
+}
+
 static void clear_tests() {
     unlink("data/storage");
     unlink("data/storage_0.data");
     unlink("data/storage_1.data");
+    unlink("data/storage_0.wal");
+    unlink("data/storage_1.wal");
+    unlink("data/storage.hot");
+    unlink("data/storage_0.crc");
+    unlink("data/storage_1.crc");
+    for (auto name : {"data/multi_0", "data/multi_1", "data/multi_2", "data/replica"})
+        for (auto ext : {"", "_0.data", "_1.data", "_0.wal", "_1.wal"})
+            unlink((std::string(name) + ext).c_str());
+}
+
+static int corrupt_page(const char *path, uint64_t page) {
+    /* flips a byte of the page, as a bit rot would */
+    int fd;
+    uint8_t byte;
+    ASSERT_FN(fd = open(path, O_RDWR));
+    FnScope scope([fd]{ close(fd); });
+    ASSERT_FN(pread(fd, &byte, 1, page * 4096 + 100));
+    byte ^= 0xff;
+    ASSERT_FN(pwrite(fd, &byte, 1, page * 4096 + 100));
+    return 0;
+}
+
+static int flip_region_version(const char *path) {
+    /* the high half of the region's magic is the version of it's layout, a flip makes it another
+    version and a second flip gives it back. The WAL mode has only the first data file */
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return 0;
+    uint8_t byte;
+    FnScope scope([fd]{ close(fd); });
+    ASSERT_FN(pread(fd, &byte, 1, 12));
+    byte ^= 1;
+    ASSERT_FN(pwrite(fd, &byte, 1, 12));
+    return 0;
 }
 
-static void alloc_slot(test_ap_malloc_t *tam, uint32_t slot, uint32_t sz) {
+static void alloc_slot(test_ap_malloc_t *tam, uint32_t slot, uint32_t sz,
+        ap_ctx_t *ctx = ap_static_ctx)
+{
     uint8_t val = rand() % 256;
-    tam->ptrs[slot] = ap_malloc_alloc(ap_static_ctx, sz);
+    tam->ptrs[slot] = ap_malloc_alloc(ctx, sz);
     tam->sz[slot] = sz;
-    uint8_t *ptr = (uint8_t *)ap_malloc_ptr(ap_static_ctx, tam->ptrs[slot]);
+    uint8_t *ptr = (uint8_t *)ap_malloc_ptr(ctx, tam->ptrs[slot]);
     memset(ptr, val, sz);
 }
 
-static void free_slot(test_ap_malloc_t *tam, uint32_t slot) {
-    uint8_t *ptr = (uint8_t *)ap_malloc_ptr(ap_static_ctx, tam->ptrs[slot]);
+static void free_slot(test_ap_malloc_t *tam, uint32_t slot, ap_ctx_t *ctx = ap_static_ctx) {
+    uint8_t *ptr = (uint8_t *)ap_malloc_ptr(ctx, tam->ptrs[slot]);
     memset(ptr, 0, tam->sz[slot]);
-    ap_malloc_free(ap_static_ctx, tam->ptrs[slot]);
+    ap_malloc_free(ctx, tam->ptrs[slot]);
     tam->ptrs[slot] = 0;
     tam->sz[slot] = 0;
 }
 
-static uint64_t hash_slots(test_ap_malloc_t *tam) {
+static void change_slots(test_ap_malloc_t *tam, int cnt) {
+    for (int i = 0; i < cnt; i++) {
+        uint32_t slot = rand() % 8192;
+        if (!tam->ptrs[slot])
+            alloc_slot(tam, slot, rand() % 40000 + 1);
+        else
+            free_slot(tam, slot);
+    }
+}
+
+static uint64_t hash_slots(test_ap_malloc_t *tam, ap_ctx_t *ctx = ap_static_ctx) {
     uint64_t ret = 0;
     for (int i = 0; i < 8192; i++) {
         uint64_t val = tam->ptrs[i];
@@ -102,7 +184,7 @@ static uint64_t hash_slots(test_ap_malloc_t *tam) {
         h = std::hash<uint64_t>{}(val);
         ret = ret ^ (h << 1);
         if (tam->ptrs[i] && tam->sz[i]) {
-            uint8_t *ptr = (uint8_t *)ap_malloc_ptr(ap_static_ctx, tam->ptrs[i]);
+            uint8_t *ptr = (uint8_t *)ap_malloc_ptr(ctx, tam->ptrs[i]);
             val = ptr[0];
             h = std::hash<uint64_t>{}(val);
             std::vector<uint8_t> cpy(tam->sz[i]);
@@ -113,6 +195,95 @@ static uint64_t hash_slots(test_ap_malloc_t *tam) {
     return ret;
 }
 
+static int check_slots(test_ap_malloc_t *tam, ap_ctx_t *ctx = ap_static_ctx) {
+    for (int i = 0; i < 8192; i++) {
+        if (!tam->ptrs[i])
+            continue;
+        auto data = (uint8_t *)ap_malloc_ptr(ctx, tam->ptrs[i]);
+        for (uint64_t j = 0; j < tam->sz[i]; j++)
+            if (data[j] != data[0]) {
+                DBG("Slot %d was not saved", i);
+                return -1;
+            }
+    }
+    return 0;
+}
+
+/* the storages of the multi tests, each in another mode, they are used at the same time from
+different threads */
+static const char *multi_names[] = {"data/multi_0", "data/multi_1", "data/multi_2"};
+static uint32_t multi_flags[] = {
+    0,
+    AP_STORAGE_FLAG_WAL,
+    AP_STORAGE_FLAG_WAL | AP_STORAGE_FLAG_TRACK_UFFD,
+};
+
+static test_ap_malloc_t *multi_slots(ap_storage_t *st) {
+    ap_ctx_t *ctx = ap_storage_get_mctx(st);
+    if (!ap_malloc_get_usr(ctx)) {
+        ap_off_t off = ap_malloc_alloc(ctx, sizeof(test_ap_malloc_t));
+        new (ap_malloc_ptr(ctx, off)) test_ap_malloc_t;
+        ap_malloc_set_usr(ctx, off);
+    }
+    return (test_ap_malloc_t *)ap_malloc_ptr(ctx, ap_malloc_get_usr(ctx));
+}
+
+static int multi_work(ap_storage_t *st, uint64_t *last_hash) {
+    /* the same transactions as wal_test, on one storage */
+    ap_ctx_t *ctx = ap_storage_get_mctx(st);
+    test_ap_malloc_t *ptr = multi_slots(st);
+    ASSERT_FN(ap_storage_do_changes(st, AP_STORAGE_COMMIT_CHANGES));
+    *last_hash = hash_slots(ptr, ctx);
+    for (int i = 0; i < 10300; i++) {
+        uint32_t slot = rand() % 8192;
+        if (i % 1000 == 999) {
+            uint64_t hash = hash_slots(ptr, ctx);
+            ASSERT_FN(ap_storage_do_changes(st, AP_STORAGE_COMMIT_CHANGES));
+            *last_hash = hash;
+        }
+        else if (i % 1000 == 499) {
+            ASSERT_FN(ap_storage_do_changes(st, AP_STORAGE_REVERT_CHANGES));
+            if (hash_slots(ptr, ctx) != *last_hash) {
+                DBG("The hashes differ after revert");
+                return -1;
+            }
+        }
+        else if (i % 5000 == 4000) {
+            ap_malloc_trim(ctx);
+        }
+        else if (!ptr->ptrs[slot]) {
+            alloc_slot(ptr, slot, rand() % 40000 + 1, ctx);
+        }
+        else {
+            free_slot(ptr, slot, ctx);
+        }
+    }
+    return 0;
+}
+
+static int check_reader(test_reader_t *ptr, ap_ctx_t *ctx) {
+    /* a snapshot must hold exactly one commit */
+    if (ptr->rounds.size() != ptr->round) {
+        DBG("Round %ld has %ld rounds in the vector", ptr->round, ptr->rounds.size());
+        return -1;
+    }
+    for (uint64_t i = 0; i < ptr->round; i++)
+        if (ptr->rounds[i] != i + 1) {
+            DBG("Round %ld has %ld at %ld in the vector", ptr->round, ptr->rounds[i], i);
+            return -1;
+        }
+    ASSERT_FN(check_slots(&ptr->slots, ctx));
+    for (int i = 0; i < READER_SLOTS; i++) {
+        if (!ptr->slots.ptrs[i])
+            continue;
+        if (*(uint8_t *)ap_malloc_ptr(ctx, ptr->slots.ptrs[i]) != uint8_t(ptr->round)) {
+            DBG("Slot %d is not from round %ld", i, ptr->round);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int do_host_stuff(const char *prog_name) {
     clear_tests();
 
@@ -129,6 +300,110 @@ static int do_host_stuff(const char *prog_name) {
         clear_tests();
     }
 
+    DBG("######################### grow_test:");
+    ASSERT_FN(run_program(prog_name, "grow_test"));
+    ASSERT_FN(run_program(prog_name, "grow_read_test"));
+    clear_tests();
+
+    DBG("######################### track_test:");
+    ASSERT_FN(run_program(prog_name, "track_test_uffd"));
+    ASSERT_FN(run_program(prog_name, "slots_read_test"));
+    clear_tests();
+    ASSERT_FN(run_program(prog_name, "track_test_soft_dirty"));
+    ASSERT_FN(run_program(prog_name, "slots_read_test"));
+    clear_tests();
+
+    DBG("######################### lazy_test:");
+    ASSERT_FN(run_program(prog_name, "lazy_test"));
+    ASSERT_FN(run_program(prog_name, "lazy_read_test"));
+    ASSERT_FN(run_program(prog_name, "lazy_read_test"));
+    ASSERT_FN(run_program(prog_name, "slots_read_test"));
+    clear_tests();
+    ASSERT_FN(run_program(prog_name, "lazy_uffd_test"));
+    ASSERT_FN(run_program(prog_name, "slots_read_test"));
+    clear_tests();
+
+    DBG("######################### crc_test:");
+    ASSERT_FN(run_program(prog_name, "crc_test"));
+    ASSERT_FN(run_program(prog_name, "crc_read_test"));
+    /* an open without checksums drops them, the next one makes them again */
+    ASSERT_FN(run_program(prog_name, "slots_read_test"));
+    ASSERT_FN(run_program(prog_name, "crc_read_test"));
+    /* a bad page in each data file: the open takes the one of the storage file from the backup
+    and ap_storage_verify finds the one of the backup, the next open repairs that one */
+    ASSERT_FN(corrupt_page("data/storage_0.data", 1));
+    ASSERT_FN(corrupt_page("data/storage_1.data", 2));
+    ASSERT_FN(run_program(prog_name, "crc_repair_test"));
+    ASSERT_FN(run_program(prog_name, "crc_read_test"));
+    /* the same page is bad in both files, the open must fail */
+    ASSERT_FN(corrupt_page("data/storage_0.data", 1));
+    ASSERT_FN(corrupt_page("data/storage_1.data", 1));
+    if (run_program(prog_name, "crc_read_test") == 0) {
+        DBG("The storage was opened with a page that is bad in both files");
+        return -1;
+    }
+    clear_tests();
+
+    DBG("######################### wal_test:");
+    ASSERT_FN(run_program(prog_name, "wal_test"));
+    ASSERT_FN(run_program(prog_name, "wal_read_test"));
+    ASSERT_FN(run_program(prog_name, "wal_crash_test"));
+    ASSERT_FN(run_program(prog_name, "wal_read_test"));
+    clear_tests();
+
+    DBG("######################### wal_async_test:");
+    ASSERT_FN(run_program(prog_name, "wal_async_test"));
+    ASSERT_FN(run_program(prog_name, "wal_read_test"));
+    ASSERT_FN(run_program(prog_name, "wal_async_crash_test"));
+    ASSERT_FN(run_program(prog_name, "wal_read_test"));
+    clear_tests();
+    ASSERT_FN(run_program(prog_name, "wal_async_uffd_test"));
+    ASSERT_FN(run_program(prog_name, "wal_read_test"));
+    clear_tests();
+    ASSERT_FN(run_program(prog_name, "wal_fail_test"));
+    ASSERT_FN(run_program(prog_name, "wal_read_test"));
+    clear_tests();
+
+    DBG("######################### savepoint_test:");
+    ASSERT_FN(run_program(prog_name, "savepoint_test"));
+    ASSERT_FN(run_program(prog_name, "slots_read_test"));
+    clear_tests();
+    ASSERT_FN(run_program(prog_name, "savepoint_lazy_test"));
+    ASSERT_FN(run_program(prog_name, "lazy_read_test"));
+    clear_tests();
+    ASSERT_FN(run_program(prog_name, "savepoint_wal_test"));
+    ASSERT_FN(run_program(prog_name, "wal_read_test"));
+    clear_tests();
+
+    DBG("######################### bulk_test:");
+    ASSERT_FN(run_program(prog_name, "bulk_test"));
+    ASSERT_FN(run_program(prog_name, "bulk_read_test"));
+    clear_tests();
+    ASSERT_FN(run_program(prog_name, "bulk_lazy_test"));
+    ASSERT_FN(run_program(prog_name, "bulk_read_test"));
+    clear_tests();
+
+    DBG("######################### repl_test:");
+    ASSERT_FN(run_program(prog_name, "repl_test"));
+    ASSERT_FN(run_program(prog_name, "repl_read_test"));
+    clear_tests();
+    ASSERT_FN(run_program(prog_name, "repl_wal_test"));
+    ASSERT_FN(run_program(prog_name, "repl_read_test"));
+    clear_tests();
+
+    DBG("######################### open_fail_test:");
+    ASSERT_FN(run_program(prog_name, "open_fail_test"));
+    clear_tests();
+
+    DBG("######################### multi_test:");
+    ASSERT_FN(run_program(prog_name, "multi_test"));
+    ASSERT_FN(run_program(prog_name, "multi_read_test"));
+    clear_tests();
+
+    DBG("######################### reader_test:");
+    ASSERT_FN(run_program(prog_name, "reader_test"));
+    clear_tests();
+
     DBG("######################### base_test:");
     ASSERT_FN(run_program(prog_name, "base_test"));
     ASSERT_FN(run_program(prog_name, "read_test"));
@@ -228,6 +503,749 @@ static int do_guest_stuff(const char *_param) {
         ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
         ap_storage_uninit();
     }
+    else if (param == "grow_test") {
+        /* the storage grows by mapping only the new tail, so the region must not move and the time
+        of a grow must not depend on how large the storage already is */
+        DBG("Start grow_test");
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL));
+        auto [off, ptr] = ap_storage_construct<test_ap_malloc_t>();
+        ap_malloc_set_usr(ap_static_ctx, off);
+        void *region = ap_static_ctx->region;
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+
+        uint64_t first_us = 0, last_us = 0;
+        for (int i = 0; i < 256; i++) {
+            uint64_t start = get_time_us();
+            alloc_slot(ptr, i, 1024 * 1024);
+            uint64_t dt = get_time_us() - start;
+            if (i < 32)
+                first_us += dt;
+            if (i >= 256 - 32)
+                last_us += dt;
+            if (ap_static_ctx->region != region) {
+                DBG("The region moved while growing");
+                return -1;
+            }
+            if (i % 64 == 63)
+                ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        }
+        DBG("first 32 allocs: %ldus last 32 allocs: %ldus", first_us, last_us);
+
+        /* a revert drops the grown part, the region grows again after that */
+        uint64_t hash = hash_slots(ptr);
+        for (int i = 256; i < 320; i++)
+            alloc_slot(ptr, i, 1024 * 1024);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+        if (hash_slots(ptr) != hash) {
+            DBG("Failed because hashes differ after revert");
+            return -1;
+        }
+        for (int i = 256; i < 320; i++)
+            alloc_slot(ptr, i, 1024 * 1024);
+        ASSERT_FN(CHK_BOOL(ap_static_ctx->region == region));
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        ap_storage_uninit();
+    }
+    else if (param == "grow_read_test" || param == "slots_read_test" ||
+            param == "lazy_read_test")
+    {
+        DBG("Start %s", param.c_str());
+        uint32_t flags = param == "lazy_read_test" ?
+                AP_STORAGE_FLAG_LAZY | AP_STORAGE_FLAG_PREFETCH : 0;
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL, flags));
+        /* the writer may have been skipped, then the storage is new */
+        if (ap_malloc_get_usr(ap_static_ctx)) {
+            auto ptr = (test_ap_malloc_t *)ap_malloc_ptr(ap_static_ctx,
+                    ap_malloc_get_usr(ap_static_ctx));
+            ASSERT_FN(check_slots(ptr));
+        }
+        ASSERT_FN(ap_malloc_validate(ap_static_ctx));
+        ap_storage_uninit();
+        if (flags & AP_STORAGE_FLAG_PREFETCH && access("data/storage.hot", F_OK) < 0) {
+            DBG("The hot ranges where not saved");
+            return -1;
+        }
+    }
+    else if (param == "track_test_uffd" || param == "track_test_soft_dirty" ||
+            param == "lazy_test" || param == "lazy_uffd_test")
+    {
+        /* the same random changes as in ap_malloc_long_test, with the pages tracked by the kernel,
+        or with the segments of a lazy storage set up as they are used */
+        DBG("Start %s", param.c_str());
+        uint32_t flags = param == "track_test_soft_dirty" ? AP_STORAGE_FLAG_TRACK_SOFT_DIRTY :
+                param == "lazy_test" ? AP_STORAGE_FLAG_LAZY | AP_STORAGE_FLAG_PREFETCH :
+                param == "lazy_uffd_test" ? AP_STORAGE_FLAG_LAZY | AP_STORAGE_FLAG_TRACK_UFFD :
+                AP_STORAGE_FLAG_TRACK_UFFD;
+        if (ap_storage_init("data/storage", ap_storage_except_cbk, NULL, flags) < 0) {
+            DBG("The kernel can't track the pages this way, skipped");
+            return 0;
+        }
+        auto [off, ptr] = ap_storage_construct<test_ap_malloc_t>();
+        ap_malloc_set_usr(ap_static_ctx, off);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        last_malloc_test_hash = hash_slots(ptr);
+
+        for (int i = 0; i < 30000; i++) {
+            uint32_t slot = rand() % 8192;
+            if (i % 1000 == 999) {
+                uint64_t hash = hash_slots(ptr);
+                ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+                ASSERT_FN(CHK_BOOL(hash == hash_slots(ptr)));
+                last_malloc_test_hash = hash;
+            }
+            else if (i % 1000 == 499) {
+                ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+                if (hash_slots(ptr) != last_malloc_test_hash) {
+                    DBG("Failed because hashes differ after revert");
+                    return -1;
+                }
+            }
+            else if (!ptr->ptrs[slot]) {
+                alloc_slot(ptr, slot, rand() % 20000 + 1);
+            }
+            else {
+                free_slot(ptr, slot);
+            }
+        }
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        ap_storage_uninit();
+    }
+    else if (param == "wal_test" || param == "wal_crash_test" || param == "wal_async_test" ||
+            param == "wal_async_crash_test" || param == "wal_async_uffd_test")
+    {
+        /* enaugh commits for a few checkpoints, the crash test exits in the middle of a
+        transaction, without uninit, and the reader must find the last commit. The async tests
+        keep writing while the commit is flushed, the revert that follows must still find the
+        pages as they where when the commit started. */
+        DBG("Start %s", param.c_str());
+        bool async = param.find("async") != std::string::npos;
+        uint32_t flags = AP_STORAGE_FLAG_WAL;
+        if (param == "wal_async_uffd_test")
+            flags |= AP_STORAGE_FLAG_TRACK_UFFD;
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL, flags));
+        static int async_done, async_started;
+        auto commit_cbk = [](void *ctx, int result) {
+            if (result == 0)
+                __atomic_add_fetch((int *)ctx, 1, __ATOMIC_SEQ_CST);
+        };
+        test_ap_malloc_t *ptr;
+        if (ap_malloc_get_usr(ap_static_ctx)) {
+            ptr = (test_ap_malloc_t *)ap_malloc_ptr(ap_static_ctx,
+                    ap_malloc_get_usr(ap_static_ctx));
+            ASSERT_FN(check_slots(ptr));
+        }
+        else {
+            ap_off_t off;
+            std::tie(off, ptr) = ap_storage_construct<test_ap_malloc_t>();
+            ap_malloc_set_usr(ap_static_ctx, off);
+        }
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        last_malloc_test_hash = hash_slots(ptr);
+
+        for (int i = 0; i < 40300; i++) {
+            uint32_t slot = rand() % 8192;
+            if (i % 1000 == 999) {
+                uint64_t hash = hash_slots(ptr);
+                if (async) {
+                    ASSERT_FN(ap_storage_commit_async(commit_cbk, &async_done));
+                    async_started++;
+                }
+                else {
+                    ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+                }
+                ASSERT_FN(CHK_BOOL(hash == hash_slots(ptr)));
+                last_malloc_test_hash = hash;
+            }
+            else if (i % 1000 == 499) {
+                ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+                if (hash_slots(ptr) != last_malloc_test_hash) {
+                    DBG("Failed because hashes differ after revert");
+                    return -1;
+                }
+            }
+            else if (i % 5000 == 4000) {
+                ap_malloc_trim(ap_static_ctx);
+            }
+            else if (!ptr->ptrs[slot]) {
+                alloc_slot(ptr, slot, rand() % 40000 + 1);
+            }
+            else {
+                free_slot(ptr, slot);
+            }
+        }
+
+        ASSERT_FN(ap_storage_wait_commit());
+        if (async_done != async_started) {
+            DBG("Only %d of %d async commits called back", async_done, async_started);
+            return -1;
+        }
+        FILE *f = fopen("data/wal_hash", "w");
+        ASSERT_FN(CHK_BOOL(f));
+        fprintf(f, "%lx", last_malloc_test_hash);
+        fclose(f);
+        if (param == "wal_crash_test" || param == "wal_async_crash_test")
+            _exit(0);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+        ap_storage_uninit();
+    }
+    else if (param == "wal_fail_test") {
+        /* the log can't be written while the file size limit is 0, the pages of the failed
+        commits must be reverted by a revert and written by the next commit */
+        DBG("Start wal_fail_test");
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL,
+                AP_STORAGE_FLAG_WAL));
+        auto [off, ptr] = ap_storage_construct<test_ap_malloc_t>();
+        ap_malloc_set_usr(ap_static_ctx, off);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        last_malloc_test_hash = hash_slots(ptr);
+
+        signal(SIGXFSZ, SIG_IGN);
+        struct rlimit old_lim;
+        ASSERT_FN(getrlimit(RLIMIT_FSIZE, &old_lim));
+        for (int round = 0; round < 3; round++) {
+            change_slots(ptr, 500);
+            struct rlimit lim = { .rlim_cur = 0, .rlim_max = old_lim.rlim_max };
+            ASSERT_FN(setrlimit(RLIMIT_FSIZE, &lim));
+            int ret = round < 2 ? ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES) :
+                    ap_storage_commit_async() < 0 ? -1 : ap_storage_wait_commit();
+            ASSERT_FN(setrlimit(RLIMIT_FSIZE, &old_lim));
+            if (ret == 0) {
+                DBG("The commit didn't fail in round %d", round);
+                return -1;
+            }
+            if (round == 0) {
+                ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+                if (hash_slots(ptr) != last_malloc_test_hash) {
+                    DBG("The revert after a failed commit didn't go back to the last commit");
+                    return -1;
+                }
+                continue;
+            }
+            change_slots(ptr, 100);
+            ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+            last_malloc_test_hash = hash_slots(ptr);
+        }
+
+        FILE *f = fopen("data/wal_hash", "w");
+        ASSERT_FN(CHK_BOOL(f));
+        fprintf(f, "%lx", last_malloc_test_hash);
+        fclose(f);
+        ap_storage_uninit();
+    }
+    else if (param == "crc_test") {
+        /* the random changes of ap_malloc_long_test with checksums, a thread checks the last
+        commit all the time and must never find a bad page */
+        DBG("Start crc_test");
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL,
+                AP_STORAGE_FLAG_CHECKSUMS));
+        auto [off, ptr] = ap_storage_construct<test_ap_malloc_t>();
+        ap_malloc_set_usr(ap_static_ctx, off);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+
+        std::atomic<bool> stop = false;
+        std::atomic<int64_t> bad = 0;
+        int verify_cnt = 0;
+        std::thread verifier([&]{
+            while (!stop) {
+                int64_t ret = ap_storage_verify();
+                if (ret)
+                    bad = ret;
+                verify_cnt++;
+            }
+        });
+        FnScope scope([&]{ stop = true; verifier.join(); });
+        for (int i = 0; i < 20000; i++) {
+            uint32_t slot = rand() % 8192;
+            if (i % 1000 == 999) {
+                ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+            }
+            else if (i % 1000 == 499) {
+                ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+            }
+            else if (!ptr->ptrs[slot]) {
+                alloc_slot(ptr, slot, rand() % 20000 + 1);
+            }
+            else {
+                free_slot(ptr, slot);
+            }
+        }
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        scope.call();
+        DBG("verified %d times", verify_cnt);
+        if (bad) {
+            DBG("The verify found %ld bad pages", bad.load());
+            return -1;
+        }
+        ap_storage_uninit();
+    }
+    else if (param == "crc_read_test" || param == "crc_repair_test") {
+        /* the repair test starts with a bad page in each data file */
+        DBG("Start %s", param.c_str());
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL,
+                AP_STORAGE_FLAG_CHECKSUMS | AP_STORAGE_FLAG_VERIFY));
+        auto ptr = (test_ap_malloc_t *)ap_malloc_ptr(ap_static_ctx,
+                ap_malloc_get_usr(ap_static_ctx));
+        ASSERT_FN(check_slots(ptr));
+        ASSERT_FN(ap_malloc_validate(ap_static_ctx));
+        int64_t bad = ap_storage_verify();
+        if (bad != (param == "crc_repair_test" ? 1 : 0)) {
+            DBG("The verify found %ld bad pages", bad);
+            return -1;
+        }
+        ap_storage_uninit();
+    }
+    else if (param == "savepoint_test" || param == "savepoint_lazy_test" ||
+            param == "savepoint_wal_test")
+    {
+        /* batches of requests, each request has a savepoint and a nested one for half of it's
+        changes, a third of the inner and of the outer savepoints are rolled back. The storage
+        grows and is trimmed inside the savepoints. After each rollback the slots must be as they
+        where at the savepoint. */
+        DBG("Start %s", param.c_str());
+        uint32_t flags = param == "savepoint_lazy_test" ? AP_STORAGE_FLAG_LAZY :
+                param == "savepoint_wal_test" ? AP_STORAGE_FLAG_WAL : 0;
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL, flags));
+        auto [off, ptr] = ap_storage_construct<test_ap_malloc_t>();
+        ap_malloc_set_usr(ap_static_ctx, off);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+
+        auto change = [&ptr](int cnt) {
+            for (int i = 0; i < cnt; i++) {
+                uint32_t slot = rand() % 8192;
+                if (rand() % 200 == 0)
+                    ap_malloc_trim(ap_static_ctx);
+                else if (!ptr->ptrs[slot])
+                    alloc_slot(ptr, slot, rand() % 200 == 0 ? 1024 * 1024 : rand() % 20000 + 1);
+                else
+                    free_slot(ptr, slot);
+            }
+        };
+        auto check = [&ptr](uint64_t hash, const char *what) {
+            if (hash_slots(ptr) != hash) {
+                DBG("Failed because hashes differ after the rollback of the %s savepoint", what);
+                return -1;
+            }
+            ASSERT_FN(ap_malloc_validate(ap_static_ctx));
+            return 0;
+        };
+
+        /* the log starts with room for the pages of the small storage, the block written after
+        the savepoints is larger, so the log grows while it is written */
+        ap_off_t big_off = ap_malloc_alloc(ap_static_ctx, SP_BIG_SZ);
+        ASSERT_FN(CHK_BOOL(big_off));
+        uint8_t *big = (uint8_t *)ap_malloc_ptr(ap_static_ctx, big_off);
+        memset(big, 1, SP_BIG_SZ);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        for (int val = 2; val <= 3; val++) {
+            ASSERT_FN(ap_storage_savepoint());
+            memset(big, val, SP_BIG_SZ);
+        }
+        for (int sp = 2; sp >= 1; sp--) {
+            ASSERT_FN(ap_storage_rollback_to(sp));
+            for (uint64_t i = 0; i < SP_BIG_SZ; i += 512) {
+                if (big[i] != sp) {
+                    DBG("Byte %ld of the block was not rolled back to savepoint %d", i, sp);
+                    return -1;
+                }
+            }
+        }
+        ASSERT_FN(ap_storage_release(1));
+        ap_malloc_free(ap_static_ctx, big_off);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        int rollbacks = 0;
+        for (int batch = 0; batch < 10; batch++) {
+            for (int req = 0; req < 30; req++) {
+                int outer = ap_storage_savepoint();
+                ASSERT_FN(outer);
+                uint64_t outer_hash = hash_slots(ptr);
+                change(10);
+
+                int inner = ap_storage_savepoint();
+                ASSERT_FN(CHK_BOOL(inner == outer + 1));
+                uint64_t inner_hash = hash_slots(ptr);
+                change(10);
+                if (rand() % 3 == 0) {
+                    ASSERT_FN(ap_storage_rollback_to(inner));
+                    ASSERT_FN(check(inner_hash, "inner"));
+                    change(5);
+                    rollbacks++;
+                }
+                ASSERT_FN(ap_storage_release(inner));
+
+                if (rand() % 3 == 0) {
+                    ASSERT_FN(ap_storage_rollback_to(outer));
+                    ASSERT_FN(check(outer_hash, "outer"));
+                    rollbacks++;
+                }
+                ASSERT_FN(ap_storage_release(outer));
+            }
+            last_malloc_test_hash = hash_slots(ptr);
+            ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+            ASSERT_FN(CHK_BOOL(hash_slots(ptr) == last_malloc_test_hash));
+        }
+        DBG("%d rollbacks", rollbacks);
+
+        /* a savepoint that is not released ends with the revert */
+        ASSERT_FN(ap_storage_savepoint());
+        change(100);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+        ASSERT_FN(check(last_malloc_test_hash, "reverted"));
+        if (ap_storage_rollback_to(1) == 0) {
+            DBG("The savepoint was not dropped by the revert");
+            return -1;
+        }
+
+        FILE *f = fopen("data/wal_hash", "w");
+        ASSERT_FN(CHK_BOOL(f));
+        fprintf(f, "%lx", last_malloc_test_hash);
+        fclose(f);
+        ap_storage_uninit();
+    }
+    else if (param == "bulk_test" || param == "bulk_lazy_test") {
+        /* the pages written in a bulk write don't fault, they must still be reverted and
+        committed like the others */
+        DBG("Start %s", param.c_str());
+        uint32_t flags = param == "bulk_lazy_test" ? AP_STORAGE_FLAG_LAZY : 0;
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL, flags));
+        auto [off, ptr] = ap_storage_construct<test_bulk_t>();
+        ap_malloc_set_usr(ap_static_ctx, off);
+        ptr->block = ap_malloc_alloc(ap_static_ctx, BULK_BLOCK_SZ);
+        ASSERT_FN(CHK_BOOL(ptr->block));
+        uint8_t *block = (uint8_t *)ap_malloc_ptr(ap_static_ctx, ptr->block);
+        memset(block, 0x11, BULK_BLOCK_SZ);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+
+        uint8_t outside[16];
+        if (ap_storage_mark_dirty(outside, sizeof(outside)) == 0) {
+            DBG("A range outside the storage was marked");
+            return -1;
+        }
+        for (int round = 0; round < 2; round++) {
+            if (round == 0) {
+                ap_storage_bulk_write_t bulk;
+                for (uint64_t i = 0; i < BULK_ELEMS; i++)
+                    ptr->vec.push_back(i * 7);
+                ASSERT_FN(ap_storage_mark_dirty(block, BULK_BLOCK_SZ));
+                memset(block, 0xab, BULK_BLOCK_SZ);
+            }
+            else {
+                ap_storage_bulk_write_t bulk(block, BULK_BLOCK_SZ);
+                ASSERT_FN(bulk.ret);
+                for (uint64_t i = 0; i < BULK_ELEMS; i++)
+                    ptr->vec.push_back(i * 7);
+                memset(block, 0xab, BULK_BLOCK_SZ);
+                break;
+            }
+            ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+            if (ptr->vec.size() || block[0] != 0x11 || block[BULK_BLOCK_SZ - 1] != 0x11) {
+                DBG("The bulk write was not reverted");
+                return -1;
+            }
+        }
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        if (ap_storage_bulk_end() == 0) {
+            DBG("A bulk write was ended without being started");
+            return -1;
+        }
+        ap_storage_uninit();
+    }
+    else if (param == "bulk_read_test") {
+        DBG("Start bulk_read_test");
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL));
+        auto ptr = (test_bulk_t *)ap_malloc_ptr(ap_static_ctx, ap_malloc_get_usr(ap_static_ctx));
+        if (ptr->vec.size() != BULK_ELEMS) {
+            DBG("The vector has %ld elements", ptr->vec.size());
+            return -1;
+        }
+        for (uint64_t i = 0; i < BULK_ELEMS; i++)
+            if (ptr->vec[i] != i * 7) {
+                DBG("Element %ld was not saved", i);
+                return -1;
+            }
+        uint8_t *block = (uint8_t *)ap_malloc_ptr(ap_static_ctx, ptr->block);
+        for (uint64_t i = 0; i < BULK_BLOCK_SZ; i++)
+            if (block[i] != 0xab) {
+                DBG("Byte %ld of the block was not saved", i);
+                return -1;
+            }
+        ASSERT_FN(ap_malloc_validate(ap_static_ctx));
+        ap_storage_uninit();
+    }
+    else if (param == "repl_test" || param == "repl_wal_test") {
+        /* a follower thread applies the stream of the default storage from a socketpair, after
+        each record it must hold the same slots as the leader's commit. At the end a block is
+        changed by a few bytes in each commit, the records must be as small as the changes. */
+        DBG("Start %s", param.c_str());
+        bool wal = param == "repl_wal_test";
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL,
+                wal ? AP_STORAGE_FLAG_WAL : 0));
+        ap_storage_t *replica = ap_storage_open("data/replica", ap_storage_except_cbk, NULL);
+        ASSERT_FN(CHK_BOOL(replica));
+        auto [off, ptr] = ap_storage_construct<test_ap_malloc_t>();
+        ap_malloc_set_usr(ap_static_ctx, off);
+
+        int sv[2];
+        ASSERT_FN(socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+        ASSERT_FN(ap_storage_replicate(sv[0],
+                AP_STORAGE_REPL_FULL | (wal ? 0 : AP_STORAGE_REPL_DELTA)));
+        std::vector<uint64_t> leader_hashes, follower_hashes;
+        std::vector<int64_t> rec_sizes;
+        int64_t follower_ret = 0;
+        std::thread follower([&]{
+            ap_ctx_t *ctx = ap_storage_get_mctx(replica);
+            while ((follower_ret = ap_storage_replica_apply(replica, sv[1])) > 0) {
+                rec_sizes.push_back(follower_ret);
+                auto fptr = (test_ap_malloc_t *)ap_malloc_ptr(ctx, ap_malloc_get_usr(ctx));
+                follower_hashes.push_back(hash_slots(fptr, ctx));
+            }
+        });
+
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        leader_hashes.push_back(hash_slots(ptr));
+        for (int i = 0; i < 20000; i++) {
+            uint32_t slot = rand() % 8192;
+            if (i % 1000 == 999) {
+                ASSERT_FN(ap_storage_commit_async());
+                leader_hashes.push_back(hash_slots(ptr));
+            }
+            else if (i % 1000 == 499) {
+                ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+            }
+            else if (i % 5000 == 4000) {
+                ap_malloc_trim(ap_static_ctx);
+            }
+            else if (!ptr->ptrs[slot]) {
+                alloc_slot(ptr, slot, rand() % 20000 + 1);
+            }
+            else {
+                free_slot(ptr, slot);
+            }
+        }
+        ASSERT_FN(ap_storage_wait_commit());
+
+        const uint64_t block_sz = 4 * 1024 * 1024;
+        uint8_t *block = (uint8_t *)ap_malloc_ptr(ap_static_ctx,
+                ap_malloc_alloc(ap_static_ctx, block_sz));
+        ASSERT_FN(CHK_BOOL(block));
+        memset(block, 1, block_sz);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        leader_hashes.push_back(hash_slots(ptr));
+        for (int i = 0; i < 10; i++) {
+            block[i * 123457 % block_sz] = i + 2;
+            block[i * 765433 % block_sz] = i + 2;
+            ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+            leader_hashes.push_back(hash_slots(ptr));
+        }
+
+        shutdown(sv[0], SHUT_WR);
+        follower.join();
+        close(sv[0]);
+        close(sv[1]);
+        ASSERT_FN(follower_ret);
+        if (follower_hashes != leader_hashes) {
+            DBG("The follower applied %ld records, the leader made %ld commits",
+                    follower_hashes.size(), leader_hashes.size());
+            for (uint64_t i = 0; i < std::min(follower_hashes.size(), leader_hashes.size()); i++)
+                if (follower_hashes[i] != leader_hashes[i])
+                    DBG("The record %ld differs", i);
+            return -1;
+        }
+        int64_t block_rec = rec_sizes[rec_sizes.size() - 11];
+        int64_t small_max = *std::max_element(rec_sizes.end() - 10, rec_sizes.end());
+        DBG("full: %ld bytes, block: %ld bytes, small commits: at most %ld bytes",
+                rec_sizes[0], block_rec, small_max);
+        if (block_rec < int64_t(block_sz) || small_max > (wal ? 3 * 4096 : 256)) {
+            DBG("The records don't follow the size of the changes");
+            return -1;
+        }
+
+        FILE *f = fopen("data/repl_hash", "w");
+        ASSERT_FN(CHK_BOOL(f));
+        fprintf(f, "%lx", leader_hashes.back());
+        fclose(f);
+        ap_storage_close(replica);
+        ap_storage_uninit();
+    }
+    else if (param == "repl_read_test") {
+        /* the follower holds the last commit of the leader after it was closed */
+        DBG("Start repl_read_test");
+        ASSERT_FN(ap_storage_init("data/replica", ap_storage_except_cbk, NULL));
+        auto ptr = (test_ap_malloc_t *)ap_malloc_ptr(ap_static_ctx,
+                ap_malloc_get_usr(ap_static_ctx));
+        uint64_t hash = 0;
+        FILE *f = fopen("data/repl_hash", "r");
+        ASSERT_FN(CHK_BOOL(f && fscanf(f, "%lx", &hash) == 1));
+        fclose(f);
+        if (hash_slots(ptr) != hash) {
+            DBG("The follower doesn't hold the last commit: %lx != %lx", hash_slots(ptr), hash);
+            return -1;
+        }
+        ASSERT_FN(check_slots(ptr));
+        ASSERT_FN(ap_malloc_validate(ap_static_ctx));
+        ap_storage_uninit();
+    }
+    else if (param == "open_fail_test") {
+        /* ap_malloc_init rejects a region of another layout, at the end of the open. A failed
+        open must undo all it did, so more of them than a process can have storages still leave
+        room for the open that follows, once the region is good again */
+        DBG("Start open_fail_test");
+        for (uint32_t flags : {0u, uint32_t(AP_STORAGE_FLAG_WAL)}) {
+            clear_tests();
+            ap_storage_t *st = ap_storage_open("data/storage", ap_storage_except_cbk, NULL, flags);
+            ASSERT_FN(CHK_BOOL(st));
+            ap_storage_close(st);
+
+            for (auto path : {"data/storage_0.data", "data/storage_1.data"})
+                ASSERT_FN(flip_region_version(path));
+            for (int i = 0; i < 65; i++) {
+                if ((st = ap_storage_open("data/storage", ap_storage_except_cbk, NULL, flags))) {
+                    DBG("A region of another layout was opened");
+                    return -1;
+                }
+            }
+            for (auto path : {"data/storage_0.data", "data/storage_1.data"})
+                ASSERT_FN(flip_region_version(path));
+            ASSERT_FN(CHK_BOOL(st = ap_storage_open("data/storage", ap_storage_except_cbk, NULL,
+                    flags)));
+            ASSERT_FN(ap_malloc_validate(ap_storage_get_mctx(st)));
+            ap_storage_close(st);
+        }
+    }
+    else if (param == "multi_test") {
+        /* the default storage stays open next to the others, the storages are written and
+        committed in parallel */
+        DBG("Start multi_test");
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL));
+        ap_storage_t *st[3];
+        for (int i = 0; i < 3; i++)
+            ASSERT_FN(CHK_BOOL(st[i] = ap_storage_open(multi_names[i], ap_storage_except_cbk,
+                    NULL, multi_flags[i])));
+        uint64_t hash[3] = {};
+        int ret[3] = {};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 3; i++)
+            threads.emplace_back([&, i]{ ret[i] = multi_work(st[i], &hash[i]); });
+        for (auto &t : threads)
+            t.join();
+        for (int i = 0; i < 3; i++)
+            ASSERT_FN(ret[i]);
+
+        FILE *f = fopen("data/multi_hash", "w");
+        ASSERT_FN(CHK_BOOL(f));
+        for (int i = 0; i < 3; i++) {
+            fprintf(f, "%lx\n", hash[i]);
+            ap_storage_close(st[i]);
+        }
+        fclose(f);
+        ASSERT_FN(ap_malloc_validate(ap_static_ctx));
+        ap_storage_uninit();
+    }
+    else if (param == "multi_read_test") {
+        DBG("Start multi_read_test");
+        FILE *f = fopen("data/multi_hash", "r");
+        ASSERT_FN(CHK_BOOL(f));
+        FnScope scope([f]{ fclose(f); });
+        for (int i = 0; i < 3; i++) {
+            uint64_t hash = 0;
+            ASSERT_FN(CHK_BOOL(fscanf(f, "%lx", &hash) == 1));
+            ap_storage_t *st = ap_storage_open(multi_names[i], ap_storage_except_cbk, NULL,
+                    multi_flags[i]);
+            ASSERT_FN(CHK_BOOL(st));
+            ap_ctx_t *ctx = ap_storage_get_mctx(st);
+            test_ap_malloc_t *ptr = multi_slots(st);
+            if (hash_slots(ptr, ctx) != hash) {
+                DBG("Storage %s doesn't hold the last commit", multi_names[i]);
+                return -1;
+            }
+            ASSERT_FN(check_slots(ptr, ctx));
+            ASSERT_FN(ap_malloc_validate(ctx));
+            ap_storage_close(st);
+        }
+    }
+    else if (param == "reader_test") {
+        /* the writer, a reader process scans the snapshots while the commits go on. Each round
+        also writes over some slots and reverts that, the reader must not see it */
+        DBG("Start reader_test");
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL));
+        auto [off, ptr] = ap_storage_construct<test_reader_t>();
+        ap_malloc_set_usr(ap_static_ctx, off);
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+
+        int pid;
+        ASSERT_FN(pid = start_program("/proc/self/exe", "reader_scan"));
+        for (uint64_t round = 1; round <= READER_ROUNDS; round++) {
+            for (int i = 0; i < 20; i++) {
+                uint32_t slot = rand() % READER_SLOTS;
+                if (ptr->slots.ptrs[slot])
+                    memset(ap_malloc_ptr(ap_static_ctx, ptr->slots.ptrs[slot]), 0xff, 1);
+            }
+            ASSERT_FN(ap_storage_do_changes(AP_STORAGE_REVERT_CHANGES));
+
+            for (int i = 0; i < 50; i++) {
+                uint32_t slot = rand() % READER_SLOTS;
+                if (ptr->slots.ptrs[slot])
+                    free_slot(&ptr->slots, slot);
+                else
+                    alloc_slot(&ptr->slots, slot, rand() % 4000 + 1);
+            }
+            for (int i = 0; i < READER_SLOTS; i++)
+                if (ptr->slots.ptrs[i])
+                    memset(ap_malloc_ptr(ap_static_ctx, ptr->slots.ptrs[i]), round,
+                            ptr->slots.sz[i]);
+            ptr->round = round;
+            ptr->rounds.push_back(round);
+            ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+            usleep(2000);
+        }
+        ASSERT_FN(wait_program(pid));
+        ap_storage_uninit();
+    }
+    else if (param == "reader_scan") {
+        /* each snapshot is checked when it is taken and again after the writer committed over
+        it */
+        DBG("Start reader_scan");
+        ap_storage_reader_t *r = ap_storage_reader_open("data/storage");
+        ASSERT_FN(CHK_BOOL(r));
+        FnScope scope([r]{ ap_storage_reader_close(r); });
+        ap_ctx_t *ctx = ap_storage_reader_get_mctx(r);
+        int snapshots = 0, pinned = 0;
+        while (true) {
+            ASSERT_FN(ap_storage_reader_snapshot(r));
+            auto ptr = (test_reader_t *)ap_malloc_ptr(ctx, ap_malloc_get_usr(ctx));
+            ASSERT_FN(check_reader(ptr, ctx));
+            snapshots++;
+            if (ptr->round == READER_ROUNDS)
+                break;
+            while (!ap_storage_reader_stale(r))
+                usleep(500);
+            ASSERT_FN(check_reader(ptr, ctx));
+            pinned++;
+        }
+        DBG("snapshots: %d checked after a commit: %d generation: %ld", snapshots, pinned,
+                ap_storage_reader_generation(r));
+        if (!pinned) {
+            DBG("No snapshot was checked after a commit");
+            return -1;
+        }
+    }
+    else if (param == "wal_read_test") {
+        DBG("Start wal_read_test");
+        ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL,
+                AP_STORAGE_FLAG_WAL));
+        auto ptr = (test_ap_malloc_t *)ap_malloc_ptr(ap_static_ctx,
+                ap_malloc_get_usr(ap_static_ctx));
+        uint64_t hash = 0;
+        FILE *f = fopen("data/wal_hash", "r");
+        ASSERT_FN(CHK_BOOL(f && fscanf(f, "%lx", &hash) == 1));
+        fclose(f);
+        if (hash_slots(ptr) != hash) {
+            DBG("The storage doesn't hold the last commit: %lx != %lx", hash_slots(ptr), hash);
+            return -1;
+        }
+        ASSERT_FN(check_slots(ptr));
+        ASSERT_FN(ap_malloc_validate(ap_static_ctx));
+        ap_storage_uninit();
+    }
     else if (param == "ap_malloc_read_test") {
         DBG("Start ap_malloc_read_test");
         ASSERT_FN(ap_storage_init("data/storage", ap_storage_except_cbk, NULL));
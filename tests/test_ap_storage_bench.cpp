@@ -0,0 +1,118 @@
+#include "ap_storage.h"
+#include "debug.h"
+#include "time_utils.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+/* Commit cycle throughput of ap_storage for each way of tracking the modified pages and for the
+two-file and the WAL modes. A cycle writes one byte in each of N pages of the storage and commits
+them, N goes from 10k to 1M pages. The async modes start the commit with ap_storage_commit_async
+and go on writing while it is flushed, their write time is the mutation throughput during the
+commits.
+Each run is done in a new process, such that the state that a tracking mode leaves in the process
+(the soft-dirty bits, the SIGSEGV handler, the userfaultfd registration) doesn't change the
+timing of the next one. The ways that the kernel doesn't support are skipped.
+
+    test_ap_storage_bench.bin [ctrl file, default data/storage_bench] [max pages, default 100k]
+
+The 1M pages run must be asked for, the two data files take 4GB each then. On a disk the first
+write to a page after a commit also pays for the file system's own write fault, on a tmpfs the
+cost of the tracking is easier to see. */
+
+#define ROUNDS      4
+
+struct track_mode_t {
+    const char *name;
+    uint32_t flags;
+    bool async;
+};
+
+static track_mode_t track_modes[] = {
+    { "mprotect",   0, false },
+    { "soft_dirty", AP_STORAGE_FLAG_TRACK_SOFT_DIRTY, false },
+    { "uffd",       AP_STORAGE_FLAG_TRACK_UFFD, false },
+    { "wal",        AP_STORAGE_FLAG_WAL, false },
+    { "wal_uffd",   AP_STORAGE_FLAG_WAL | AP_STORAGE_FLAG_TRACK_UFFD, false },
+    { "wal_async",  AP_STORAGE_FLAG_WAL, true },
+    { "wal_uffd_async", AP_STORAGE_FLAG_WAL | AP_STORAGE_FLAG_TRACK_UFFD, true },
+};
+
+void ap_storage_except_cbk(void *ctx, const char *errmsg, ap_except_info_t *ei) {
+    DBG("[CRITICAL] %s\n%s", errmsg, ei->bt.c_str());
+    exit(1);
+}
+
+static void clear_storage(const std::string &ctrl) {
+    unlink(ctrl.c_str());
+    for (auto ext : {"_0.data", "_1.data", "_0.wal", "_1.wal"})
+        unlink((ctrl + ext).c_str());
+}
+
+static int bench_commits(const std::string &ctrl, track_mode_t mode, uint64_t pages) {
+    clear_storage(ctrl);
+    if (ap_storage_init(ctrl.c_str(), ap_storage_except_cbk, NULL, mode.flags) < 0) {
+        DBG("%-14s pages: %7ld skipped, not supported", mode.name, pages);
+        return 0;
+    }
+    ap_off_t off = ap_malloc_alloc(ap_static_ctx, pages * 4096);
+    ASSERT_FN(CHK_BOOL(off));
+    uint8_t *data = (uint8_t *)ap_malloc_ptr(ap_static_ctx, off);
+    ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+
+    uint64_t write_us = 0, commit_us = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        uint64_t start = get_time_us();
+        for (uint64_t i = 0; i < pages; i++)
+            data[i * 4096] = r + 1;
+        uint64_t mid = get_time_us();
+        if (mode.async) {
+            ASSERT_FN(ap_storage_commit_async());
+        }
+        else {
+            ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        }
+        uint64_t end = get_time_us();
+        write_us += mid - start;
+        commit_us += end - mid;
+    }
+    /* the last flush is part of the cost */
+    uint64_t start = get_time_us();
+    ASSERT_FN(ap_storage_wait_commit());
+    commit_us += get_time_us() - start;
+    DBG("%-14s pages: %7ld write: %9.3fms commit: %9.3fms cycle: %9.3fms %8.0f pages/s", mode.name,
+            pages, write_us / 1000. / ROUNDS, commit_us / 1000. / ROUNDS,
+            (write_us + commit_us) / 1000. / ROUNDS,
+            pages * ROUNDS * 1e6 / (write_us + commit_us));
+
+    ap_storage_uninit();
+    clear_storage(ctrl);
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    DBG_SCOPE();
+    std::string ctrl = argc > 1 ? argv[1] : "data/storage_bench";
+    uint64_t max_pages = argc > 2 ? std::stoull(argv[2]) : 100000;
+
+    for (auto mode : track_modes) {
+        for (uint64_t pages : {10000, 100000, 1000000}) {
+            if (pages > max_pages)
+                continue;
+            int pid;
+            ASSERT_FN(pid = fork());
+            if (pid == 0)
+                exit(bench_commits(ctrl, mode, pages) < 0 ? 1 : 0);
+            int status = 0;
+            ASSERT_FN(waitpid(pid, &status, 0));
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                DBG("The %s run with %ld pages failed", mode.name, pages);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
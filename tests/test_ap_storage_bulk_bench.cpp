@@ -0,0 +1,112 @@
+#include "ap_storage.h"
+#include "ap_vector.h"
+#include "debug.h"
+#include "time_utils.h"
+
+#include <unistd.h>
+#include <string>
+
+/* Bulk loads into ap_storage with and without telling the storage what will be written. With the
+default tracking the first write to each page after a commit costs a SIGSEGV and a mprotect, the
+loads bellow skip that:
+
+    vector          push_back of N uint64_t in an empty ap_vector, the storage grows as it fills
+    vector_bulk     the same inside an ap_storage_bulk_write_t, the new memory is writable at once
+    block           N uint64_t written in a block that was allocated and committed before
+    block_marked    the same after ap_storage_mark_dirty on the block, one mprotect for all of it
+
+Each load is committed, the commit time is printed too, it is about the same for all of them.
+
+    test_ap_storage_bulk_bench.bin [ctrl file, default data/storage_bulk_bench]
+            [max elements in millions, default 16]
+*/
+
+#define ROUNDS      3
+
+enum {
+    LOAD_VECTOR,
+    LOAD_VECTOR_BULK,
+    LOAD_BLOCK,
+    LOAD_BLOCK_MARKED,
+};
+
+static const char *load_names[] = { "vector", "vector_bulk", "block", "block_marked" };
+
+void ap_storage_except_cbk(void *ctx, const char *errmsg, ap_except_info_t *ei) {
+    DBG("[CRITICAL] %s\n%s", errmsg, ei->bt.c_str());
+    exit(1);
+}
+
+static void clear_storage(const std::string &ctrl) {
+    unlink(ctrl.c_str());
+    for (auto ext : {"_0.data", "_1.data", "_0.wal", "_1.wal", ".hot", "_0.crc", "_1.crc"})
+        unlink((ctrl + ext).c_str());
+}
+
+static int bench_load(const std::string &ctrl, int load, uint64_t elems) {
+    clear_storage(ctrl);
+    ASSERT_FN(ap_storage_init(ctrl.c_str(), ap_storage_except_cbk, NULL));
+    auto [off, vec] = ap_storage_construct<ap_vector_t<uint64_t>>();
+    ap_malloc_set_usr(ap_static_ctx, off);
+    uint64_t *block = NULL;
+    if (load == LOAD_BLOCK || load == LOAD_BLOCK_MARKED) {
+        ap_off_t block_off = ap_malloc_alloc(ap_static_ctx, elems * sizeof(uint64_t));
+        ASSERT_FN(CHK_BOOL(block_off));
+        block = (uint64_t *)ap_malloc_ptr(ap_static_ctx, block_off);
+    }
+    ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+
+    uint64_t load_us = 0, commit_us = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        uint64_t start = get_time_us();
+        if (load == LOAD_VECTOR) {
+            for (uint64_t i = 0; i < elems; i++)
+                vec->push_back(i + r);
+        }
+        else if (load == LOAD_VECTOR_BULK) {
+            ap_storage_bulk_write_t bulk;
+            for (uint64_t i = 0; i < elems; i++)
+                vec->push_back(i + r);
+        }
+        else {
+            if (load == LOAD_BLOCK_MARKED)
+                ASSERT_FN(ap_storage_mark_dirty(block, elems * sizeof(uint64_t)));
+            for (uint64_t i = 0; i < elems; i++)
+                block[i] = i + r;
+        }
+        uint64_t mid = get_time_us();
+        ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        uint64_t end = get_time_us();
+        load_us += mid - start;
+        commit_us += end - mid;
+
+        /* the next round loads an empty vector again, it's memory is given back */
+        if (load == LOAD_VECTOR || load == LOAD_VECTOR_BULK) {
+            vec->clear();
+            ap_malloc_trim(ap_static_ctx);
+            ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+        }
+    }
+    DBG("%-12s elems: %4ldM load: %9.3fms (%7.1fns/page) commit: %9.3fms", load_names[load],
+            elems >> 20, load_us / 1000. / ROUNDS,
+            load_us * 1000. / ROUNDS / (elems * sizeof(uint64_t) / 4096),
+            commit_us / 1000. / ROUNDS);
+    ap_storage_uninit();
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    DBG_SCOPE();
+    std::string ctrl = argc > 1 ? argv[1] : "data/storage_bulk_bench";
+    uint64_t max_m = argc > 2 ? std::stoull(argv[2]) : 16;
+
+    for (uint64_t m : {1, 4, 16, 64}) {
+        if (m > max_m)
+            continue;
+        for (int load : {LOAD_VECTOR, LOAD_VECTOR_BULK, LOAD_BLOCK, LOAD_BLOCK_MARKED})
+            ASSERT_FN(bench_load(ctrl, load, m << 20));
+    }
+    clear_storage(ctrl);
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "ap_storage.h"
+#include "debug.h"
+#include "time_utils.h"
+
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+/* Startup cost of ap_storage for storages of different sizes. The storage is created once for each
+size, as a single allocation that is never written, so the files are sparse and only the open path
+is measured. Then, each time in a new process, the storage is opened, 1000 random pages are
+written, committed and the storage is closed. rand() is not seeded, so each open writes the same
+pages, as a program that uses the same data at each start. pte is the memory of the page tables
+after the open.
+
+    test_ap_storage_open_bench.bin [--cold] [ctrl file, default data/storage_open_bench]
+            [max size in GB, default 16]
+
+The files take no space on disk, but the sizes must fit in the file system's limits. With --cold,
+run as root, the page cache of the whole machine is dropped before each open, so the touch and
+prefetch times are the ones of a cold start, otherwise the files are read from the cache. */
+
+#define ROUNDS      3
+#define TOUCH_PAGES 1000
+
+struct open_mode_t {
+    const char *name;
+    uint32_t flags;
+};
+
+static open_mode_t open_modes[] = {
+    { "mprotect",   0 },
+    { "uffd",       AP_STORAGE_FLAG_TRACK_UFFD },
+    { "wal",        AP_STORAGE_FLAG_WAL },
+    { "lazy",       AP_STORAGE_FLAG_LAZY },
+    { "lazy_uffd",  AP_STORAGE_FLAG_LAZY | AP_STORAGE_FLAG_TRACK_UFFD },
+    { "lazy_wal",   AP_STORAGE_FLAG_LAZY | AP_STORAGE_FLAG_WAL },
+    { "prefetch",   AP_STORAGE_FLAG_LAZY | AP_STORAGE_FLAG_PREFETCH },
+    { "checksums",  AP_STORAGE_FLAG_CHECKSUMS },
+    { "verify",     AP_STORAGE_FLAG_CHECKSUMS | AP_STORAGE_FLAG_VERIFY },
+};
+
+void ap_storage_except_cbk(void *ctx, const char *errmsg, ap_except_info_t *ei) {
+    DBG("[CRITICAL] %s\n%s", errmsg, ei->bt.c_str());
+    exit(1);
+}
+
+static void clear_storage(const std::string &ctrl) {
+    unlink(ctrl.c_str());
+    for (auto ext : {"_0.data", "_1.data", "_0.wal", "_1.wal", ".hot", "_0.crc", "_1.crc"})
+        unlink((ctrl + ext).c_str());
+}
+
+static uint64_t pte_kb() {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f)
+        return 0;
+    char line[256];
+    uint64_t kb = 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmPTE: %lu kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+static int create_storage(const std::string &ctrl, open_mode_t mode, uint64_t sz) {
+    if (ap_storage_init(ctrl.c_str(), ap_storage_except_cbk, NULL, mode.flags) < 0) {
+        DBG("%-10s skipped, not supported", mode.name);
+        return 1;
+    }
+    ap_off_t off = ap_malloc_alloc(ap_static_ctx, sz);
+    ASSERT_FN(CHK_BOOL(off));
+    ap_malloc_set_usr(ap_static_ctx, off);
+    ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+    ap_storage_uninit();
+    return 0;
+}
+
+static void drop_caches() {
+    /* only root can do this, the failure is ignored */
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0)
+        return ;
+    if (write(fd, "3", 1) < 0)
+        DBGE("Failed to drop the page cache");
+    close(fd);
+}
+
+static int open_storage(const std::string &ctrl, open_mode_t mode, uint64_t sz, bool cold) {
+    if (cold)
+        drop_caches();
+    uint64_t start = get_time_us();
+    ASSERT_FN(ap_storage_init(ctrl.c_str(), ap_storage_except_cbk, NULL, mode.flags));
+    uint64_t opened = get_time_us();
+    uint64_t pte = pte_kb();
+
+    uint8_t *data = (uint8_t *)ap_malloc_ptr(ap_static_ctx, ap_malloc_get_usr(ap_static_ctx));
+    for (int i = 0; i < TOUCH_PAGES; i++)
+        data[(rand() % (sz / 4096)) * 4096] = i;
+    uint64_t touched = get_time_us();
+    ASSERT_FN(ap_storage_do_changes(AP_STORAGE_COMMIT_CHANGES));
+    uint64_t committed = get_time_us();
+    ap_storage_uninit();
+    uint64_t closed = get_time_us();
+
+    DBG("%-10s size: %3ldGB open: %9.3fms pte: %7ldkB touch: %9.3fms commit: %9.3fms "
+            "close: %9.3fms", mode.name, sz >> 30, (opened - start) / 1000., pte,
+            (touched - opened) / 1000., (committed - touched) / 1000.,
+            (closed - committed) / 1000.);
+    return 0;
+}
+
+static int run_child(std::function<int()> fn) {
+    int pid;
+    ASSERT_FN(pid = fork());
+    if (pid == 0) {
+        int ret = fn();
+        exit(ret < 0 ? 255 : ret);
+    }
+    int status = 0;
+    ASSERT_FN(waitpid(pid, &status, 0));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 255)
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+int main(int argc, char const *argv[])
+{
+    DBG_SCOPE();
+    bool cold = argc > 1 && std::string(argv[1]) == "--cold";
+    if (cold) {
+        argc--;
+        argv++;
+    }
+    std::string ctrl = argc > 1 ? argv[1] : "data/storage_open_bench";
+    uint64_t max_gb = argc > 2 ? std::stoull(argv[2]) : 16;
+
+    for (auto mode : open_modes) {
+        for (uint64_t gb : {1, 4, 16, 64, 256}) {
+            if (gb > max_gb)
+                continue;
+            uint64_t sz = gb << 30;
+            clear_storage(ctrl);
+            int ret;
+            ASSERT_FN(ret = run_child([&]{ return create_storage(ctrl, mode, sz); }));
+            if (ret == 1)
+                break;
+            for (int r = 0; r < ROUNDS; r++)
+                ASSERT_FN(run_child([&]{ return open_storage(ctrl, mode, sz, cold); }));
+        }
+    }
+    clear_storage(ctrl);
+    return 0;
+}
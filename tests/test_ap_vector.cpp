@@ -13,7 +13,7 @@ void ap_except_cbk(const char *errmsg, ap_except_info_t *ei) {
     exit(1);
 }
 
-static int add_mem_fn(ap_sz_t sz);
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz);
 
 static uint8_t mem[TOTAL_MEM];
 static ap_ctx_t mc = {
@@ -22,7 +22,7 @@ static ap_ctx_t mc = {
 };
 
 static ap_sz_t tot_mem = INIT_MEM;
-static int add_mem_fn(ap_sz_t sz) {
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
     tot_mem += sz;
     if (tot_mem > TOTAL_MEM)
         return -1;
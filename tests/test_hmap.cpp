@@ -1,19 +1,15 @@
-#define AP_EXCEPT_STATIC_CBK
+#define AP_EXCEPT_THROW
 
 #include "ap_hashmap.h"
 #include "debug.h"
 
 #include <map>
+#include <vector>
 
 #define TOTAL_MEM   (1024*1024)
 #define INIT_MEM    (4096)
 
-void ap_except_cbk(const char *errmsg, ap_except_info_t *ei) {
-    DBG("[CRITICAL] %s\n%s", errmsg, ei->bt.c_str());
-    exit(1);
-}
-
-static int add_mem_fn(ap_sz_t sz);
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz);
 
 static uint8_t mem[TOTAL_MEM];
 static ap_ctx_t mc = {
@@ -22,7 +18,7 @@ static ap_ctx_t mc = {
 };
 
 static ap_sz_t tot_mem = INIT_MEM;
-static int add_mem_fn(ap_sz_t sz) {
+static int add_mem_fn(ap_ctx_t *ctx, ap_sz_t sz) {
     tot_mem += sz;
     if (tot_mem > TOTAL_MEM)
         return -1;
@@ -48,6 +44,58 @@ static void ap_free(void *p) {
     ap_malloc_free(ctx, off);
 }
 
+/* the map, it's buckets and it's nodes are mixed with fillers that are freed, after the compaction
+the map must still find all it's elements */
+using chmap_t = ap_hashmap_t<int, int>;
+static ap_off_t chmap_off;
+
+static void chmap_reloc_fn(ap_ctx_t *ctx, const ap_malloc_reloc_table_t *table, void *usr) {
+    chmap_off = ap_malloc_reloc_off(table, chmap_off);
+    ((chmap_t *)ap_malloc_ptr(ctx, chmap_off))->reloc(table);
+}
+
+static int test_compact() {
+    ap_ctx_t *ctx = &mc;
+    chmap_off = ap_malloc_alloc(ctx, sizeof(chmap_t));
+    ASSERT_FN(((chmap_t *)ap_malloc_ptr(ctx, chmap_off))->init(ctx));
+    std::vector<ap_off_t> fillers;
+    for (int i = 0; i < 2000; i++) {
+        auto hmap = (chmap_t *)ap_malloc_ptr(ctx, chmap_off);
+        auto n = hmap->alloc_hnode();
+        hmap->deref_hnode(n)->key = i;
+        hmap->deref_hnode(n)->val = i * 3;
+        hmap->insert(n);
+        fillers.push_back(ap_malloc_alloc(ctx, 100 + i % 300));
+    }
+    for (auto off : fillers)
+        ap_malloc_free(ctx, off);
+
+    while (ap_malloc_compact(ctx, chmap_reloc_fn, NULL, 0) == 0)
+        ;
+    ASSERT_FN(ap_malloc_validate(ctx));
+
+    auto &hmap = *(chmap_t *)ap_malloc_ptr(ctx, chmap_off);
+    for (int i = 0; i < 2000; i++) {
+        ap_off_t n = hmap.find(i);
+        if (!n || hmap.deref_hnode(n)->val != i * 3) {
+            DBG("hashmap was not relocated correctly at %d", i);
+            return -1;
+        }
+    }
+    static int cnt;
+    cnt = 0;
+    hmap.iter(NULL, [](chmap_t::hmap_node_t *, void *) { cnt++; });
+    if (cnt != 2000) {
+        DBG("hashmap lost elements: %d", cnt);
+        return -1;
+    }
+    for (int i = 0; i < 2000; i++)
+        hmap.free_hnode(hmap.erase(i));
+    hmap.uninit();
+    ap_malloc_free(ctx, chmap_off);
+    return 0;
+}
+
 int main(int argc, char const *argv[])
 {
     DBG_SCOPE();
@@ -92,5 +140,7 @@ int main(int argc, char const *argv[])
 
     ap_free(&hmap);
 
+    ASSERT_FN(test_compact());
+
     return 0;
 }
\ No newline at end of file